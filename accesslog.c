@@ -0,0 +1,221 @@
+#include "./inc/accesslog.h"
+
+static const char *log_path;
+static int log_fd = -1;
+static int enabled;
+static volatile sig_atomic_t reopen;
+static logring_t *rings;
+static __thread logring_t *ring_self;
+// only the logger thread touches these
+static char lines[LOG_BATCH][LOG_LINE_MAX];
+static struct iovec iov[LOG_BATCH];
+
+static void on_hup(int sig) {
+    (void)sig;
+    reopen = 1;
+}
+
+static int open_log(void) {
+    return open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+// a rotated log gets a fresh file; if that fails, keep writing the old one
+static void reopen_log(void) {
+    int fd;
+    reopen = 0;
+    if ((fd = open_log()) < 0) {
+        perror("reopen access log");
+        return;
+    }
+    close(log_fd);
+    log_fd = fd;
+}
+
+// write out n lines, resuming after short writes
+static void flush_lines(int n) {
+    struct iovec *vp = iov;
+    ssize_t done;
+    while(n > 0) {
+        if ((done = writev(log_fd, vp, n)) < 0) {
+            if (errno == EINTR) continue;
+            perror("write access log");
+            return;
+        }
+        while(n > 0 && (size_t)done >= vp->iov_len) {
+            done -= vp->iov_len;
+            vp++;
+            n--;
+        }
+        if (n > 0) {
+            vp->iov_base = (char *)vp->iov_base + done;
+            vp->iov_len -= done;
+        }
+    }
+}
+
+static size_t put_char(char *buf, size_t len, size_t cap, char c) {
+    if (len < cap) buf[len++] = c;
+    return len;
+}
+
+// quoted fields are escaped like nginx does: \" \\ and \xHH for the rest.
+// Stops short of cap, truncating the field rather than overrunning buf.
+static size_t put_escaped(char *buf, size_t len, size_t cap, const char *s) {
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char c;
+    if (!*s) return put_char(buf, len, cap, '-');
+    for(; (c = (unsigned char)*s) != 0; s++) {
+        if (c == '"' || c == '\\') {
+            if (cap - len < 2) break;
+            buf[len++] = '\\';
+            buf[len++] = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            if (cap - len < 4) break;
+            buf[len++] = '\\';
+            buf[len++] = 'x';
+            buf[len++] = hex[c >> 4];
+            buf[len++] = hex[c & 15];
+        } else {
+            if (cap - len < 1) break;
+            buf[len++] = c;
+        }
+    }
+    return len;
+}
+
+// combined log format, one line of at most LOG_LINE_MAX bytes
+static size_t format_record(char *buf, logrec_t *rec) {
+    static time_t last = -1;
+    static char stamp[32];
+    char addr[INET_ADDRSTRLEN];
+    struct tm tm;
+    // the newline always fits
+    size_t len, cap = LOG_LINE_MAX - 1;
+    int n;
+    if (rec->time != last) {
+        gmtime_r(&rec->time, &tm);
+        strftime(stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        last = rec->time;
+    }
+    inet_ntop(AF_INET, &rec->addr, addr, sizeof(addr));
+    len = snprintf(buf, cap, "%s - - [%s] \"", addr, stamp);
+    if (rec->method[0]) {
+        len = put_escaped(buf, len, cap, rec->method);
+        len = put_char(buf, len, cap, ' ');
+        len = put_escaped(buf, len, cap, rec->uri);
+        len = put_char(buf, len, cap, ' ');
+        len = put_escaped(buf, len, cap, rec->version);
+    } else {
+        // head never parsed
+        len = put_char(buf, len, cap, '-');
+    }
+    n = snprintf(buf + len, cap - len + 1, rec->bytes ? "\" %d %zu \"" : "\" %d - \"", rec->status, rec->bytes);
+    // snprintf counts what didn't fit too
+    len = n < 0 ? len : (size_t)n > cap - len ? cap : len + n;
+    len = put_escaped(buf, len, cap, rec->referer);
+    len = put_char(buf, len, cap, '"');
+    len = put_char(buf, len, cap, ' ');
+    len = put_char(buf, len, cap, '"');
+    len = put_escaped(buf, len, cap, rec->agent);
+    len = put_char(buf, len, cap, '"');
+    buf[len++] = '\n';
+    return len;
+}
+
+// Write out what every ring holds, LOG_BATCH lines per writev. Returns the count.
+static size_t drain(void) {
+    logring_t *rp;
+    size_t head, tail, total = 0;
+    int n = 0;
+    for(rp = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); rp; rp = rp->next) {
+        head = rp->head;
+        tail = __atomic_load_n(&rp->tail, __ATOMIC_ACQUIRE);
+        total += tail - head;
+        for(; head != tail; head++) {
+            iov[n].iov_base = lines[n];
+            iov[n].iov_len = format_record(lines[n], &rp->recs[head & (LOG_RING_SIZE - 1)]);
+            if (++n == LOG_BATCH) {
+                flush_lines(n);
+                n = 0;
+            }
+            // formatted, so the slot may be refilled
+            __atomic_store_n(&rp->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (n) flush_lines(n);
+    return total;
+}
+
+static void *logger(void *arg) {
+    sigset_t set;
+    (void)arg;
+    // the one thread SIGHUP is delivered to
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    while(1) {
+        if (reopen) reopen_log();
+        if (drain() == 0) usleep(LOG_IDLE_US);
+    }
+    return NULL;
+}
+
+// Start logging accesses to path, reopened on SIGHUP. Must run before any
+// other thread is created, they all inherit SIGHUP blocked from here.
+void accesslog_open(const char *path) {
+    struct sigaction sa;
+    sigset_t set;
+    pthread_t tid;
+    log_path = path;
+    if ((log_fd = open_log()) < 0) fatal_exit(1, "Failed open access log");
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_hup;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    enabled = 1;
+    if (pthread_create(&tid, NULL, logger, NULL) != 0) fatal_exit(3, "Failed create logger thread");
+    pthread_detach(tid);
+}
+
+int accesslog_enabled(void) {
+    return enabled;
+}
+
+static logring_t *ring_register(void) {
+    logring_t *rp = (logring_t *)aligned_alloc(METRICS_LINE, sizeof(logring_t));
+    if (!rp) fatal_exit(1, "Failed allocate log ring");
+    rp->head = rp->tail = 0;
+    rp->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&rings, &rp->next, rp, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return ring_self = rp;
+}
+
+// The calling thread's next free record, NULL when logging is off or the
+// ring is full. A full ring drops the record rather than wait for the logger.
+logrec_t *accesslog_reserve(void) {
+    logring_t *rp = ring_self;
+    if (!enabled) return NULL;
+    if (!rp) rp = ring_register();
+    if (rp->tail - __atomic_load_n(&rp->head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        METRIC_ADD(log_dropped, 1);
+        return NULL;
+    }
+    return &rp->recs[rp->tail & (LOG_RING_SIZE - 1)];
+}
+
+// Hand the reserved record over to the logger
+void accesslog_commit(void) {
+    __atomic_store_n(&ring_self->tail, ring_self->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Copy n bytes of s into a record field of size cap, truncating
+void accesslog_field(char *dst, size_t cap, const char *s, size_t n) {
+    if (!s) n = 0;
+    if (n >= cap) n = cap - 1;
+    if (n) memcpy(dst, s, n);
+    dst[n] = 0;
+}
@@ -0,0 +1,57 @@
+#include "./inc/arena.h"
+
+void arena_init(arena_t *ap) {
+    ap->first = ap->curr = NULL;
+    ap->used = 0;
+}
+
+static chunk_t *chunk_new(size_t size) {
+    chunk_t *chunk = (chunk_t *)malloc(sizeof(chunk_t) + size);
+    if (!chunk) fatal_exit(1, "Failed allocate arena chunk");
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}
+
+void *arena_alloc(arena_t *ap, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!ap->curr) {
+        ap->first = ap->curr = chunk_new(n > ARENA_CHUNK ? n : ARENA_CHUNK);
+        ap->used = 0;
+    }
+    // move on through chunks kept from earlier requests before growing
+    while(ap->used + n > ap->curr->size) {
+        if (!ap->curr->next) ap->curr->next = chunk_new(n > ARENA_CHUNK ? n : ARENA_CHUNK);
+        ap->curr = ap->curr->next;
+        ap->used = 0;
+    }
+    ap->used += n;
+    return ap->curr->data + ap->used - n;
+}
+
+char *arena_strndup(arena_t *ap, const char *s, size_t len) {
+    char *p = (char *)arena_alloc(ap, len + 1);
+    memcpy(p, s, len);
+    p[len] = 0;
+    return p;
+}
+
+char *arena_strdup(arena_t *ap, const char *s) {
+    return arena_strndup(ap, s, strlen(s));
+}
+
+// drop everything allocated, keeping the chunks
+void arena_reset(arena_t *ap) {
+    ap->curr = ap->first;
+    ap->used = 0;
+}
+
+void arena_free(arena_t *ap) {
+    chunk_t *chunk = ap->first, *next;
+    while(chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(ap);
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# End to end benchmark: serve a scratch copy of public/ plus generated large
+# files with ./cerver on loopback and drive it with bench/loadgen through a
+# few scenarios. Every run appends one JSON line per scenario to $OUT,
+# labelled with the commit and engine, so runs can be compared.
+#
+# Knobs, from the environment: ENGINE THREADS ARGS (extra server flags),
+# LOADERS CONNS SECS RATE (open loop requests/s), PORT OUT
+set -e
+cd "$(dirname "$0")/.."
+ROOT=$(pwd)
+ENGINE=${ENGINE:-epoll}
+THREADS=${THREADS:-2}
+ARGS=${ARGS:-}
+LOADERS=${LOADERS:-2}
+CONNS=${CONNS:-64}
+SECS=${SECS:-5}
+RATE=${RATE:-5000}
+PORT=${PORT:-18480}
+OUT=${OUT:-bench/results.json}
+REV=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+# mostly small static assets, some misses, a few large files
+MIX="/public/index.html:40 /public/home.css:20 /public/math.js:20 /public/math.html:10 /missing:5 /1m.bin:4 /16m.bin:1"
+
+WWW=$(mktemp -d)
+PID=
+trap '[ -n "$PID" ] && kill $PID; rm -rf "$WWW"' EXIT
+trap 'exit 1' INT TERM
+cp -r public "$WWW/"
+head -c 1048576 /dev/urandom > "$WWW/1m.bin"
+head -c 16777216 /dev/urandom > "$WWW/16m.bin"
+(cd "$WWW" && exec "$ROOT/cerver" -e "$ENGINE" -t "$THREADS" $ARGS "$PORT" > /dev/null) &
+PID=$!
+sleep 0.5
+
+run() {
+  name=$1
+  shift
+  bench/loadgen -p "$PORT" -t "$LOADERS" -d "$SECS" -l "$REV $ENGINE $name" -o "$OUT" "$@"
+}
+
+run keepalive -c "$CONNS" $MIX
+run small -c "$CONNS" /public/index.html
+run per-request -n -c "$CONNS" $MIX
+run open-loop -c "$CONNS" -R "$RATE" $MIX
+echo "results appended to $OUT"
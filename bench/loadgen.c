@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// HTTP load generator for the end to end benchmarks (make bench).
+// Closed loop: every connection sends its next request as soon as the
+// last answer is in. Open loop (-R): requests are due on a fixed schedule
+// whether or not the server keeps up, and latency counts from when one
+// was due rather than sent, so a stalled server cannot hide its backlog
+// (coordinated omission). Closed loop runs are corrected after the fact
+// instead, backfilling the requests a stall held back.
+
+#define MAX_TARGETS 64
+#define MAX_EVENTS 256
+#define RES_BUF_MAX 16384
+// log-linear latency buckets, every power of 2 split in 2^SUB_BITS: ~3% error
+#define SUB_BITS 5
+#define SUB (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) << SUB_BITS)
+
+#define C_IDLE 0        // nothing in flight, open loop waits for the schedule
+#define C_CONNECT 1
+#define C_SEND 2
+#define C_RECV 3
+
+typedef struct {
+  char *path;
+  int weight;
+  char *req;            // rendered request, keep-alive or not
+  size_t reqlen;
+} target_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[BUCKETS];
+} hist_t;
+
+typedef struct {
+  int fd;
+  int state;
+  target_t *target;
+  size_t sent;
+  uint64_t start;       // when the request in flight was due (open) or issued (closed)
+  uint64_t due;         // open loop: when the next request is due
+  int head;             // response head parsed
+  int status;
+  int close;            // server closes after this response
+  long left;            // body bytes still to read
+  size_t buflen;
+  char buf[RES_BUF_MAX];
+} lconn_t;
+
+typedef struct {
+  int id;
+  pthread_t tid;
+  int epfd;
+  int nconns;
+  lconn_t *conns;
+  uint64_t seed;
+  uint64_t requests;
+  uint64_t bytes;
+  uint64_t errors;
+  uint64_t status[6];   // by class, 0 unused
+  hist_t hist;
+} worker_t;
+
+static struct sockaddr_in addr;
+static target_t targets[MAX_TARGETS];
+static int ntargets, total_weight;
+static int keepalive = 1;
+static double rate;             // requests/s over all connections, 0 closed loop
+static uint64_t interval;       // ns between requests on one connection, open loop
+static volatile int recording, stopping;
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-a addr] [-p port] [-t threads] [-c conns] [-d secs] [-w warmup_secs] "
+          "[-R rate] [-n] [-z] [-l label] [-o out.json] path[:weight]...\n", prog);
+  exit(1);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rnd(worker_t *wp) {
+  wp->seed ^= wp->seed << 13;
+  wp->seed ^= wp->seed >> 7;
+  wp->seed ^= wp->seed << 17;
+  return wp->seed;
+}
+
+static int bucket(uint64_t v) {
+  int msb = 63 - __builtin_clzll(v | 1);
+  if (msb < SUB_BITS) return (int)v;
+  return ((msb - SUB_BITS + 1) << SUB_BITS) + (int)((v >> (msb - SUB_BITS)) & (SUB - 1));
+}
+
+// highest value that falls in bucket i
+static uint64_t bucket_top(int i) {
+  int msb;
+  if (i < SUB) return i;
+  msb = (i >> SUB_BITS) + SUB_BITS - 1;
+  return (((uint64_t)(SUB | (i & (SUB - 1))) + 1) << (msb - SUB_BITS)) - 1;
+}
+
+static void hist_add(hist_t *hp, uint64_t v, uint64_t n) {
+  hp->buckets[bucket(v)] += n;
+  hp->count += n;
+  hp->sum += v * n;
+  if (v > hp->max) hp->max = v;
+}
+
+static uint64_t hist_quantile(hist_t *hp, double q) {
+  uint64_t rank = (uint64_t)(q * hp->count + 0.5), seen = 0;
+  int i;
+  if (rank == 0) rank = 1;
+  for(i = 0; i < BUCKETS; i++) {
+    if ((seen += hp->buckets[i]) >= rank) return bucket_top(i) < hp->max ? bucket_top(i) : hp->max;
+  }
+  return hp->max;
+}
+
+// A closed loop connection stuck behind a slow answer would have sent a
+// request every `expected` ns meanwhile. Add those, each waiting that much
+// less, like HdrHistogram's copyCorrectedForCoordinatedOmission.
+static void hist_correct(hist_t *dst, hist_t *src, uint64_t expected) {
+  uint64_t v, missing;
+  int i;
+  *dst = *src;
+  if (!expected) return;
+  for(i = 0; i < BUCKETS; i++) {
+    if (!src->buckets[i] || (v = bucket_top(i)) <= expected) continue;
+    for(missing = v - expected; missing >= expected; missing -= expected) hist_add(dst, missing, src->buckets[i]);
+  }
+}
+
+static target_t *pick(worker_t *wp) {
+  int r = (int)(rnd(wp) % total_weight), i;
+  for(i = 0; i < ntargets - 1; i++) {
+    if ((r -= targets[i].weight) < 0) break;
+  }
+  return &targets[i];
+}
+
+static void conn_reset(worker_t *wp, lconn_t *cp) {
+  if (cp->fd >= 0) {
+    epoll_ctl(wp->epfd, EPOLL_CTL_DEL, cp->fd, NULL);
+    close(cp->fd);
+  }
+  cp->fd = -1;
+  cp->state = C_IDLE;
+}
+
+static int conn_open(worker_t *wp, lconn_t *cp) {
+  struct epoll_event ev;
+  int one = 1;
+  if ((cp->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) return -1;
+  setsockopt(cp->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(cp->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+    close(cp->fd);
+    cp->fd = -1;
+    return -1;
+  }
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = cp;
+  epoll_ctl(wp->epfd, EPOLL_CTL_ADD, cp->fd, &ev);
+  cp->state = C_CONNECT;
+  return 0;
+}
+
+static void progress(worker_t *wp, lconn_t *cp);
+
+// Start a request due at start, connecting first when there is no connection
+static void issue(worker_t *wp, lconn_t *cp, uint64_t start) {
+  cp->target = pick(wp);
+  cp->start = start;
+  cp->sent = 0;
+  cp->head = 0;
+  cp->buflen = 0;
+  if (cp->fd < 0) {
+    if (conn_open(wp, cp) < 0) {
+      if (recording) wp->errors++;
+      return;
+    }
+  } else {
+    cp->state = C_SEND;
+  }
+  progress(wp, cp);
+}
+
+static void failed(worker_t *wp, lconn_t *cp) {
+  if (recording) wp->errors++;
+  conn_reset(wp, cp);
+}
+
+// One response is complete: record it and move on to the next request
+static void completed(worker_t *wp, lconn_t *cp) {
+  uint64_t now = now_ns();
+  if (recording) {
+    wp->requests++;
+    wp->status[cp->status / 100 < 6 ? cp->status / 100 : 0]++;
+    hist_add(&wp->hist, now - cp->start, 1);
+  }
+  if (cp->close || !keepalive) conn_reset(wp, cp);
+  cp->state = C_IDLE;
+  if (stopping) return;
+  if (!interval) {
+    issue(wp, cp, now);
+  } else if (now >= cp->due) {
+    // behind schedule: the next one is already late, and counted as such
+    issue(wp, cp, cp->due);
+    cp->due += interval;
+  }
+}
+
+// parse a complete response head in buf, returns its length or 0 when incomplete, -1 when broken
+static long parse_head(lconn_t *cp) {
+  char *end, *line, *next, *value;
+  long length = -1;
+  if ((end = memmem(cp->buf, cp->buflen, "\r\n\r\n", 4)) == NULL) return cp->buflen >= RES_BUF_MAX ? -1 : 0;
+  *end = 0;
+  if (sscanf(cp->buf, "HTTP/1.%*d %d", &cp->status) != 1) return -1;
+  cp->close = 0;
+  for(line = strstr(cp->buf, "\r\n"); line; line = next) {
+    line += 2;
+    next = strstr(line, "\r\n");
+    if (next) *next = 0;
+    if ((value = strchr(line, ':')) == NULL) continue;
+    for(*value++ = 0; *value == ' '; value++);
+    if (strcasecmp(line, "Content-Length") == 0) length = atol(value);
+    else if (strcasecmp(line, "Connection") == 0 && strcasecmp(value, "close") == 0) cp->close = 1;
+  }
+  // bodiless answers
+  if (length < 0) length = cp->status == 204 || cp->status == 304 ? 0 : -1;
+  if (length < 0) return -1;
+  cp->left = length;
+  return end + 4 - cp->buf;
+}
+
+// Push the connection as far as it goes without blocking
+static void progress(worker_t *wp, lconn_t *cp) {
+  ssize_t n;
+  long headlen;
+  int err;
+  socklen_t len = sizeof(err);
+  if (cp->state == C_CONNECT) {
+    if (getsockopt(cp->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err == EINPROGRESS) return;
+    if (err) {
+      failed(wp, cp);
+      return;
+    }
+    cp->state = C_SEND;
+  }
+  if (cp->state == C_SEND) {
+    while(cp->sent < cp->target->reqlen) {
+      if ((n = send(cp->fd, cp->target->req + cp->sent, cp->target->reqlen - cp->sent, MSG_NOSIGNAL)) < 0) {
+        if (errno == EAGAIN || errno == ENOTCONN) return;
+        failed(wp, cp);
+        return;
+      }
+      cp->sent += n;
+    }
+    cp->state = C_RECV;
+  }
+  while(cp->state == C_RECV) {
+    if (!cp->head) {
+      n = recv(cp->fd, cp->buf + cp->buflen, RES_BUF_MAX - cp->buflen, 0);
+    } else {
+      n = recv(cp->fd, cp->buf, cp->left < RES_BUF_MAX ? (size_t)cp->left : RES_BUF_MAX, 0);
+    }
+    if (n <= 0) {
+      if (n < 0 && errno == EAGAIN) return;
+      failed(wp, cp);
+      return;
+    }
+    if (recording) wp->bytes += n;
+    if (!cp->head) {
+      cp->buflen += n;
+      if ((headlen = parse_head(cp)) < 0) {
+        failed(wp, cp);
+        return;
+      }
+      if (!headlen) continue;
+      cp->head = 1;
+      n = cp->buflen - headlen;
+    }
+    if ((cp->left -= n) <= 0) completed(wp, cp);
+  }
+}
+
+// open loop: send whatever fell due, returns ms until the next one is
+static int due(worker_t *wp) {
+  uint64_t now = now_ns(), next = UINT64_MAX;
+  lconn_t *cp;
+  int i;
+  for(i = 0; i < wp->nconns; i++) {
+    cp = &wp->conns[i];
+    if (cp->state == C_IDLE && cp->due <= now) {
+      issue(wp, cp, cp->due);
+      cp->due += interval;
+    }
+    if (cp->state == C_IDLE && cp->due < next) next = cp->due;
+  }
+  if (next == UINT64_MAX) return 1;
+  return next > now ? (int)((next - now + 999999) / 1000000) : 0;
+}
+
+static void *work(void *arg) {
+  worker_t *wp = (worker_t *)arg;
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t start = now_ns();
+  int i, n, timeout = -1;
+  if ((wp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) return NULL;
+  for(i = 0; i < wp->nconns; i++) {
+    wp->conns[i].fd = -1;
+    wp->conns[i].state = C_IDLE;
+    // spread each connection's schedule over one interval
+    wp->conns[i].due = start + (interval ? rnd(wp) % interval : 0);
+    if (!interval) issue(wp, &wp->conns[i], start);
+  }
+  while(!stopping) {
+    if (interval) timeout = due(wp);
+    else timeout = 100;
+    n = epoll_wait(wp->epfd, events, MAX_EVENTS, timeout);
+    for(i = 0; i < n; i++) progress(wp, (lconn_t *)events[i].data.ptr);
+    // closed loop connections that failed to connect try again once things calm down
+    if (!interval && n == 0) {
+      for(i = 0; i < wp->nconns; i++) {
+        if (wp->conns[i].state == C_IDLE && wp->conns[i].fd < 0) issue(wp, &wp->conns[i], now_ns());
+      }
+    }
+  }
+  for(i = 0; i < wp->nconns; i++) conn_reset(wp, &wp->conns[i]);
+  return NULL;
+}
+
+static void add_target(char *arg, const char *host, int gzip) {
+  target_t *tp;
+  char *colon = strrchr(arg, ':');
+  char req[1024];
+  int len;
+  if (ntargets == MAX_TARGETS) return;
+  tp = &targets[ntargets++];
+  tp->weight = 1;
+  if (colon) {
+    *colon = 0;
+    tp->weight = atoi(colon + 1) > 0 ? atoi(colon + 1) : 1;
+  }
+  tp->path = arg;
+  total_weight += tp->weight;
+  len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: cerver-loadgen\r\n%s%s\r\n",
+                 tp->path, host, gzip ? "Accept-Encoding: gzip\r\n" : "", keepalive ? "" : "Connection: close\r\n");
+  tp->req = strndup(req, len);
+  tp->reqlen = len;
+}
+
+static void print_json(FILE *fp, const char *label, int nthreads, int nconns, double secs,
+                       worker_t *total, hist_t *corrected) {
+  static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+  static const char *names[] = { "p50", "p90", "p99", "p999" };
+  int i;
+  fprintf(fp, "{\"label\":\"%s\",\"time\":%ld,\"mode\":\"%s\",\"keepalive\":%s,\"threads\":%d,\"conns\":%d,"
+          "\"rate\":%.0f,\"secs\":%.3f,\"requests\":%lu,\"rps\":%.1f,\"bytes\":%lu,\"mbps\":%.2f,\"errors\":%lu,",
+          label, (long)time(NULL), interval ? "open" : "closed", keepalive ? "true" : "false", nthreads, nconns,
+          rate, secs, total->requests, total->requests / secs, total->bytes, total->bytes / secs / 1e6, total->errors);
+  fprintf(fp, "\"status\":{\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu},\"latency_ns\":{\"mean\":%lu,\"max\":%lu",
+          total->status[2], total->status[3], total->status[4], total->status[5],
+          total->hist.count ? total->hist.sum / total->hist.count : 0, total->hist.max);
+  for(i = 0; i < 4; i++) fprintf(fp, ",\"%s\":%lu", names[i], hist_quantile(&total->hist, qs[i]));
+  fprintf(fp, "},\"corrected_ns\":{\"max\":%lu", corrected->max);
+  for(i = 0; i < 4; i++) fprintf(fp, ",\"%s\":%lu", names[i], hist_quantile(corrected, qs[i]));
+  fprintf(fp, "}}\n");
+}
+
+int main(int argc, char **argv) {
+  const char *host = "127.0.0.1", *label = "", *out = NULL;
+  int port = 8080, nthreads = 2, nconns = 32, secs = 10, warmup = 1, gzip = 0, opt, i, j;
+  worker_t *workers, total;
+  hist_t *corrected;
+  uint64_t t0, t1;
+  FILE *fp;
+  while((opt = getopt(argc, argv, "a:p:t:c:d:w:R:nzl:o:")) != -1) {
+    switch(opt) {
+      case 'a':
+        host = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 't':
+        nthreads = atoi(optarg);
+        break;
+      case 'c':
+        nconns = atoi(optarg);
+        break;
+      case 'd':
+        secs = atoi(optarg);
+        break;
+      case 'w':
+        warmup = atoi(optarg);
+        break;
+      case 'R':
+        rate = atof(optarg);
+        break;
+      case 'n':
+        keepalive = 0;
+        break;
+      case 'z':
+        gzip = 1;
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      case 'o':
+        out = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind == argc || nthreads <= 0 || nconns < nthreads || secs <= 0) usage(argv[0]);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) usage(argv[0]);
+  for(i = optind; i < argc; i++) add_target(argv[i], host, gzip);
+  if (rate > 0) interval = (uint64_t)(1e9 * nconns / rate);
+
+  if ((workers = (worker_t *)calloc(nthreads, sizeof(worker_t))) == NULL) return 1;
+  for(i = 0; i < nthreads; i++) {
+    workers[i].id = i;
+    workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+    workers[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+    if ((workers[i].conns = (lconn_t *)calloc(workers[i].nconns, sizeof(lconn_t))) == NULL) return 1;
+    if (pthread_create(&workers[i].tid, NULL, work, &workers[i]) != 0) return 1;
+  }
+  sleep(warmup);
+  recording = 1;
+  t0 = now_ns();
+  sleep(secs);
+  recording = 0;
+  t1 = now_ns();
+  stopping = 1;
+  memset(&total, 0, sizeof(total));
+  for(i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].tid, NULL);
+    total.requests += workers[i].requests;
+    total.bytes += workers[i].bytes;
+    total.errors += workers[i].errors;
+    for(j = 0; j < 6; j++) total.status[j] += workers[i].status[j];
+    for(j = 0; j < BUCKETS; j++) total.hist.buckets[j] += workers[i].hist.buckets[j];
+    total.hist.count += workers[i].hist.count;
+    total.hist.sum += workers[i].hist.sum;
+    if (workers[i].hist.max > total.hist.max) total.hist.max = workers[i].hist.max;
+  }
+  // open loop latencies already count from the schedule
+  if ((corrected = (hist_t *)malloc(sizeof(hist_t))) == NULL) return 1;
+  hist_correct(corrected, &total.hist, interval || !total.hist.count ? 0 : total.hist.sum / total.hist.count);
+
+  printf("%s%s%s, %s loop, %d threads, %d connections%s\n", label, *label ? ": " : "", keepalive ? "keep-alive" : "connection per request",
+         interval ? "open" : "closed", nthreads, nconns, interval ? "" : " (latency corrected for coordinated omission in brackets)");
+  printf("  %lu requests in %.2fs, %.1f req/s, %.2f MB/s, %lu errors, %lu non-2xx/3xx\n",
+         total.requests, (t1 - t0) / 1e9, total.requests / ((t1 - t0) / 1e9), total.bytes / ((t1 - t0) / 1e9) / 1e6,
+         total.errors, total.status[0] + total.status[1] + total.status[4] + total.status[5]);
+  printf("  latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+         hist_quantile(&total.hist, 0.5) / 1e3, hist_quantile(&total.hist, 0.9) / 1e3, hist_quantile(&total.hist, 0.99) / 1e3,
+         hist_quantile(&total.hist, 0.999) / 1e3, total.hist.max / 1e3);
+  if (!interval) {
+    printf("            [p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f]\n",
+           hist_quantile(corrected, 0.5) / 1e3, hist_quantile(corrected, 0.9) / 1e3, hist_quantile(corrected, 0.99) / 1e3,
+           hist_quantile(corrected, 0.999) / 1e3);
+  }
+  if (out) {
+    if ((fp = fopen(out, "a")) == NULL) {
+      perror(out);
+      return 1;
+    }
+    print_json(fp, label, nthreads, nconns, (t1 - t0) / 1e9, &total, corrected);
+    fclose(fp);
+  }
+  return 0;
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "../inc/conn.h"
+#include "../inc/sbuf.h"
+
+// Component microbenchmarks (make microbench), linked against the
+// server's own objects. Each one runs until it fills BENCH_TIME_NS and
+// reports ns/op and heap allocations/op; with -b the results are set
+// against a baseline file and regressions are marked.
+
+#define BENCH_TIME_NS 300000000ULL
+#define BENCH_MAX_N 1000000000L
+#define REGRESS_PCT 20          // ns/op this much over baseline is flagged
+#define SBUF_SIZE 1024
+#define MAX_BASELINE 64
+
+char *__libc_malloc(size_t);
+char *__libc_calloc(size_t, size_t);
+char *__libc_realloc(void *, size_t);
+char *__libc_memalign(size_t, size_t);
+
+// every heap allocation in the process, counted on the way to glibc's allocator
+static uint64_t allocs;
+
+void *malloc(size_t n) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(p, n);
+}
+
+void *aligned_alloc(size_t align, size_t n) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_memalign(align, n);
+}
+
+int posix_memalign(void **p, size_t align, size_t n) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return (*p = __libc_memalign(align, n)) ? 0 : ENOMEM;
+}
+
+typedef struct Bench {
+  const char *name;
+  long (*fn)(struct Bench *, long);   // runs about n ops, returns how many it did
+  int producers, consumers;           // sbuf only
+  size_t bytes;                       // input bytes over the ops done, if meaningful
+} bench_t;
+
+typedef struct {
+  char name[32];
+  double ns;
+  double allocs;
+} baseline_t;
+
+// Request heads as browsers, tools and proxies send them
+static const char *corpus[] = {
+  "GET /public/index.html HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+  "sec-ch-ua-mobile: ?0\r\n"
+  "sec-ch-ua-platform: \"Linux\"\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Sec-Fetch-Site: none\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Sec-Fetch-Dest: document\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "If-None-Match: \"ce8025-3f-6ad434ea\"\r\n"
+  "\r\n",
+  "GET /public/home.css HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+  "Accept: text/css,*/*;q=0.1\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Referer: http://localhost:8080/public/index.html\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n",
+  "GET /public/math.js?v=3 HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: curl/8.5.0\r\n"
+  "Accept: */*\r\n"
+  "\r\n",
+  "GET http://localhost:8080/big.bin HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "Range: bytes=0-1023\r\n"
+  "Via: 1.1 proxy\r\n"
+  "X-Forwarded-For: 10.0.0.7\r\n"
+  "\r\n",
+};
+#define CORPUS_LEN (sizeof(corpus) / sizeof(corpus[0]))
+
+static const char *exts[] = { "html", "css", "js", "png", "jpg", "svg", "woff2", "json", "txt", "nope" };
+static char *methods[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "BREW" };
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void pair(int *sv) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) fatal_exit(1, "Failed socketpair");
+}
+
+// rio_readline, one line per op, over the corpus written into a socketpair
+static long bench_readline(bench_t *b, long n) {
+  static char text[8192];
+  static size_t textlen;
+  static rio_t rio;
+  char line[1024];
+  long done = 0;
+  size_t i, got;
+  ssize_t len;
+  int sv[2];
+  if (!textlen) {
+    for(i = 0; i < CORPUS_LEN; i++) textlen += snprintf(text + textlen, sizeof(text) - textlen, "%s", corpus[i]);
+  }
+  pair(sv);
+  rio_init(&rio, sv[0]);
+  b->bytes = 0;
+  while(done < n) {
+    if (rio_writen(sv[1], text, textlen) < 0) fatal_exit(1, "Failed write corpus");
+    for(got = 0; got < textlen; got += len, done++) {
+      if ((len = rio_readline(&rio, line, sizeof(line))) <= 0) fatal_exit(1, "Failed read corpus");
+    }
+    b->bytes += textlen;
+  }
+  close(sv[0]);
+  close(sv[1]);
+  return done;
+}
+
+// parse_head, read_startline, read_request_headers and parse_location, one request per op
+static long bench_parse(bench_t *b, long n) {
+  static char head[4096];
+  size_t lens[CORPUS_LEN];
+  parser_t parser;
+  arena_t arena;
+  req_t req;
+  res_t res;
+  long i;
+  size_t k;
+  for(k = 0; k < CORPUS_LEN; k++) lens[k] = strlen(corpus[k]);
+  arena_init(&arena);
+  b->bytes = 0;
+  for(i = 0; i < n; i++) {
+    k = i % CORPUS_LEN;
+    // both write into the head, a fresh copy every time
+    memcpy(head, corpus[k], lens[k]);
+    parser_init(&parser);
+    req_init(&req, &arena);
+    res_init(&res, &arena);
+    if (parse_head(&parser, head, lens[k]) != PARSE_DONE ||
+        read_startline(&parser, head, &req, &res) != OK || read_request_headers(&parser, head, &req) != OK) {
+      fatal_exit(1, "Failed parse corpus");
+    }
+    arena_reset(&arena);
+    b->bytes += lens[k];
+  }
+  arena_free(&arena);
+  return n;
+}
+
+static long bench_mime(bench_t *b, long n) {
+  long i, hits = 0;
+  (void)b;
+  for(i = 0; i < n; i++) hits += get_mime(exts[i % (sizeof(exts) / sizeof(exts[0]))]) != NULL;
+  return hits >= 0 ? n : 0;
+}
+
+static long bench_method(bench_t *b, long n) {
+  long i, hits = 0;
+  (void)b;
+  for(i = 0; i < n; i++) hits += check_method(methods[i % (sizeof(methods) / sizeof(methods[0]))]) == OK;
+  return hits >= 0 ? n : 0;
+}
+
+// httpsend for a typical cached asset, status line and headers serialized
+// into conn->out with the body copied behind, then dropped unsent
+static long bench_httpsend(bench_t *b, long n) {
+  static char body[512];
+  conn_t *conn;
+  res_t *res;
+  long i;
+  int sv[2];
+  if ((conn = (conn_t *)malloc(sizeof(conn_t))) == NULL) fatal_exit(1, "Failed allocate connection");
+  pair(sv);
+  conn_init(conn, sv[0]);
+  res = &conn->res;
+  b->bytes = 0;
+  for(i = 0; i < n; i++) {
+    res_init(res, &conn->arena);
+    res->status = 200;
+    append_header(res, header_ref(res->arena, "Vary", "Accept-Encoding"));
+    append_header(res, header_ref(res->arena, "ETag", "\"ce8025-3f-6ad434ea\""));
+    append_header(res, header_ref(res->arena, "Last-Modified", "Sun, 18 Oct 2026 02:54:34 GMT"));
+    append_header(res, header_ref(res->arena, "Accept-Ranges", "bytes"));
+    append_header(res, header_ref(res->arena, "Content-Type", "text/css"));
+    res->body = body;
+    res->length = sizeof(body);
+    httpsend(conn, res);
+    b->bytes += conn->outlen;
+    conn->outlen = 0;
+    conn->niov = conn->iovsent = 0;
+    arena_reset(&conn->arena);
+  }
+  conn_close(conn);
+  close(sv[1]);
+  free(conn);
+  return n;
+}
+
+typedef struct {
+  sbuf_t *sp;
+  long count;
+  long *left;         // consumers: items still to take, shared
+} side_t;
+
+static void *produce(void *arg) {
+  side_t *side = (side_t *)arg;
+  long i;
+  for(i = 0; i < side->count; i++) sbuf_insert(side->sp, 3);
+  return NULL;
+}
+
+static void *consume(void *arg) {
+  side_t *side = (side_t *)arg;
+  while(__atomic_sub_fetch(side->left, 1, __ATOMIC_RELAXED) >= 0) sbuf_delete(side->sp);
+  return NULL;
+}
+
+// sbuf_insert and sbuf_delete, one item through the ring per op, with
+// producers and consumers contending on both ends
+static long bench_sbuf(bench_t *b, long n) {
+  pthread_t tids[64];
+  side_t sides[64];
+  sbuf_t sbuf;
+  long left = n;
+  int i, nthreads = b->producers + b->consumers;
+  sbuf_init(&sbuf, SBUF_SIZE);
+  for(i = 0; i < nthreads; i++) {
+    sides[i].sp = &sbuf;
+    sides[i].left = &left;
+    sides[i].count = n / b->producers + (i < n % b->producers);
+    if (pthread_create(&tids[i], NULL, i < b->producers ? produce : consume, &sides[i]) != 0) {
+      fatal_exit(3, "Failed create thread");
+    }
+  }
+  for(i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+  sbuf_destroy(&sbuf);
+  return n;
+}
+
+static bench_t benches[] = {
+  { "rio_readline", bench_readline, 0, 0, 0 },
+  { "parse_request", bench_parse, 0, 0, 0 },
+  { "get_mime", bench_mime, 0, 0, 0 },
+  { "check_method", bench_method, 0, 0, 0 },
+  { "httpsend", bench_httpsend, 0, 0, 0 },
+  { "sbuf_1p1c", bench_sbuf, 1, 1, 0 },
+  { "sbuf_2p2c", bench_sbuf, 2, 2, 0 },
+  { "sbuf_4p4c", bench_sbuf, 4, 4, 0 },
+  { "sbuf_8p8c", bench_sbuf, 8, 8, 0 },
+  { "sbuf_1p8c", bench_sbuf, 1, 8, 0 },
+  { "sbuf_8p1c", bench_sbuf, 8, 1, 0 },
+};
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int load_baseline(const char *path, baseline_t *base) {
+  FILE *fp = fopen(path, "r");
+  char line[256];
+  int n = 0;
+  if (!fp) return 0;
+  while(n < MAX_BASELINE && fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%31s %lf %lf", base[n].name, &base[n].ns, &base[n].allocs) == 3) n++;
+  }
+  fclose(fp);
+  return n;
+}
+
+static baseline_t *find_baseline(baseline_t *base, int n, const char *name) {
+  int i;
+  for(i = 0; i < n; i++) {
+    if (strcmp(base[i].name, name) == 0) return &base[i];
+  }
+  return NULL;
+}
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-b baseline] [-w baseline] [name...]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *basepath = NULL, *outpath = NULL;
+  baseline_t base[MAX_BASELINE], *bp;
+  bench_t *b;
+  uint64_t start, elapsed, a0, c0, c1;
+  double ns, perop;
+  long n, done;
+  int nbase = 0, regressions = 0, opt, i, j, selected;
+  char note[64];
+  FILE *out = NULL;
+  while((opt = getopt(argc, argv, "b:w:")) != -1) {
+    switch(opt) {
+      case 'b':
+        basepath = optarg;
+        break;
+      case 'w':
+        outpath = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (basepath) nbase = load_baseline(basepath, base);
+  if (outpath) {
+    if ((out = fopen(outpath, "w")) == NULL) {
+      perror(outpath);
+      return 1;
+    }
+    fprintf(out, "# name ns/op allocs/op, written by make microbench-baseline\n");
+  }
+  printf("%-16s %12s %10s %12s %8s  %s\n", "benchmark", "ns/op", "allocs/op", "baseline", "delta", "");
+  for(i = 0; i < (int)NBENCHES; i++) {
+    b = &benches[i];
+    for(selected = optind == argc, j = optind; j < argc; j++) selected |= strcmp(argv[j], b->name) == 0;
+    if (!selected) continue;
+    // grow n until a run fills the time budget, as Go's testing package does
+    for(n = 1; ; ) {
+      a0 = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+      start = now_ns();
+      c0 = cycles();
+      done = b->fn(b, n);
+      c1 = cycles();
+      elapsed = now_ns() - start;
+      if (elapsed >= BENCH_TIME_NS || n >= BENCH_MAX_N) break;
+      perop = elapsed / (double)(done > 0 ? done : 1);
+      n = perop > 0 ? (long)(BENCH_TIME_NS * 1.2 / perop) : n * 100;
+      if (n > done * 100) n = done * 100;
+      if (n <= done) n = done + 1;
+      if (n > BENCH_MAX_N) n = BENCH_MAX_N;
+    }
+    ns = elapsed / (double)done;
+    perop = (__atomic_load_n(&allocs, __ATOMIC_RELAXED) - a0) / (double)done;
+    note[0] = 0;
+    if (b->bytes && c1 > c0) {
+      snprintf(note, sizeof(note), "%.2f Mop/s, %.2f B/cycle", 1e3 / ns, b->bytes / (double)(c1 - c0));
+    } else if (b->bytes) {
+      snprintf(note, sizeof(note), "%.2f Mop/s, %.0f MB/s", 1e3 / ns, b->bytes * 1e3 / elapsed);
+    }
+    if ((bp = find_baseline(base, nbase, b->name)) != NULL) {
+      // more allocations are a regression whatever the time says
+      j = ns > bp->ns * (100 + REGRESS_PCT) / 100 || perop > bp->allocs + 0.005;
+      regressions += j;
+      printf("%-16s %12.1f %10.2f %12.1f %+7.1f%%  %s%s\n", b->name, ns, perop, bp->ns,
+             (ns - bp->ns) * 100 / bp->ns, j ? "REGRESSION " : "", note);
+    } else {
+      printf("%-16s %12.1f %10.2f %12s %8s  %s\n", b->name, ns, perop, "-", "-", note);
+    }
+    if (out) fprintf(out, "%s %.1f %.2f\n", b->name, ns, perop);
+  }
+  if (out) fclose(out);
+  if (basepath) printf("%d regression%s against %s (over +%d%% ns/op or more allocs/op)\n",
+                       regressions, regressions == 1 ? "" : "s", basepath, REGRESS_PCT);
+  return 0;
+}
@@ -0,0 +1,130 @@
+#include "./inc/bundle.h"
+
+static const char *bundle_path;
+static bundle_t *current;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t checked;
+// This thread's reference to the version it serves, and how many of its
+// responses use it
+static __thread bundle_t *mine;
+static __thread int uses;
+static __thread time_t next_check;
+
+// Drop one reference counted in refs, unmapping the version with the last
+static void bundle_release_shared(bundle_t *bp) {
+    if (__atomic_sub_fetch(&bp->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    munmap(bp->map, bp->size);
+    close(bp->fd);
+    free(bp);
+}
+
+// Map path and check it is a whole bundle. NULL when it is not.
+static bundle_t *bundle_map(const char *path) {
+    bundle_t *bp = (bundle_t *)calloc(1, sizeof(bundle_t));
+    bundle_hdr_t *hdr;
+    if (!bp) return NULL;
+    if ((bp->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(bp->fd, &bp->st) < 0 ||
+        (size_t)bp->st.st_size < sizeof(bundle_hdr_t)) goto fail;
+    bp->size = bp->st.st_size;
+    if ((bp->map = (char *)mmap(NULL, bp->size, PROT_READ, MAP_SHARED, bp->fd, 0)) == MAP_FAILED) {
+        bp->map = NULL;
+        goto fail;
+    }
+    hdr = bp->hdr = (bundle_hdr_t *)bp->map;
+    if (memcmp(hdr->magic, BUNDLE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->size != bp->size ||
+        (hdr->nslots & (hdr->nslots - 1)) != 0 || !hdr->nbuckets ||
+        hdr->disp + (uint64_t)hdr->nbuckets * sizeof(uint32_t) > bp->size ||
+        hdr->slots + (uint64_t)hdr->nslots * sizeof(uint32_t) > bp->size ||
+        hdr->entries + (uint64_t)hdr->nentries * sizeof(bundle_ent_t) > bp->size) goto fail;
+    bp->disp = (const uint32_t *)(bp->map + hdr->disp);
+    bp->slots = (const uint32_t *)(bp->map + hdr->slots);
+    bp->entries = (bundle_ent_t *)(bp->map + hdr->entries);
+    // the index and headers are touched by every request, fault them in now
+    madvise(bp->map, hdr->entries + (uint64_t)hdr->nentries * sizeof(bundle_ent_t), MADV_WILLNEED);
+    bp->refs = 1;
+    return bp;
+fail:
+    if (bp->map) munmap(bp->map, bp->size);
+    if (bp->fd >= 0) close(bp->fd);
+    free(bp);
+    return NULL;
+}
+
+// Serve from the bundle at path, until it is replaced by another
+int bundle_open(const char *path) {
+    bundle_path = path;
+    if ((current = bundle_map(path)) == NULL) return -1;
+    checked = time(NULL);
+    printf("Mapped bundle %s, %u entries\n", path, current->hdr->nentries);
+    return 0;
+}
+
+// A new file renamed over the bundle's path becomes current, atomically
+// for requests: each one sees either the old version or the new one.
+static void bundle_check(time_t now) {
+    time_t last = __atomic_load_n(&checked, __ATOMIC_RELAXED);
+    struct stat st;
+    bundle_t *bp, *old;
+    // one thread per interval does the stat
+    if (now - last < BUNDLE_CHECK_INTERVAL ||
+        !__atomic_compare_exchange_n(&checked, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+    if (stat(bundle_path, &st) < 0 || (st.st_ino == current->st.st_ino && st.st_dev == current->st.st_dev &&
+        st.st_mtime == current->st.st_mtime && st.st_size == current->st.st_size)) return;
+    if ((bp = bundle_map(bundle_path)) == NULL) {
+        fprintf(stderr, "Ignored bad bundle %s\n", bundle_path);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    old = current;
+    __atomic_store_n(&current, bp, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+    bundle_release_shared(old);
+}
+
+// Adopt the current version if it changed since this thread last looked.
+// The responses still on the old one turn into shared references to it.
+static void bundle_refresh(void) {
+    bundle_t *bp;
+    if (__atomic_load_n(&current, __ATOMIC_ACQUIRE) == mine) return;
+    pthread_mutex_lock(&lock);
+    bp = current;
+    __atomic_add_fetch(&bp->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock);
+    if (mine) {
+        if (uses) __atomic_add_fetch(&mine->refs, uses, __ATOMIC_RELAXED);
+        bundle_release_shared(mine);
+    }
+    mine = bp;
+    uses = 0;
+}
+
+// The current version, referenced; bundle_release once done with it, on
+// the same thread. Requests only touch this thread's reference, the lock
+// and the shared count are for when the version changes.
+bundle_t *bundle_get(void) {
+    time_t now = time(NULL);
+    if (!mine || now >= next_check) {
+        bundle_check(now);
+        bundle_refresh();
+        next_check = now + BUNDLE_CHECK_INTERVAL;
+    }
+    uses++;
+    return mine;
+}
+
+void bundle_release(bundle_t *bp) {
+    if (bp == mine) uses--;
+    else bundle_release_shared(bp);
+}
+
+// One probe of the perfect hash, NULL for a url not in the bundle
+bundle_ent_t *bundle_find(bundle_t *bp, const char *url, size_t len) {
+    bundle_ent_t *ent;
+    uint32_t seed, slot;
+    if (!bp->hdr->nslots) return NULL;
+    seed = bp->disp[phash_hash(url, len, 0, 0) % bp->hdr->nbuckets];
+    if ((slot = bp->slots[phash_hash(url, len, seed, 0) & (bp->hdr->nslots - 1)]) == 0) return NULL;
+    ent = &bp->entries[slot - 1];
+    if (ent->urllen != len || memcmp(bp->map + ent->url, url, len) != 0) return NULL;
+    return ent;
+}
@@ -0,0 +1,273 @@
+#include "./inc/cache.h"
+
+static unsigned hash_key(const char *key) {
+    // FNV-1a
+    unsigned h = 2166136261u;
+    while(*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static shard_t *shard_of(cache_t *cache, unsigned hash) {
+    // low bits pick the bucket, high bits the shard
+    return &cache->shards[(hash >> 24) % CACHE_SHARDS];
+}
+
+cache_t *cache_create(size_t budget) {
+    int i;
+    cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+    if (!cache) fatal_exit(1, "Failed calloc cache");
+    for(i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].budget = budget / CACHE_SHARDS;
+    }
+    cache->entry_max = budget / CACHE_SHARDS < CACHE_ENTRY_MAX ? budget / CACHE_SHARDS : CACHE_ENTRY_MAX;
+    return cache;
+}
+
+// entry->gz markers for a variant being compressed, and for one not worth having
+static entry_t variant_busy, variant_none;
+
+void cache_release(entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (entry->gz && entry->gz != &variant_busy && entry->gz != &variant_none) cache_release(entry->gz);
+    free(entry->key);
+    free(entry->path);
+    free(entry->body);
+    free(entry);
+}
+
+// unlink entry from table and ring, the table's reference goes with it. Lock held.
+static void shard_remove(shard_t *sp, entry_t *entry) {
+    entry_t **pp = &sp->buckets[entry->hash % CACHE_BUCKETS];
+    while(*pp != entry) pp = &(*pp)->next;
+    *pp = entry->next;
+    if (entry->next_clock == entry) {
+        sp->hand = NULL;
+    } else {
+        entry->prev_clock->next_clock = entry->next_clock;
+        entry->next_clock->prev_clock = entry->prev_clock;
+        if (sp->hand == entry) sp->hand = entry->next_clock;
+    }
+    sp->bytes -= entry->cost;
+    cache_release(entry);
+}
+
+// CLOCK: sweep the hand, giving recently hit entries a second chance. Lock held.
+static void shard_evict(shard_t *sp, size_t need) {
+    entry_t *victim;
+    while(sp->hand && sp->bytes + need > sp->budget) {
+        if (sp->hand->referenced) {
+            sp->hand->referenced = 0;
+            sp->hand = sp->hand->next_clock;
+            continue;
+        }
+        victim = sp->hand;
+        shard_remove(sp, victim);
+    }
+}
+
+static entry_t *shard_find(shard_t *sp, const char *key, unsigned hash) {
+    entry_t *entry = sp->buckets[hash % CACHE_BUCKETS];
+    while(entry && (entry->hash != hash || strcmp(entry->key, key) != 0)) entry = entry->next;
+    return entry;
+}
+
+// Returns a referenced entry for key, or NULL when missing or stale.
+// Callers hand the reference back with cache_release. A caller that knows
+// the file's current st (the docroot index) passes it and saves the stat,
+// otherwise the entry is checked against the file once per interval.
+entry_t *cache_get(cache_t *cache, const char *key, const struct stat *known) {
+    unsigned hash = hash_key(key);
+    shard_t *sp = shard_of(cache, hash);
+    entry_t *entry;
+    struct stat st;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&sp->lock);
+    if ((entry = shard_find(sp, key, hash)) == NULL) {
+        pthread_mutex_unlock(&sp->lock);
+        METRIC_ADD(cache_misses, 1);
+        return NULL;
+    }
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    entry->referenced = 1;
+    pthread_mutex_unlock(&sp->lock);
+    if (known) {
+        if (known->st_mtime == entry->mtime && (size_t)known->st_size == entry->size && known->st_ino == entry->ino) {
+            METRIC_ADD(cache_hits, 1);
+            return entry;
+        }
+    } else {
+        if (now - __atomic_load_n(&entry->checked, __ATOMIC_RELAXED) < CACHE_CHECK_INTERVAL) {
+            METRIC_ADD(cache_hits, 1);
+            return entry;
+        }
+        // revalidate outside the lock, one stat per interval
+        if (stat(entry->path, &st) == 0 && st.st_mtime == entry->mtime &&
+            (size_t)st.st_size == entry->size && st.st_ino == entry->ino) {
+            __atomic_store_n(&entry->checked, now, __ATOMIC_RELAXED);
+            METRIC_ADD(cache_hits, 1);
+            return entry;
+        }
+    }
+    pthread_mutex_lock(&sp->lock);
+    if (shard_find(sp, key, hash) == entry) shard_remove(sp, entry);
+    pthread_mutex_unlock(&sp->lock);
+    cache_release(entry);
+    // stale, as good as missing
+    METRIC_ADD(cache_misses, 1);
+    return NULL;
+}
+
+static int read_file(const char *path, char *buf, size_t size) {
+    int fd;
+    ssize_t n;
+    size_t done = 0;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC, 0)) < 0) return -1;
+    while(done < size) {
+        if ((n = read(fd, buf + done, size - done)) <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    return done == size ? 0 : -1;
+}
+
+// Strong validator for a file version, into buf (ETAG_LEN_MAX bytes)
+void cache_etag(const struct stat *st, char *buf) {
+    snprintf(buf, ETAG_LEN_MAX, "\"%lx-%lx-%lx\"", (unsigned long)st->st_ino,
+             (unsigned long)st->st_size, (unsigned long)st->st_mtime);
+}
+
+// Read path (stat'ed as st) into a new unreferenced entry, a metadata-only
+// one (body NULL) when it is over entry_max
+static entry_t *entry_load(cache_t *cache, const char *key, const char *path, struct stat *st, char *mime) {
+    entry_t *entry;
+    size_t size = st->st_size;
+    if ((entry = (entry_t *)calloc(1, sizeof(entry_t))) == NULL) return NULL;
+    entry->key = key ? strdup(key) : NULL;
+    entry->path = strdup(path);
+    if (size <= cache->entry_max) entry->body = (char *)malloc(size ? size : 1);
+    if ((key && !entry->key) || !entry->path || (size <= cache->entry_max &&
+        (!entry->body || read_file(path, entry->body, size) < 0))) {
+        entry->refs = 1;
+        cache_release(entry);
+        return NULL;
+    }
+    entry->size = size;
+    entry->cost = sizeof(entry_t) + (key ? strlen(key) : 0) + strlen(path) + 2 + (entry->body ? size : 0);
+    entry->mtime = st->st_mtime;
+    entry->ino = st->st_ino;
+    entry->mime = mime;
+    // formatted once per file version, never per request
+    httpdate_format(st->st_mtime, entry->lastmod);
+    cache_etag(st, entry->etag);
+    return entry;
+}
+
+// A path.gz sibling at least as new as entry's file becomes its gzip variant.
+// Only the source is revalidated later, the sibling is trusted to follow it.
+static void load_sibling(cache_t *cache, entry_t *entry) {
+    char sibling[PATH_MAX];
+    struct stat st;
+    entry_t *variant;
+    if (snprintf(sibling, sizeof(sibling), "%s%s", entry->path, GZIP_SUFFIX) >= (int)sizeof(sibling)) return;
+    if (stat(sibling, &st) < 0 || !S_ISREG(st.st_mode) || st.st_mtime < entry->mtime) return;
+    if ((variant = entry_load(cache, NULL, sibling, &st, entry->mime)) == NULL) return;
+    // dated like the file it stands for
+    variant->mtime = entry->mtime;
+    memcpy(variant->lastmod, entry->lastmod, sizeof(entry->lastmod));
+    variant->refs = 1;
+    entry->gz = variant;
+    entry->cost += variant->cost;
+}
+
+// Load path (stat'ed as st) into the cache under key. Files over entry_max
+// get a metadata-only entry (body NULL) and are sent from disk. Returns a
+// referenced entry, or NULL if the file could not be read.
+entry_t *cache_put(cache_t *cache, const char *key, const char *path, struct stat *st, char *mime) {
+    unsigned hash = hash_key(key);
+    shard_t *sp = shard_of(cache, hash);
+    entry_t *entry, *old;
+    if ((entry = entry_load(cache, key, path, st, mime)) == NULL) return NULL;
+    if (gzip_compressible(mime)) load_sibling(cache, entry);
+    if (!entry->gz && (!gzip_compressible(mime) || entry->size < GZIP_MIN_SIZE)) entry->gz = &variant_none;
+    entry->checked = time(NULL);
+    entry->hash = hash;
+    // one for the table, one for the caller
+    entry->refs = 2;
+
+    pthread_mutex_lock(&sp->lock);
+    if ((old = shard_find(sp, key, hash)) != NULL) shard_remove(sp, old);
+    shard_evict(sp, entry->cost);
+    entry->next = sp->buckets[hash % CACHE_BUCKETS];
+    sp->buckets[hash % CACHE_BUCKETS] = entry;
+    if (sp->hand) {
+        // insert just behind the hand, i.e. last to be swept
+        entry->next_clock = sp->hand;
+        entry->prev_clock = sp->hand->prev_clock;
+        sp->hand->prev_clock->next_clock = entry;
+        sp->hand->prev_clock = entry;
+    } else {
+        entry->next_clock = entry->prev_clock = entry;
+        sp->hand = entry;
+    }
+    sp->bytes += entry->cost;
+    pthread_mutex_unlock(&sp->lock);
+    return entry;
+}
+
+// gzip body of entry as a new variant, etag and dates follow the source
+static entry_t *compress_entry(entry_t *entry) {
+    entry_t *variant;
+    size_t len;
+    if ((variant = (entry_t *)calloc(1, sizeof(entry_t))) == NULL) return NULL;
+    if ((variant->body = gzip_compress(entry->body, entry->size, &len)) == NULL ||
+        (variant->path = strdup(entry->path)) == NULL) {
+        free(variant->body);
+        free(variant);
+        return NULL;
+    }
+    variant->size = len;
+    variant->cost = sizeof(entry_t) + strlen(entry->path) + 1 + len;
+    variant->mtime = entry->mtime;
+    variant->ino = entry->ino;
+    variant->mime = entry->mime;
+    memcpy(variant->lastmod, entry->lastmod, sizeof(entry->lastmod));
+    // the source tag with -gz inside the quotes
+    snprintf(variant->etag, sizeof(variant->etag), "%.*s-gz\"", (int)strlen(entry->etag) - 1, entry->etag);
+    variant->gz = &variant_none;
+    variant->refs = 1;
+    return variant;
+}
+
+// Referenced gzip variant of a referenced entry, compressed from its body
+// the first time it is asked for. Exactly one thread compresses a version;
+// the rest get NULL meanwhile and send the identity body, as they do when
+// compression doesn't pay off.
+entry_t *cache_variant(cache_t *cache, entry_t *entry) {
+    entry_t *variant = __atomic_load_n(&entry->gz, __ATOMIC_ACQUIRE), *expected = NULL;
+    unsigned hash = entry->hash;
+    shard_t *sp = shard_of(cache, hash);
+    if (variant == NULL) {
+        if (!entry->body || !__atomic_compare_exchange_n(&entry->gz, &expected, &variant_busy, 0,
+                                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return NULL;
+        variant = compress_entry(entry);
+        pthread_mutex_lock(&sp->lock);
+        // charged only while entry is still in the table, it takes the cost out with it
+        if (variant && shard_find(sp, entry->key, hash) == entry) {
+            entry->cost += variant->cost;
+            sp->bytes += variant->cost;
+            shard_evict(sp, 0);
+        }
+        pthread_mutex_unlock(&sp->lock);
+        __atomic_store_n(&entry->gz, variant ? variant : &variant_none, __ATOMIC_RELEASE);
+    }
+    if (variant == &variant_busy || variant == &variant_none) return NULL;
+    __atomic_add_fetch(&variant->refs, 1, __ATOMIC_RELAXED);
+    return variant;
+}
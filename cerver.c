@@ -1,8 +1,90 @@
 #include "./inc/core.h"
 
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-e epoll|thread|uring] [-t threads] [-r] [-p] [-k max_requests] [-i idle_timeout] [-T header_timeout] [-W write_timeout] [-l max_conns] [-q queue_size] [-c cache_size] [-z] [-x] [-b bundle] [-2] [-P prefix=upstream] [-m mime_types] [-M metrics_path] [-a access_log] [port]\n", prog);
+  exit(1);
+}
+
 int main(int argc, char **argv) {
   short port = 0;
-  if (argc < 2 || sscanf(argv[1], "%hd", &port) != 1) {
+  int opt;
+  server_t app = { 0 };
+  app.engine = ENGINE_EPOLL;
+  app.max_requests = 100;
+  app.idle_timeout = 15;
+  app.header_timeout = 10;
+  app.write_timeout = 30;
+  app.cache_size = 32 << 20;
+  while((opt = getopt(argc, argv, "e:t:rpk:i:T:W:l:q:c:zxb:2P:m:M:a:")) != -1) {
+    switch(opt) {
+      case 'e':
+        if (strcmp(optarg, "epoll") == 0) app.engine = ENGINE_EPOLL;
+        else if (strcmp(optarg, "thread") == 0) app.engine = ENGINE_THREAD;
+        else if (strcmp(optarg, "uring") == 0) app.engine = ENGINE_URING;
+        else usage(argv[0]);
+        break;
+      case 't':
+        app.nthreads = atoi(optarg);
+        break;
+      case 'r':
+        app.reuseport = 1;
+        break;
+      case 'p':
+        app.pin = 1;
+        break;
+      case 'k':
+        app.max_requests = atoi(optarg);
+        break;
+      case 'i':
+        app.idle_timeout = atoi(optarg);
+        break;
+      case 'T':
+        app.header_timeout = atoi(optarg);
+        break;
+      case 'W':
+        app.write_timeout = atoi(optarg);
+        break;
+      case 'l':
+        app.max_conns = atoi(optarg);
+        break;
+      case 'q':
+        app.queue_size = atoi(optarg);
+        break;
+      case 'c':
+        app.cache_size = parse_size(optarg);
+        break;
+      case 'z':
+        app.precompress = 1;
+        break;
+      case 'x':
+        app.index = 1;
+        break;
+      case 'b':
+        app.bundle = optarg;
+        break;
+      case '2':
+        app.h2 = 1;
+        break;
+      case 'P':
+        if (proxy_add_route(&app, optarg) != OK) {
+          fprintf(stderr, "bad route %s, want /prefix=host:port or /prefix=unix:/path\n", optarg);
+          usage(argv[0]);
+        }
+        break;
+      case 'm':
+        app.mime_file = optarg;
+        break;
+      case 'M':
+        app.metrics_path = optarg;
+        break;
+      case 'a':
+        app.access_log = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc || sscanf(argv[optind], "%hd", &port) != 1) {
       // use default 8080 port
       port = 8080;
   }
@@ -10,6 +92,8 @@ int main(int argc, char **argv) {
   if ((public = getcwd(NULL, MAX_PATH_LEN)) == NULL) {
       fatal_exit(1, "Failed reading public dir"); 
   }
-  run_server(port, public);
+  app.port = port;
+  app.www = public;
+  run_server(&app);
   return 0;
-}
\ No newline at end of file
+}
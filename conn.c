@@ -0,0 +1,366 @@
+#include "./inc/conn.h"
+#include "./inc/h2.h"
+#include "./inc/proxy.h"
+
+void conn_init(conn_t *conn, int fd) {
+    conn->fd = fd;
+    conn->peer.s_addr = 0;
+    conn->state = CONN_READ;
+    conn->keep_alive = 1;
+    conn->requests = 0;
+    conn->pending = 0;
+    conn->blocking = 0;
+    conn->phase = 0;
+    conn->deadline = 0;
+    conn->timer.prev = conn->timer.next = NULL;
+    conn->stamp = 0;
+    conn->sent = conn->batch = 0;
+    conn->part = 0;
+    conn->bodysent = 0;
+    conn->outlen = 0;
+    conn->niov = conn->iovsent = conn->nheld = 0;
+    conn->h2 = NULL;
+    conn->px = NULL;
+    conn->epfd = -1;
+    rio_init(&conn->rio, fd);
+    parser_init(&conn->parser);
+    arena_init(&conn->arena);
+    req_init(&conn->req, &conn->arena);
+    res_init(&conn->res, &conn->arena);
+    STAT_ADD(accepted, 1);
+    STAT_ADD(inflight, 1);
+}
+
+// Whether one more connection may be served, checked before conn_init
+int conn_admit(server_t *app) {
+    return app->max_conns <= 0 || STAT_GET(inflight) < app->max_conns ? OK : FAILED;
+}
+
+// Refuse a fresh connection: a best effort 503 telling the client when to
+// come back, then close. Never blocks the acceptor.
+void conn_shed(int fd) {
+    static const char busy[] = "HTTP/1.1 503 Service Unavailable" CRLF
+                               "Retry-After: " RETRY_AFTER CRLF
+                               "Content-Length: 0" CRLF
+                               "Connection: close" CRLF CRLF;
+    PROBE1(shed, fd);
+    while(send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EINTR);
+    close(fd);
+    STAT_ADD(shed, 1);
+}
+
+// The phase conn is in, from where conn_drive left it
+int conn_phase(conn_t *conn) {
+    // an upstream gets write_timeout to make progress, like a client reading
+    if (conn->state == CONN_WRITE || conn->state == CONN_PROXY) return PHASE_WRITE;
+    // a partial head is buffered, or the first one hasn't even started
+    return conn->requests == 0 || conn->rio.unread > 0 ? PHASE_HEADER : PHASE_IDLE;
+}
+
+// Seconds allowed for phase, 0 for no limit
+int conn_timeout(server_t *app, int phase) {
+    int timeout = phase == PHASE_HEADER ? app->header_timeout :
+                  phase == PHASE_WRITE ? app->write_timeout : app->idle_timeout;
+    return timeout > 0 ? timeout : 0;
+}
+
+// Count a connection about to be closed for missing its deadline
+void conn_timed_out(conn_t *conn) {
+    if (conn->phase == PHASE_HEADER) STAT_ADD(timeout_header, 1);
+    else if (conn->phase == PHASE_WRITE) STAT_ADD(timeout_write, 1);
+    else STAT_ADD(timeout_idle, 1);
+}
+
+// A blocking read may only wait for what is left of the phase's deadline,
+// which starts when the phase does. Fails with EAGAIN once it has passed.
+static int conn_read_deadline(server_t *app, conn_t *conn) {
+    int phase = conn_phase(conn), timeout;
+    time_t now = time(NULL);
+    struct timeval tv = { 0, 0 };
+    if (phase != conn->phase) {
+        conn->phase = phase;
+        timeout = conn_timeout(app, phase);
+        conn->deadline = timeout ? now + timeout : 0;
+    }
+    if (conn->deadline) {
+        if (conn->deadline <= now) {
+            errno = EAGAIN;
+            return FAILED;
+        }
+        tv.tv_sec = conn->deadline - now;
+    }
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return OK;
+}
+
+// Add a segment to the next writev, merging with the previous one when contiguous
+void conn_queue(conn_t *conn, char *buf, size_t n) {
+    struct iovec *last = conn->niov ? &conn->iov[conn->niov - 1] : NULL;
+    if (n == 0) return;
+    if (last && (char *)last->iov_base + last->iov_len == buf) {
+        last->iov_len += n;
+        return;
+    }
+    conn->iov[conn->niov].iov_base = buf;
+    conn->iov[conn->niov].iov_len = n;
+    conn->niov++;
+}
+
+// keep a cache entry alive until its queued body is written
+void conn_hold(conn_t *conn, entry_t *entry) {
+    conn->held[conn->nheld++] = entry;
+}
+
+static ssize_t conn_writev(conn_t *conn, int more) {
+    struct msghdr msg = { 0 };
+    ssize_t ret;
+    msg.msg_iov = conn->iov + conn->iovsent;
+    msg.msg_iovlen = conn->niov - conn->iovsent;
+    // with a file body to follow, MSG_MORE holds the tail back so it shares a segment with the body
+    while((ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0))) < 0 && errno == EINTR);
+    if (ret > 0) conn_wrote(conn, ret);
+    return ret;
+}
+
+static ssize_t conn_sendfile(conn_t *conn, int infd, off_t offset, size_t n) {
+    ssize_t ret;
+    while((ret = sendfile(conn->fd, infd, &offset, n)) < 0 && errno == EINTR);
+    if (ret > 0) conn_wrote(conn, ret);
+    return ret;
+}
+
+static ssize_t conn_send(conn_t *conn, const char *buf, size_t n, int more) {
+    ssize_t ret;
+    while((ret = send(conn->fd, buf, n, MSG_NOSIGNAL | (more ? MSG_MORE : 0))) < 0 && errno == EINTR);
+    if (ret > 0) conn_wrote(conn, ret);
+    return ret;
+}
+
+// multipart/byteranges body: each part's head, then its slice straight from
+// the file or the cached body. Only the closing delimiter goes out uncorked.
+static int conn_send_parts(conn_t *conn) {
+    res_t *res = &conn->res;
+    range_t *part;
+    size_t done;
+    ssize_t n;
+    while(conn->part <= res->nranges) {
+        part = &res->ranges[conn->part];
+        if (conn->bodysent < part->headlen) {
+            n = conn_send(conn, part->head + conn->bodysent, part->headlen - conn->bodysent,
+                          conn->part < res->nranges);
+        } else if ((done = conn->bodysent - part->headlen) < part->len) {
+            if (res->fd >= 0) {
+                n = conn_sendfile(conn, res->fd, part->start + done, part->len - done);
+                if (n == 0) return CONN_CLOSE;
+            } else {
+                n = conn_send(conn, res->body + part->start + done, part->len - done, 1);
+            }
+        } else {
+            conn->part++;
+            conn->bodysent = 0;
+            continue;
+        }
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? CONN_WRITE : CONN_CLOSE;
+        conn->bodysent += n;
+    }
+    return OK;
+}
+
+// Count n bytes just written to conn, whichever engine wrote them
+void conn_wrote(conn_t *conn, size_t n) {
+    if (conn->sent == conn->batch) PROBE2(first_byte, conn->fd, n);
+    conn->sent += n;
+    METRIC_ADD(bytes_sent, n);
+}
+
+// Skip n written bytes of the queued segments, trimming a partially written one
+void conn_advance(conn_t *conn, size_t n) {
+    struct iovec *iov;
+    while(n > 0) {
+        iov = &conn->iov[conn->iovsent];
+        if (n >= iov->iov_len) {
+            n -= iov->iov_len;
+            conn->iovsent++;
+        } else {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+// write out queued segments then the pending file body, resuming where the last call stopped
+static int conn_flush(conn_t *conn) {
+    ssize_t n;
+    res_t *res = &conn->res;
+    while(conn->iovsent < conn->niov) {
+        if ((n = conn_writev(conn, conn->pending)) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? CONN_WRITE : CONN_CLOSE;
+        }
+        conn_advance(conn, n);
+    }
+    if (conn->pending && res->nranges) return conn_send_parts(conn);
+    while(conn->pending && conn->bodysent < res->length) {
+        // straight from page cache, no user space copy
+        n = conn_sendfile(conn, res->fd, res->offset + conn->bodysent, res->length - conn->bodysent);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? CONN_WRITE : CONN_CLOSE;
+        }
+        // file shrank under us, Content-Length can't be honored anymore
+        if (n == 0) return CONN_CLOSE;
+        conn->bodysent += n;
+    }
+    return OK;
+}
+
+// drop everything queued once written, or when the connection goes away
+static void conn_reset_queue(conn_t *conn) {
+    int i;
+    for(i = 0; i < conn->nheld; i++) cache_release(conn->held[i]);
+    conn->nheld = conn->niov = conn->iovsent = 0;
+    conn->outlen = 0;
+}
+
+// Whether another buffered request may be answered into the queue right now
+int conn_can_queue(conn_t *conn) {
+    return conn->keep_alive && !conn->pending && conn->niov + 3 <= CONN_IOV_MAX &&
+           OUT_BUF_MAX - conn->outlen >= HDR_LEN_MAX;
+}
+
+// Answer every complete request buffered in rio, as far as the queue allows.
+// Returns 1 and switches to CONN_WRITE when there is something to send.
+int conn_process(server_t *app, conn_t *conn) {
+    if (conn->h2) return h2_process(app, conn);
+    if (app->h2 && h2_preface(conn)) {
+        // prior knowledge, HTTP/2 from the first byte
+        h2_start(conn);
+        return h2_process(app, conn);
+    }
+    while(conn_can_queue(conn)) {
+        // web_handle times the rest of the parse and the lookup from here
+        conn->stamp = mono_ns();
+        if (parse_head(&conn->parser, conn->rio.cursor, conn->rio.unread) == PARSE_AGAIN) break;
+        conn->requests++;
+        METRIC_ADD(requests, 1);
+        web_handle(app, conn);
+        // upgraded to h2c, the rest of the input is frames
+        if (conn->h2) break;
+        // requests after a proxied one wait for its response
+        if (proxy_active(conn)) break;
+    }
+    if (conn->niov > 0 || conn->pending || proxy_active(conn)) {
+        conn->state = conn->niov > 0 || conn->pending ? CONN_WRITE : CONN_PROXY;
+        conn->batch = conn->sent;
+        conn->stamp = mono_ns();
+        return 1;
+    }
+    return 0;
+}
+
+// The request head does not fit in the buffer: answer 400 and close
+void conn_overflow(conn_t *conn) {
+    int i;
+    // drop what else already arrived, closing with it unread would reset
+    // the connection before the client reads the 400
+    for(i = 0; i < 8 && recv(conn->fd, conn->rio.buf, sizeof(conn->rio.buf), MSG_DONTWAIT) > 0; i++);
+    rio_init(&conn->rio, conn->fd);
+    conn->keep_alive = 0;
+    conn->res.status = 400;
+    httpsend_error(conn, &conn->res);
+}
+
+// Everything queued went out: drop it and go back to reading, or close
+void conn_sent(conn_t *conn) {
+    metrics_time(HIST_SEND, conn->stamp);
+    PROBE2(sent, conn->fd, conn->sent - conn->batch);
+    if (conn->pending) {
+        free_response(&conn->res);
+        res_init(&conn->res, &conn->arena);
+        conn->pending = 0;
+        conn->part = 0;
+        conn->bodysent = 0;
+    }
+    conn_reset_queue(conn);
+    if (proxy_active(conn)) {
+        // what went ahead of a proxied request is out, its own memory is still in use
+        conn->state = CONN_PROXY;
+        conn->batch = conn->sent;
+        return;
+    }
+    // nothing queued refers to request memory anymore
+    arena_reset(&conn->arena);
+    conn->state = conn->keep_alive ? CONN_READ : CONN_CLOSE;
+}
+
+// (Re)arm conn's deadline in wheel, from tick now, for the phase it is in.
+// A head must arrive whole within header_timeout of its start however it
+// trickles in; writes and idling restart the clock on every wakeup.
+void conn_deadline(server_t *app, wheel_t *wheel, conn_t *conn, unsigned long now) {
+    int phase = conn_phase(conn), timeout;
+    if (phase == PHASE_HEADER && conn->phase == PHASE_HEADER) return;
+    conn->phase = phase;
+    if ((timeout = conn_timeout(app, phase)) > 0) {
+        wheel_arm(wheel, &conn->timer, now + (unsigned long)timeout * 1000 / WHEEL_TICK_MS);
+    } else {
+        wheel_cancel(wheel, &conn->timer);
+    }
+}
+
+// Make as much progress as the socket allows. Returns CONN_READ or CONN_WRITE
+// when the fd would block, CONN_CLOSE once the connection is done.
+int conn_drive(server_t *app, conn_t *conn) {
+    ssize_t n;
+    int ret;
+    while(1) {
+        switch(conn->state) {
+            case CONN_READ:
+                // answer every request already buffered before touching the socket
+                if (conn_process(app, conn)) break;
+                if (conn->blocking && conn_read_deadline(app, conn) != OK) return CONN_READ;
+                if ((n = rio_fill(&conn->rio)) > 0) break;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CONN_READ;
+                if (n < 0 && errno == ENOBUFS) {
+                    conn_overflow(conn);
+                    break;
+                }
+                if (n < 0) METRIC_ADD(errors, 1);
+                conn->state = CONN_CLOSE;
+                break;
+            case CONN_WRITE:
+                // SO_SNDTIMEO already bounds each blocking write by write_timeout
+                conn->phase = PHASE_WRITE;
+                if ((ret = conn_flush(conn)) != OK) {
+                    if (ret == CONN_CLOSE) {
+                        METRIC_ADD(errors, 1);
+                        conn->state = CONN_CLOSE;
+                    }
+                    return ret;
+                }
+                conn_sent(conn);
+                break;
+            case CONN_PROXY:
+                conn->phase = PHASE_WRITE;
+                // OK once the exchange is over, conn has moved on by itself
+                if ((ret = proxy_drive(app, conn)) != OK) {
+                    if (ret == CONN_CLOSE) conn->state = CONN_CLOSE;
+                    return ret;
+                }
+                break;
+            default:
+                return CONN_CLOSE;
+        }
+    }
+}
+
+void conn_close(conn_t *conn) {
+    PROBE3(close, conn->fd, conn->requests, conn->sent);
+    conn_reset_queue(conn);
+    free_response(&conn->res);
+    h2_free(conn);
+    proxy_free(conn);
+    arena_free(&conn->arena);
+    req_init(&conn->req, &conn->arena);
+    res_init(&conn->res, &conn->arena);
+    if (close(conn->fd) < 0) fatal_exit(4, "Failed close connection");
+    STAT_ADD(inflight, -1);
+}
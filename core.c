@@ -1,43 +1,162 @@
 #include "./inc/core.h"
 
 server_t svr;
+stats_t stats;
+static const char *engine_names[] = { "epoll", "thread", "io_uring" };
 
-void run_server(int port, char *public) {
-  int listenfd, connfd, i;
-  struct sockaddr_in client;
+static void run_threaded(int listenfd) {
+  int connfd, i;
   pthread_t tid;
   sbuf_t sbuf;
-  int clientlen = sizeof(client);
-  svr.port = port;
-  svr.www = public;
-  sbuf_init(&sbuf, NTHREADS);
-  listenfd = open_listenfd(port);
-  for(i = 0; i < NTHREADS; i++) {
+  sbuf_init(&sbuf, svr.queue_size > 0 ? svr.queue_size : svr.nthreads);
+  for(i = 0; i < svr.nthreads; i++) {
     if (pthread_create(&tid, NULL, thread_handle, &sbuf) != 0) fatal_exit(3, "Failed create thread");
   }
 
-  printf("Cerver start on port %d...\n", port);
   while(1) {
-    if ((connfd = accept(listenfd, (SA *)&client, (socklen_t *)&clientlen)) < 0) fatal_exit(3, "Failed accept connection");
-    report_client(&client);
-    sbuf_insert(&sbuf, connfd);
+    if ((connfd = accept(listenfd, NULL, NULL)) < 0) fatal_exit(3, "Failed accept connection");
+    PROBE1(accept, connfd);
+    if (conn_admit(&svr) != OK) {
+      conn_shed(connfd);
+    } else if (svr.queue_size <= 0) {
+      // no queue limit: wait for a free slot, the listen backlog absorbs the rest
+      sbuf_insert(&sbuf, connfd);
+    } else if (sbuf_depth(&sbuf) >= svr.queue_size || !sbuf_try_insert(&sbuf, connfd)) {
+      // never wait for a worker past the queue limit, the client is told to retry
+      conn_shed(connfd);
+    }
   }
 }
 
+// each worker accepts on its own SO_REUSEPORT socket, nothing is handed over
+static void *thread_accept(void *arg) {
+  int id = (int)(long)arg, listenfd, connfd;
+  if (svr.pin) pin_cpu(id);
+  listenfd = open_reuseport_listenfd(svr.port, svr.pin ? id : -1);
+  while(1) {
+    if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fatal_exit(3, "Failed accept connection");
+    }
+    PROBE1(accept, connfd);
+    if (conn_admit(&svr) != OK) conn_shed(connfd);
+    else serve_conn(connfd);
+  }
+  return NULL;
+}
+
+static void run_threaded_reuseport(void) {
+  int i;
+  pthread_t tid;
+  for(i = 1; i < svr.nthreads; i++) {
+    if (pthread_create(&tid, NULL, thread_accept, (void *)(long)i) != 0) fatal_exit(3, "Failed create thread");
+  }
+  thread_accept((void *)0);
+}
+
+static void run_epoll(int listenfd) {
+  int i;
+  loop_t *loops;
+  if ((loops = (loop_t *)calloc(svr.nthreads, sizeof(loop_t))) == NULL) fatal_exit(1, "Failed calloc loops");
+  for(i = 0; i < svr.nthreads; i++) {
+    if (svr.reuseport) listenfd = open_reuseport_listenfd(svr.port, svr.pin ? i : -1);
+    set_nonblocking(listenfd);
+    loop_init(&loops[i], i, listenfd, &svr);
+  }
+  // main thread runs loop 0 itself
+  for(i = 1; i < svr.nthreads; i++) {
+    if (pthread_create(&loops[i].tid, NULL, loop_run, &loops[i]) != 0) fatal_exit(3, "Failed create thread");
+  }
+  loop_run(&loops[0]);
+}
+
+// Like run_epoll, one ring per core; the sockets stay blocking, a splice
+// to one waits in the kernel's workers instead of failing with EAGAIN
+static void run_uring(int listenfd) {
+  int i;
+  uring_t *rings;
+  if ((rings = (uring_t *)calloc(svr.nthreads, sizeof(uring_t))) == NULL) fatal_exit(1, "Failed calloc rings");
+  for(i = 0; i < svr.nthreads; i++) {
+    if (svr.reuseport) listenfd = open_reuseport_listenfd(svr.port, svr.pin ? i : -1);
+    uring_init(&rings[i], i, listenfd, &svr);
+  }
+  for(i = 1; i < svr.nthreads; i++) {
+    if (pthread_create(&rings[i].tid, NULL, uring_run, &rings[i]) != 0) fatal_exit(3, "Failed create thread");
+  }
+  uring_run(&rings[0]);
+}
+
+void run_server(server_t *app) {
+  int listenfd;
+  svr = *app;
+  // first, every later thread inherits its signal mask
+  if (svr.access_log) accesslog_open(svr.access_log);
+  if (svr.engine == ENGINE_URING && uring_probe() != OK) {
+    fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+    svr.engine = ENGINE_EPOLL;
+  }
+  // upstream sockets are waited on by the epoll loops and the blocking workers only
+  if (svr.engine == ENGINE_URING && svr.nroutes) {
+    fprintf(stderr, "proxy routes need epoll or thread, falling back to epoll\n");
+    svr.engine = ENGINE_EPOLL;
+  }
+  if (svr.nthreads <= 0) {
+    svr.nthreads = svr.engine != ENGINE_THREAD ? (int)sysconf(_SC_NPROCESSORS_ONLN) : NTHREADS;
+    if (svr.nthreads <= 0) svr.nthreads = 1;
+  }
+  // before anything looks up a type
+  if (svr.mime_file && load_mime_types(svr.mime_file) != OK) fatal_exit(1, "Failed load mime types");
+  if (svr.bundle && bundle_open(svr.bundle) < 0) fatal_exit(1, "Failed map bundle");
+  if (svr.precompress) gzip_precompress(svr.www, svr.nthreads);
+  if (svr.cache_size > 0) svr.cache = cache_create(svr.cache_size);
+  // after precompressing, so the siblings are indexed too
+  if (svr.index) svr.docroot = docroot_create(svr.www, svr.nthreads);
+  // peers closing early must not kill the process through a write
+  signal(SIGPIPE, SIG_IGN);
+  listenfd = svr.reuseport ? -1 : open_listenfd(svr.port);
+
+  printf("Cerver start on port %d (%s, %d threads%s)...\n", svr.port,
+         engine_names[svr.engine], svr.nthreads,
+         svr.reuseport ? ", reuseport" : "");
+  if (svr.engine == ENGINE_EPOLL) {
+    run_epoll(listenfd);
+  } else if (svr.engine == ENGINE_URING) {
+    run_uring(listenfd);
+  } else if (svr.reuseport) {
+    run_threaded_reuseport();
+  } else {
+    run_threaded(listenfd);
+  }
+}
+
+
+// Serve one blocking connection to its end on the calling worker
+void serve_conn(int connfd) {
+  // too big for a comfortable stack frame, one per worker thread
+  static __thread conn_t *conn;
+  struct timeval tv = { svr.write_timeout, 0 };
+  struct sockaddr_in peer;
+  socklen_t peerlen = sizeof(peer);
+  if (!conn && (conn = (conn_t *)malloc(sizeof(conn_t))) == NULL) fatal_exit(1, "Failed allocate connection");
+  conn_init(conn, connfd);
+  // a timed out read or write surfaces as EAGAIN; conn_drive sets the read side per phase
+  conn->blocking = 1;
+  // the acceptor kept no address, only the access log and X-Forwarded-For want it
+  if ((accesslog_enabled() || svr.nroutes) && getpeername(connfd, (SA *)&peer, &peerlen) == 0) conn->peer = peer.sin_addr;
+  if (svr.write_timeout > 0) setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  // blocking fd, so this returns only once the connection is done or timed out
+  if (conn_drive(&svr, conn) != CONN_CLOSE) conn_timed_out(conn);
+  conn_close(conn);
+}
 
 void *thread_handle(void *arg) {
   sbuf_t *sp = (sbuf_t *)arg;
+  uint64_t stamp;
   int connfd;
   if (pthread_detach(pthread_self()) != 0) fatal_exit(2, "Failed detach thread");
   while(1) {
-      connfd = sbuf_delete(sp);
-      web_handle(&svr, connfd);
-      printf("Close connection from connection %d\n", connfd);
-      if (close(connfd) < 0) fatal_exit(4, "Failed close connection");
+      connfd = sbuf_delete_stamped(sp, &stamp);
+      metrics_time(HIST_QUEUE, stamp);
+      serve_conn(connfd);
   }
 }
-
-void report_client(struct sockaddr_in *client) {
-    char *ip = inet_ntoa(client->sin_addr);
-    printf("Connected from %s\n", ip);
-}
\ No newline at end of file
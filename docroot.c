@@ -0,0 +1,369 @@
+#include "./inc/docroot.h"
+#include "./inc/http.h"
+
+static docent_t tombstone;
+
+// Directories still to be scanned by a (re)scan, shared by its walkers
+typedef struct {
+    docroot_t *dr;
+    doctable_t *table;
+    char **stack;
+    size_t n, cap;
+    int busy;           // walkers in the middle of a directory
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} walk_t;
+
+static unsigned hash_url(const char *url, size_t len) {
+    // FNV-1a
+    unsigned h = 2166136261u;
+    while(len--) {
+        h ^= (unsigned char)*url++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void node_free(docent_t *node) {
+    if (!node || node == &tombstone) return;
+    free(node->url);
+    free(node->path);
+    free(node);
+}
+
+// Mime type and validators for path, formatted once per file version
+void docent_fill(docent_t *doc, char *path, struct stat *st) {
+    doc->path = path;
+    doc->st = *st;
+    doc->mime = get_mime(get_extension(path));
+    cache_etag(st, doc->etag);
+    httpdate_format(st->st_mtime, doc->lastmod);
+}
+
+static docent_t *node_new(const char *url, const char *path, struct stat *st) {
+    docent_t *node = (docent_t *)calloc(1, sizeof(docent_t));
+    char *copy;
+    if (!node) fatal_exit(1, "Failed calloc docroot node");
+    if ((node->url = strdup(url)) == NULL || (copy = strdup(path)) == NULL) fatal_exit(1, "Failed strdup docroot node");
+    node->urllen = strlen(url);
+    node->hash = hash_url(url, node->urllen);
+    docent_fill(node, copy, st);
+    return node;
+}
+
+static doctable_t *table_new(size_t nslots) {
+    doctable_t *table = (doctable_t *)calloc(1, sizeof(doctable_t));
+    if (!table || (table->slots = (docent_t **)calloc(nslots, sizeof(docent_t *))) == NULL) {
+        fatal_exit(1, "Failed calloc docroot table");
+    }
+    table->nslots = nslots;
+    return table;
+}
+
+static void table_free(doctable_t *table) {
+    size_t i;
+    for(i = 0; i < table->nslots; i++) node_free(table->slots[i]);
+    free(table->slots);
+    free(table);
+}
+
+// Slot holding url, or NULL
+static docent_t **table_find(doctable_t *table, const char *url, size_t len, unsigned hash) {
+    size_t mask = table->nslots - 1, i = hash & mask;
+    docent_t *node;
+    while((node = table->slots[i]) != NULL) {
+        if (node != &tombstone && node->hash == hash && node->urllen == len && memcmp(node->url, url, len) == 0) {
+            return &table->slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void table_put(doctable_t *table, docent_t *node);
+
+// double when half full, tombstones are dropped on the way
+static void table_grow(doctable_t *table) {
+    docent_t **old = table->slots;
+    size_t i, n = table->nslots;
+    if ((table->slots = (docent_t **)calloc(n * 2, sizeof(docent_t *))) == NULL) fatal_exit(1, "Failed calloc docroot table");
+    table->nslots = n * 2;
+    table->used = 0;
+    for(i = 0; i < n; i++) {
+        if (old[i] && old[i] != &tombstone) table_put(table, old[i]);
+    }
+    free(old);
+}
+
+// Insert node, replacing and freeing any node with the same url
+static void table_put(doctable_t *table, docent_t *node) {
+    size_t mask, i;
+    docent_t **slot;
+    if ((slot = table_find(table, node->url, node->urllen, node->hash)) != NULL) {
+        node_free(*slot);
+        *slot = node;
+        return;
+    }
+    if ((table->used + 1) * 2 > table->nslots) table_grow(table);
+    mask = table->nslots - 1;
+    i = node->hash & mask;
+    while(table->slots[i] && table->slots[i] != &tombstone) i = (i + 1) & mask;
+    if (!table->slots[i]) table->used++;
+    table->slots[i] = node;
+}
+
+static void table_remove(doctable_t *table, const char *url) {
+    size_t len = strlen(url);
+    docent_t **slot = table_find(table, url, len, hash_url(url, len));
+    if (!slot) return;
+    node_free(*slot);
+    *slot = &tombstone;
+}
+
+// drop url and everything below it, for a directory that went away
+static void table_remove_tree(doctable_t *table, const char *url) {
+    size_t i, len = strlen(url);
+    docent_t *node;
+    for(i = 0; i < table->nslots; i++) {
+        node = table->slots[i];
+        if (!node || node == &tombstone) continue;
+        if (strncmp(node->url, url, len) == 0 && (node->url[len] == 0 || node->url[len] == '/')) {
+            node_free(node);
+            table->slots[i] = &tombstone;
+        }
+    }
+}
+
+static void watch_dir(docroot_t *dr, const char *path, const char *url) {
+    int wd;
+    char **grown;
+    if ((wd = inotify_add_watch(dr->ifd, path, DOCROOT_EVENTS)) < 0) {
+        // still indexed, just not kept fresh
+        fprintf(stderr, "Failed watch %s\n", path);
+        return;
+    }
+    pthread_mutex_lock(&dr->wdlock);
+    if (wd >= dr->nwd) {
+        if ((grown = (char **)realloc(dr->wdurl, (wd + 64) * sizeof(char *))) == NULL) fatal_exit(1, "Failed realloc watches");
+        memset(grown + dr->nwd, 0, (wd + 64 - dr->nwd) * sizeof(char *));
+        dr->wdurl = grown;
+        dr->nwd = wd + 64;
+    }
+    // a directory moved back in keeps its wd, under its new url
+    free(dr->wdurl[wd]);
+    if ((dr->wdurl[wd] = strdup(url)) == NULL) fatal_exit(1, "Failed strdup watch");
+    pthread_mutex_unlock(&dr->wdlock);
+}
+
+static void walk_push(walk_t *walk, const char *url) {
+    pthread_mutex_lock(&walk->lock);
+    if (walk->n == walk->cap) {
+        walk->cap = walk->cap ? walk->cap * 2 : 64;
+        if ((walk->stack = (char **)realloc(walk->stack, walk->cap * sizeof(char *))) == NULL) fatal_exit(1, "Failed realloc walk");
+    }
+    if ((walk->stack[walk->n++] = strdup(url)) == NULL) fatal_exit(1, "Failed strdup walk");
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// Index the files of one directory and queue its subdirectories. Symlinks
+// to files are followed, symlinks to directories are not, so no loops.
+static void walk_dir(walk_t *walk, const char *url) {
+    char path[PATH_MAX], child[PATH_MAX], childurl[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    docent_t *node;
+    DIR *dir;
+    if (snprintf(path, sizeof(path), "%s%s", walk->dr->root, url) >= (int)sizeof(path)) return;
+    watch_dir(walk->dr, path, url);
+    if ((dir = opendir(path)) == NULL) return;
+    while((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+        if (S_ISLNK(st.st_mode) && (fstatat(dirfd(dir), de->d_name, &st, 0) < 0 || S_ISDIR(st.st_mode))) continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= (int)sizeof(child) ||
+            snprintf(childurl, sizeof(childurl), "%s/%s", url, de->d_name) >= (int)sizeof(childurl)) continue;
+        if (S_ISDIR(st.st_mode)) {
+            walk_push(walk, childurl);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        node = node_new(childurl, child, &st);
+        pthread_mutex_lock(&walk->lock);
+        table_put(walk->table, node);
+        // the directory itself serves its default page
+        if (strcmp(de->d_name, DOCROOT_INDEX) == 0) table_put(walk->table, node_new(url, child, &st));
+        pthread_mutex_unlock(&walk->lock);
+    }
+    closedir(dir);
+}
+
+static void *walk_worker(void *arg) {
+    walk_t *walk = (walk_t *)arg;
+    char *url;
+    pthread_mutex_lock(&walk->lock);
+    while(1) {
+        while(walk->n == 0 && walk->busy > 0) pthread_cond_wait(&walk->cond, &walk->lock);
+        if (walk->n == 0) break;
+        url = walk->stack[--walk->n];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+        walk_dir(walk, url);
+        free(url);
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+    }
+    // nothing queued and nobody left to queue more
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+// Index the tree under url into a new table, nthreads directories at a time
+static doctable_t *walk_tree(docroot_t *dr, const char *url, int nthreads) {
+    walk_t walk = { 0 };
+    pthread_t *tids;
+    int i;
+    walk.dr = dr;
+    walk.table = table_new(DOCROOT_SLOTS_MIN);
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    walk_push(&walk, url);
+    if (nthreads <= 1) {
+        walk_worker(&walk);
+    } else {
+        if ((tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t))) == NULL) fatal_exit(1, "Failed malloc walkers");
+        for(i = 0; i < nthreads; i++) {
+            if (pthread_create(&tids[i], NULL, walk_worker, &walk) != 0) fatal_exit(1, "Failed create walker");
+        }
+        for(i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+        free(tids);
+    }
+    free(walk.stack);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.cond);
+    return walk.table;
+}
+
+// Re-stat url (a file, or a directory's default page) and update its node
+static void refresh(docroot_t *dr, const char *url, const char *path) {
+    struct stat st;
+    docent_t *node = NULL;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) node = node_new(url, path, &st);
+    pthread_rwlock_wrlock(&dr->lock);
+    if (node) table_put(dr->table, node);
+    else table_remove(dr->table, url);
+    pthread_rwlock_unlock(&dr->lock);
+}
+
+static void handle_event(docroot_t *dr, struct inotify_event *ev) {
+    char dirurl[PATH_MAX], url[PATH_MAX], path[PATH_MAX];
+    doctable_t *sub, *old;
+    size_t i;
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // events were lost, start over from scratch
+        sub = walk_tree(dr, "", dr->nthreads);
+        pthread_rwlock_wrlock(&dr->lock);
+        old = dr->table;
+        dr->table = sub;
+        pthread_rwlock_unlock(&dr->lock);
+        table_free(old);
+        return;
+    }
+    pthread_mutex_lock(&dr->wdlock);
+    if (ev->wd < 0 || ev->wd >= dr->nwd || !dr->wdurl[ev->wd]) {
+        pthread_mutex_unlock(&dr->wdlock);
+        return;
+    }
+    strcpy(dirurl, dr->wdurl[ev->wd]);
+    if (ev->mask & IN_IGNORED) {
+        free(dr->wdurl[ev->wd]);
+        dr->wdurl[ev->wd] = NULL;
+    }
+    pthread_mutex_unlock(&dr->wdlock);
+    if (!ev->len) return;
+    if (snprintf(url, sizeof(url), "%s/%s", dirurl, ev->name) >= (int)sizeof(url) ||
+        snprintf(path, sizeof(path), "%s%s", dr->root, url) >= (int)sizeof(path)) return;
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            // a new subtree, indexed on the side and merged in one go
+            sub = walk_tree(dr, url, 1);
+            pthread_rwlock_wrlock(&dr->lock);
+            for(i = 0; i < sub->nslots; i++) {
+                if (sub->slots[i] && sub->slots[i] != &tombstone) table_put(dr->table, sub->slots[i]);
+                sub->slots[i] = NULL;
+            }
+            pthread_rwlock_unlock(&dr->lock);
+            table_free(sub);
+        } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            pthread_rwlock_wrlock(&dr->lock);
+            table_remove_tree(dr->table, url);
+            pthread_rwlock_unlock(&dr->lock);
+        }
+        return;
+    }
+    refresh(dr, url, path);
+    if (strcmp(ev->name, DOCROOT_INDEX) == 0) refresh(dr, dirurl, path);
+}
+
+static void *watch_loop(void *arg) {
+    docroot_t *dr = (docroot_t *)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    while(1) {
+        if ((n = read(dr->ifd, buf, sizeof(buf))) <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            fatal_exit(1, "Failed read inotify");
+        }
+        for(p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)p;
+            handle_event(dr, ev);
+        }
+    }
+    return NULL;
+}
+
+// Index root with nthreads walkers and keep the index fresh from then on
+docroot_t *docroot_create(const char *root, int nthreads) {
+    docroot_t *dr = (docroot_t *)calloc(1, sizeof(docroot_t));
+    pthread_rwlockattr_t attr;
+    size_t i, n = 0;
+    if (!dr) fatal_exit(1, "Failed calloc docroot");
+    dr->root = root;
+    dr->nthreads = nthreads;
+    // a steady stream of lookups must not starve the watcher
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&dr->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&dr->wdlock, NULL);
+    if ((dr->ifd = inotify_init1(IN_CLOEXEC)) < 0) fatal_exit(1, "Failed inotify_init");
+    dr->table = walk_tree(dr, "", nthreads);
+    for(i = 0; i < dr->table->nslots; i++) {
+        if (dr->table->slots[i] && dr->table->slots[i] != &tombstone) n++;
+    }
+    printf("Indexed %zu paths under %s\n", n, root);
+    if (pthread_create(&dr->watcher, NULL, watch_loop, dr) != 0) fatal_exit(1, "Failed create docroot watcher");
+    return dr;
+}
+
+// Copy what url resolves to into doc, its path into buf. Trailing slashes
+// don't matter. Returns FAILED for anything not in the index, i.e. a 404.
+int docroot_lookup(docroot_t *dr, const char *url, docent_t *doc, char *buf, size_t cap) {
+    size_t len = strlen(url);
+    docent_t **slot;
+    int ret = FAILED;
+    while(len && url[len - 1] == '/') len--;
+    pthread_rwlock_rdlock(&dr->lock);
+    if ((slot = table_find(dr->table, url, len, hash_url(url, len))) != NULL && strlen((*slot)->path) < cap) {
+        *doc = **slot;
+        strcpy(buf, (*slot)->path);
+        doc->path = buf;
+        doc->url = NULL;
+        ret = OK;
+    }
+    pthread_rwlock_unlock(&dr->lock);
+    return ret;
+}
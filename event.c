@@ -0,0 +1,105 @@
+#include "./inc/event.h"
+
+void loop_init(loop_t *lp, int id, int listenfd, server_t *app) {
+    struct epoll_event ev;
+    lp->id = id;
+    lp->listenfd = listenfd;
+    lp->app = app;
+    lp->now = wheel_ticks();
+    wheel_init(&lp->wheel, lp->now);
+    if ((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) fatal_exit(1, "Failed create epoll");
+    // listen socket is marked by a NULL pointer. When shared, EPOLLEXCLUSIVE
+    // wakes only one loop per connection; with reuseport it is the loop's own
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) fatal_exit(1, "Failed watch listen socket");
+}
+
+static void loop_close(loop_t *lp, conn_t *conn) {
+    wheel_cancel(&lp->wheel, &conn->timer);
+    conn_close(conn);
+    free(conn);
+}
+
+static void loop_expired(wtimer_t *timer, void *arg) {
+    conn_t *conn = (conn_t *)((char *)timer - offsetof(conn_t, timer));
+    conn_timed_out(conn);
+    loop_close((loop_t *)arg, conn);
+}
+
+static void loop_accept(loop_t *lp) {
+    int connfd;
+    struct sockaddr_in client;
+    socklen_t clientlen = sizeof(client);
+    struct epoll_event ev;
+    conn_t *conn;
+    while(1) {
+        connfd = accept4(lp->listenfd, (SA *)&client, &clientlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAIN means drained; anything else (EMFILE...) must not kill the loop
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        PROBE1(accept, connfd);
+        if (conn_admit(lp->app) != OK) {
+            conn_shed(connfd);
+            continue;
+        }
+        if ((conn = (conn_t *)malloc(sizeof(conn_t))) == NULL) {
+            close(connfd);
+            continue;
+        }
+        conn_init(conn, connfd);
+        conn->peer = client.sin_addr;
+        conn->epfd = lp->epfd;
+        // register for both directions once, edge-triggered, never modified afterwards
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            conn_close(conn);
+            free(conn);
+            continue;
+        }
+        conn_deadline(lp->app, &lp->wheel, conn, lp->now);
+    }
+}
+
+void *loop_run(void *arg) {
+    loop_t *lp = (loop_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    conn_t *conn;
+    int n, i, j;
+    if (lp->app->pin) pin_cpu(lp->id);
+    while(1) {
+        // with deadlines armed, wake up every tick to expire them
+        n = epoll_wait(lp->epfd, events, MAX_EVENTS, lp->wheel.count ? WHEEL_TICK_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fatal_exit(3, "Failed wait events");
+        }
+        lp->now = wheel_ticks();
+        for(i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                loop_accept(lp);
+                continue;
+            }
+            // an event of a connection closed earlier in this batch
+            if (events[i].data.ptr == lp) continue;
+            conn = (conn_t *)events[i].data.ptr;
+            if (conn_drive(lp->app, conn) == CONN_CLOSE) {
+                // its upstream may have reported in the same batch
+                if (conn->px) {
+                    for(j = i + 1; j < n; j++) {
+                        if (events[j].data.ptr == conn) events[j].data.ptr = lp;
+                    }
+                }
+                loop_close(lp, conn);
+            } else {
+                conn_deadline(lp->app, &lp->wheel, conn, lp->now);
+            }
+        }
+        wheel_advance(&lp->wheel, lp->now, loop_expired, lp);
+    }
+    return NULL;
+}
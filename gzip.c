@@ -0,0 +1,146 @@
+#include <ftw.h>
+#include "./inc/gzip.h"
+#include "./inc/http.h"
+
+// Files found by the precompress walk, handed out to workers by index
+static char **todo;
+static size_t ntodo, captodo, nextdo;
+
+// Whether an Accept-Encoding value allows gzip, honoring q=0 and *
+int gzip_accepted(const char *value) {
+    const char *p = value, *end, *q;
+    size_t len;
+    int gzip = -1, star = -1, on;
+    while(*p) {
+        while(*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (!*p) break;
+        if ((end = strchr(p, ',')) == NULL) end = p + strlen(p);
+        for(len = 0; p + len < end && p[len] != ';' && p[len] != ' ' && p[len] != '\t'; len++);
+        // only a zero weight turns a coding off
+        on = 1;
+        for(q = p + len; q + 1 < end; q++) {
+            if ((*q == 'q' || *q == 'Q') && q[1] == '=') {
+                on = strtod(q + 2, NULL) > 0;
+                break;
+            }
+        }
+        if ((len == 4 && strncasecmp(p, "gzip", 4) == 0) || (len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            gzip = on;
+        } else if (len == 1 && *p == '*') {
+            star = on;
+        }
+        p = end;
+    }
+    return gzip > 0 || (gzip < 0 && star > 0);
+}
+
+// Text formats compress well, images and archives already are compressed
+int gzip_compressible(const char *mime) {
+    if (!mime) return 0;
+    return strncmp(mime, "text/", 5) == 0 || strstr(mime, "javascript") || strstr(mime, "json") ||
+           strstr(mime, "xml") || strstr(mime, "svg");
+}
+
+// gzip n bytes of in into a malloc'ed buffer. Returns NULL when that fails or
+// doesn't make the body smaller.
+char *gzip_compress(const char *in, size_t n, size_t *outlen) {
+    z_stream zs;
+    char *out;
+    size_t cap;
+    memset(&zs, 0, sizeof(zs));
+    // 16 + MAX_WBITS asks for a gzip header and trailer rather than raw zlib
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    cap = deflateBound(&zs, n) + 18;
+    if ((out = (char *)malloc(cap)) == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = n;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= n) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *outlen = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+// Stream path into path.gz through a temporary file, renamed into place
+// only once complete so the server never picks up half a sibling
+static int gzip_file(const char *path) {
+    char dest[URI_LEN_MAX], tmp[URI_LEN_MAX + 8];
+    char buf[1 << 16];
+    gzFile gz;
+    int fd, n;
+    snprintf(dest, sizeof(dest), "%s%s", path, GZIP_SUFFIX);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dest);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return FAILED;
+    if ((gz = gzopen(tmp, "wb6")) == NULL) {
+        close(fd);
+        return FAILED;
+    }
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (gzwrite(gz, buf, n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    close(fd);
+    if (gzclose(gz) != Z_OK || n < 0 || rename(tmp, dest) < 0) {
+        unlink(tmp);
+        return FAILED;
+    }
+    return OK;
+}
+
+static int collect(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    char sibling[URI_LEN_MAX];
+    struct stat gzst;
+    const char *ext = get_extension(path);
+    (void)ftw;
+    if (flag != FTW_F || !S_ISREG(st->st_mode) || st->st_size < GZIP_MIN_SIZE) return 0;
+    if (!ext || strcmp(ext, "gz") == 0 || !gzip_compressible(get_mime(ext))) return 0;
+    // an up to date sibling is left alone
+    if (snprintf(sibling, sizeof(sibling), "%s%s", path, GZIP_SUFFIX) >= (int)sizeof(sibling)) return 0;
+    if (stat(sibling, &gzst) == 0 && gzst.st_mtime >= st->st_mtime) return 0;
+    if (ntodo == captodo) {
+        captodo = captodo ? captodo * 2 : 64;
+        if ((todo = (char **)realloc(todo, captodo * sizeof(char *))) == NULL) fatal_exit(1, "Failed realloc precompress list");
+    }
+    if ((todo[ntodo++] = strdup(path)) == NULL) fatal_exit(1, "Failed strdup precompress path");
+    return 0;
+}
+
+static void *precompress_worker(void *arg) {
+    size_t i;
+    (void)arg;
+    while((i = __atomic_fetch_add(&nextdo, 1, __ATOMIC_RELAXED)) < ntodo) {
+        if (gzip_file(todo[i]) != OK) fprintf(stderr, "Failed precompress %s\n", todo[i]);
+    }
+    return NULL;
+}
+
+// Write a .gz sibling next to every compressible file under root that lacks
+// an up to date one, nthreads files at a time. Runs once before serving.
+void gzip_precompress(const char *root, int nthreads) {
+    pthread_t *tids;
+    size_t i;
+    int t;
+    if (nftw(root, collect, 16, FTW_PHYS) < 0) fatal_exit(1, "Failed walk document root");
+    if (nthreads < 1) nthreads = 1;
+    if ((tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t))) == NULL) fatal_exit(1, "Failed malloc precompress threads");
+    for(t = 0; t < nthreads; t++) {
+        if (pthread_create(&tids[t], NULL, precompress_worker, NULL) != 0) fatal_exit(1, "Failed create precompress thread");
+    }
+    for(t = 0; t < nthreads; t++) pthread_join(tids[t], NULL);
+    printf("Precompressed %zu files\n", ntodo);
+    for(i = 0; i < ntodo; i++) free(todo[i]);
+    free(todo);
+    free(tids);
+    todo = NULL;
+    ntodo = captodo = nextdo = 0;
+}
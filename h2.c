@@ -0,0 +1,691 @@
+#include "./inc/h2.h"
+
+static const char upgrade_reply[] = "HTTP/1.1 101 Switching Protocols" CRLF
+                                    "Connection: Upgrade" CRLF
+                                    "Upgrade: h2c" CRLF CRLF;
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Copy n bytes to conn->out and queue them, merging with what precedes
+static void out_bytes(conn_t *conn, const void *buf, size_t n) {
+    memcpy(conn->out + conn->outlen, buf, n);
+    conn_queue(conn, conn->out + conn->outlen, n);
+    conn->outlen += n;
+}
+
+static void put_frame(conn_t *conn, uint32_t len, int type, int flags, uint32_t id) {
+    unsigned char h[H2_FRAME_HEADER] = {
+        len >> 16, len >> 8, len, type, flags, (id >> 24) & 0x7f, id >> 16, id >> 8, id
+    };
+    out_bytes(conn, h, sizeof(h));
+}
+
+static void put_u32(conn_t *conn, uint32_t v) {
+    unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+    out_bytes(conn, b, sizeof(b));
+}
+
+static void send_rst(conn_t *conn, uint32_t id, uint32_t code) {
+    put_frame(conn, 4, H2_RST_STREAM, 0, id);
+    put_u32(conn, code);
+}
+
+static void send_window_update(conn_t *conn, uint32_t id, uint32_t n) {
+    put_frame(conn, 4, H2_WINDOW_UPDATE, 0, id);
+    put_u32(conn, n);
+}
+
+static void send_goaway(conn_t *conn, h2_t *h2, uint32_t code) {
+    put_frame(conn, 8, H2_GOAWAY, 0, 0);
+    put_u32(conn, h2->last_id);
+    put_u32(conn, code);
+    h2->goaway = 1;
+}
+
+// Connection error: say why, then close once that is written
+static int h2_fail(conn_t *conn, h2_t *h2, uint32_t code) {
+    send_goaway(conn, h2, code);
+    h2->failed = 1;
+    conn->keep_alive = 0;
+    return FAILED;
+}
+
+static h2stream_t *stream_find(h2_t *h2, uint32_t id) {
+    h2stream_t *s;
+    for(s = h2->streams; s; s = s->next) {
+        if (s->id == id) return s;
+    }
+    return NULL;
+}
+
+static h2stream_t *stream_new(h2_t *h2, uint32_t id) {
+    h2stream_t *s = (h2stream_t *)malloc(sizeof(h2stream_t));
+    if (!s) fatal_exit(1, "Failed allocate stream");
+    s->id = id;
+    s->state = H2S_HEADERS;
+    s->remote_closed = 0;
+    s->head = 0;
+    s->window = h2->peer_window;
+    arena_init(&s->arena);
+    res_init(&s->res, &s->arena);
+    s->bodysent = 0;
+    s->part = 0;
+    s->partsent = 0;
+    s->next = NULL;
+    if (h2->tail) h2->tail->next = s;
+    else h2->streams = s;
+    h2->tail = s;
+    h2->nstreams++;
+    return s;
+}
+
+static void stream_free(h2_t *h2, h2stream_t *s) {
+    h2stream_t **pp, *prev = NULL;
+    for(pp = &h2->streams; *pp != s; pp = &(*pp)->next) prev = *pp;
+    *pp = s->next;
+    if (h2->tail == s) h2->tail = prev;
+    h2->nstreams--;
+    free_response(&s->res);
+    arena_free(&s->arena);
+    free(s);
+}
+
+// Make s the head of the round robin, it was next in line when a round ran out
+static void stream_rotate(h2_t *h2, h2stream_t *prev, h2stream_t *s) {
+    if (!prev) return;
+    h2->tail->next = h2->streams;
+    h2->streams = s;
+    prev->next = NULL;
+    h2->tail = prev;
+}
+
+// Start speaking HTTP/2 on conn, our SETTINGS first
+void h2_start(conn_t *conn) {
+    h2_t *h2 = (h2_t *)malloc(sizeof(h2_t));
+    if (!h2) fatal_exit(1, "Failed allocate HTTP/2 session");
+    h2->preface = 1;
+    h2->goaway = h2->failed = 0;
+    hpack_init(&h2->dec);
+    hpack_init(&h2->enc);
+    h2->window = H2_WINDOW;
+    h2->peer_window = H2_WINDOW;
+    h2->peer_frame = H2_FRAME_MAX;
+    h2->recv = 0;
+    h2->last_id = 0;
+    h2->nstreams = 0;
+    h2->streams = h2->tail = NULL;
+    h2->cont = 0;
+    h2->cont_end = 0;
+    h2->block = NULL;
+    h2->blocklen = 0;
+    h2->inpos = h2->inlen = 0;
+    h2->filelen = 0;
+    conn->h2 = h2;
+    conn->keep_alive = 1;
+    put_frame(conn, 6, H2_SETTINGS, 0, 0);
+    out_bytes(conn, "\0\x03", 2);
+    put_u32(conn, H2_STREAMS_MAX);
+}
+
+void h2_free(conn_t *conn) {
+    h2_t *h2 = conn->h2;
+    if (!h2) return;
+    while(h2->streams) stream_free(h2, h2->streams);
+    hpack_free(&h2->dec);
+    hpack_free(&h2->enc);
+    free(h2->block);
+    free(h2);
+    conn->h2 = NULL;
+}
+
+// Whether rio starts like the prior knowledge preface, on a fresh connection
+int h2_preface(conn_t *conn) {
+    size_t n = conn->rio.unread < H2_PREFACE_LEN ? conn->rio.unread : H2_PREFACE_LEN;
+    return conn->requests == 0 && n > 0 && memcmp(conn->rio.cursor, H2_PREFACE, n) == 0;
+}
+
+// A SETTINGS payload from the client, FAILED with the connection error code in *code
+static int apply_settings(h2_t *h2, const unsigned char *p, size_t len, uint32_t *code) {
+    h2stream_t *s;
+    uint32_t value;
+    int64_t delta;
+    for(; len >= 6; p += 6, len -= 6) {
+        value = get_u32(p + 2);
+        switch(p[0] << 8 | p[1]) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_resize(&h2->enc, value);
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    *code = H2_PROTOCOL_ERROR;
+                    return FAILED;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_WINDOW_MAX) {
+                    *code = H2_FLOW_CONTROL_ERROR;
+                    return FAILED;
+                }
+                // applies to open streams too, possibly leaving them negative
+                delta = (int64_t)value - h2->peer_window;
+                for(s = h2->streams; s; s = s->next) s->window += delta;
+                h2->peer_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_FRAME_MAX || value > 0xffffff) {
+                    *code = H2_PROTOCOL_ERROR;
+                    return FAILED;
+                }
+                h2->peer_frame = value;
+                break;
+        }
+    }
+    return OK;
+}
+
+// HTTP2-Settings is base64url, unpadded
+static int decode_settings(const char *value, unsigned char *out, size_t cap, size_t *outlen) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const char *pos;
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for(; *value && *value != '='; value++) {
+        if ((pos = strchr(alphabet, *value)) == NULL) return FAILED;
+        acc = acc << 6 | (pos - alphabet);
+        if ((bits += 6) >= 8) {
+            if (n == cap) return FAILED;
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    *outlen = n;
+    return n % 6 == 0 ? OK : FAILED;
+}
+
+// Building a req_t out of a decoded header block
+typedef struct {
+    req_t *req;
+    header_t *last;
+    char *path;
+    int regular;    // a regular field was seen, pseudo ones must come first
+    int bad;        // malformed, the stream is reset
+} fields_t;
+
+static int add_field(void *arg, char *name, size_t namelen, char *value, size_t valuelen) {
+    fields_t *fp = (fields_t *)arg;
+    req_t *req = fp->req;
+    header_t *header;
+    size_t i;
+    if (name[0] == ':') {
+        if (fp->regular) fp->bad = 1;
+        else if (strcmp(name, ":method") == 0) {
+            if (valuelen >= sizeof(req->method)) fp->bad = 1;
+            else memcpy(req->method, value, valuelen + 1);
+        } else if (strcmp(name, ":path") == 0) {
+            fp->path = arena_strndup(req->arena, value, valuelen);
+        } else if (strcmp(name, ":authority") == 0) {
+            // stands in for Host
+            name = "host";
+            namelen = 4;
+        } else if (strcmp(name, ":scheme") != 0) {
+            fp->bad = 1;
+        }
+        if (name[0] == ':') return OK;
+    }
+    fp->regular = 1;
+    for(i = 0; i < namelen; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') fp->bad = 1;
+    }
+    // connection specific fields have no place in HTTP/2
+    if (strcmp(name, "connection") == 0) fp->bad = 1;
+    header = (header_t *)arena_alloc(req->arena, sizeof(header_t));
+    header->name = name;
+    header->value = value;
+    header->namelen = namelen;
+    header->valuelen = valuelen;
+    header->next = NULL;
+    if (fp->last) fp->last->next = header;
+    else req->header = header;
+    fp->last = header;
+    return OK;
+}
+
+// Answer req on s right away, the way web_handle does on HTTP/1
+static void stream_respond(server_t *app, conn_t *conn, h2stream_t *s, req_t *req, uint64_t stamp) {
+    res_t *res = &s->res;
+    int ret = FAILED;
+    PROBE3(startline, conn->fd, (char *)req->method, req->location ? req->location->path : "");
+    stamp = metrics_time(HIST_PARSE, stamp);
+    if (!req->location) res->status = 400;
+    else if (check_method(req->method) != OK) res->status = 405;
+    else ret = handle_request(app, req, res);
+    // upstreams are only relayed to HTTP/1 connections
+    if (ret == OK && res->route) {
+        res->route = NULL;
+        res->status = 502;
+        ret = FAILED;
+    }
+    metrics_time(HIST_LOOKUP, stamp);
+    PROBE4(resolved, conn->fd, req->location ? req->location->path : "", res->status, res->length);
+    if (ret != OK) error_response(res);
+    s->head = strcmp(req->method, "HEAD") == 0;
+    if (accesslog_enabled()) log_request(conn->peer, req, res, "HTTP/2.0");
+}
+
+static int skip_field(void *arg, char *name, size_t namelen, char *value, size_t valuelen) {
+    (void)arg;
+    (void)name;
+    (void)namelen;
+    (void)value;
+    (void)valuelen;
+    return OK;
+}
+
+// A whole header block for stream id: a new request, or trailers to skip.
+// Every block is decoded, or the client's table and ours drift apart.
+static int h2_headers(server_t *app, conn_t *conn, h2_t *h2, uint32_t id, int isnew, int end,
+                      const unsigned char *block, size_t len) {
+    uint64_t stamp = mono_ns();
+    h2stream_t *s;
+    fields_t fields;
+    req_t req;
+    PROBE2(request, conn->fd, len);
+    if (!isnew || h2->goaway || h2->nstreams >= H2_STREAMS_MAX) {
+        if (hpack_decode(&h2->dec, block, len, &conn->arena, skip_field, NULL) != OK) {
+            return h2_fail(conn, h2, H2_COMPRESSION_ERROR);
+        }
+        if (isnew) {
+            send_rst(conn, id, H2_REFUSED_STREAM);
+        } else if ((s = stream_find(h2, id)) == NULL || s->remote_closed) {
+            // the client already ended the stream, or it was refused, reset or answered
+            send_rst(conn, id, H2_STREAM_CLOSED);
+        } else if (end) {
+            s->remote_closed = 1;
+        }
+        return OK;
+    }
+    s = stream_new(h2, id);
+    req_init(&req, &s->arena);
+    req.method[0] = 0;
+    fields.req = &req;
+    fields.last = NULL;
+    fields.path = NULL;
+    fields.regular = fields.bad = 0;
+    if (hpack_decode(&h2->dec, block, len, &s->arena, add_field, &fields) != OK) {
+        return h2_fail(conn, h2, H2_COMPRESSION_ERROR);
+    }
+    s->remote_closed = end;
+    if (fields.bad || !req.method[0] || !fields.path) {
+        send_rst(conn, id, H2_PROTOCOL_ERROR);
+        stream_free(h2, s);
+        return OK;
+    }
+    conn->requests++;
+    METRIC_ADD(requests, 1);
+    req.location = (location_t *)arena_alloc(req.arena, sizeof(location_t));
+    if (parse_location(fields.path, req.location) != OK) req.location = NULL;
+    stream_respond(app, conn, s, &req, stamp);
+    if (app->max_requests > 0 && conn->requests >= app->max_requests && !h2->goaway) {
+        // like -k on HTTP/1: what was asked for is answered, nothing more
+        send_goaway(conn, h2, H2_NO_ERROR);
+    }
+    return OK;
+}
+
+// Handle one whole frame. FAILED on a connection error, the GOAWAY queued.
+static int h2_frame(server_t *app, conn_t *conn, h2_t *h2, int type, int flags, uint32_t id,
+                    const unsigned char *p, uint32_t len) {
+    h2stream_t *s;
+    uint32_t code, n;
+    size_t pad = 0;
+    if (h2->cont && (type != H2_CONTINUATION || id != h2->cont)) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+    switch(type) {
+        case H2_DATA:
+            if (id == 0 || (id > h2->last_id)) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            if ((flags & H2_PADDED) && (len == 0 || p[0] >= len)) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            // bodies are not read, only taken off the window
+            if (len > H2_WINDOW - h2->recv) return h2_fail(conn, h2, H2_FLOW_CONTROL_ERROR);
+            if ((h2->recv += len) >= H2_WINDOW / 2) {
+                send_window_update(conn, 0, h2->recv);
+                h2->recv = 0;
+            }
+            if ((s = stream_find(h2, id)) != NULL) {
+                if (s->remote_closed) send_rst(conn, id, H2_STREAM_CLOSED);
+                else if (flags & H2_END_STREAM) s->remote_closed = 1;
+            }
+            return OK;
+        case H2_HEADERS:
+            if (id == 0 || !(id & 1)) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            if (flags & H2_PADDED) {
+                if (len == 0) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+                pad = p[0];
+                p++;
+                len--;
+            }
+            if (flags & H2_PRIORITY_FLAG) {
+                if (len < 5) return h2_fail(conn, h2, H2_FRAME_SIZE_ERROR);
+                p += 5;
+                len -= 5;
+            }
+            if (pad > len) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            len -= pad;
+            h2->cont_new = id > h2->last_id;
+            if (h2->cont_new) h2->last_id = id;
+            if (flags & H2_END_HEADERS) {
+                return h2_headers(app, conn, h2, id, h2->cont_new, flags & H2_END_STREAM, p, len);
+            }
+            if (!h2->block && (h2->block = (unsigned char *)malloc(H2_BLOCK_MAX)) == NULL) {
+                fatal_exit(1, "Failed allocate header block");
+            }
+            memcpy(h2->block, p, len);
+            h2->blocklen = len;
+            h2->cont = id;
+            h2->cont_end = flags & H2_END_STREAM;
+            return OK;
+        case H2_CONTINUATION:
+            if (!h2->cont) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            if (len > H2_BLOCK_MAX - h2->blocklen) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            memcpy(h2->block + h2->blocklen, p, len);
+            h2->blocklen += len;
+            if (!(flags & H2_END_HEADERS)) return OK;
+            h2->cont = 0;
+            return h2_headers(app, conn, h2, id, h2->cont_new, h2->cont_end, h2->block, h2->blocklen);
+        case H2_PRIORITY:
+            // no scheduling by priority, every stream gets its turn
+            if (id == 0) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            if (len != 5) send_rst(conn, id, H2_FRAME_SIZE_ERROR);
+            return OK;
+        case H2_RST_STREAM:
+            if (len != 4) return h2_fail(conn, h2, H2_FRAME_SIZE_ERROR);
+            if (id == 0 || id > h2->last_id) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            // nothing queued refers to it, the last round is written
+            if ((s = stream_find(h2, id)) != NULL) stream_free(h2, s);
+            return OK;
+        case H2_SETTINGS:
+            if (id != 0) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            if (flags & H2_ACK) return len ? h2_fail(conn, h2, H2_FRAME_SIZE_ERROR) : OK;
+            if (len % 6) return h2_fail(conn, h2, H2_FRAME_SIZE_ERROR);
+            if (apply_settings(h2, p, len, &code) != OK) return h2_fail(conn, h2, code);
+            put_frame(conn, 0, H2_SETTINGS, H2_ACK, 0);
+            return OK;
+        case H2_PING:
+            if (id != 0) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            if (len != 8) return h2_fail(conn, h2, H2_FRAME_SIZE_ERROR);
+            if (!(flags & H2_ACK)) {
+                put_frame(conn, 8, H2_PING, H2_ACK, 0);
+                out_bytes(conn, p, 8);
+            }
+            return OK;
+        case H2_GOAWAY:
+            if (id != 0) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+            // the client is leaving, what is open gets finished
+            h2->goaway = 1;
+            return OK;
+        case H2_WINDOW_UPDATE:
+            if (len != 4) return h2_fail(conn, h2, H2_FRAME_SIZE_ERROR);
+            n = get_u32(p) & 0x7fffffff;
+            if (id == 0) {
+                if (n == 0) return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+                if ((h2->window += n) > H2_WINDOW_MAX) return h2_fail(conn, h2, H2_FLOW_CONTROL_ERROR);
+                return OK;
+            }
+            if ((s = stream_find(h2, id)) == NULL) return OK;
+            if (n == 0 || (s->window += n) > H2_WINDOW_MAX) {
+                send_rst(conn, id, n ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                stream_free(h2, s);
+            }
+            return OK;
+        case H2_PUSH_PROMISE:
+            return h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+        default:
+            // unknown types are ignored
+            return OK;
+    }
+}
+
+// Take what rio holds, leaving a partial frame at the start of the buffer
+static void h2_pull(conn_t *conn, h2_t *h2) {
+    size_t n;
+    if (conn->rio.unread <= 0) return;
+    if (h2->inpos) {
+        memmove(h2->in, h2->in + h2->inpos, h2->inlen - h2->inpos);
+        h2->inlen -= h2->inpos;
+        h2->inpos = 0;
+    }
+    n = sizeof(h2->in) - h2->inlen;
+    if (n > (size_t)conn->rio.unread) n = conn->rio.unread;
+    memcpy(h2->in + h2->inlen, conn->rio.cursor, n);
+    h2->inlen += n;
+    rio_consume(&conn->rio, n);
+}
+
+// Handle every whole frame buffered, as long as their replies fit
+static void h2_input(server_t *app, conn_t *conn, h2_t *h2) {
+    unsigned char *p;
+    uint32_t len;
+    while(!h2->failed) {
+        h2_pull(conn, h2);
+        p = h2->in + h2->inpos;
+        if (h2->preface) {
+            if (h2->inlen - h2->inpos < H2_PREFACE_LEN) return;
+            if (memcmp(p, H2_PREFACE, H2_PREFACE_LEN) != 0) {
+                h2_fail(conn, h2, H2_PROTOCOL_ERROR);
+                return;
+            }
+            h2->inpos += H2_PREFACE_LEN;
+            h2->preface = 0;
+            continue;
+        }
+        if (h2->inlen - h2->inpos < H2_FRAME_HEADER) return;
+        len = (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+        if (len > H2_FRAME_MAX) {
+            h2_fail(conn, h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (h2->inlen - h2->inpos < H2_FRAME_HEADER + len) return;
+        if (OUT_BUF_MAX - conn->outlen < H2_CONTROL_ROOM || conn->niov >= CONN_IOV_MAX) return;
+        h2->inpos += H2_FRAME_HEADER + len;
+        h2_frame(app, conn, h2, p[3], p[4], get_u32(p + 5) & 0x7fffffff, p + H2_FRAME_HEADER, len);
+    }
+}
+
+// Done with s's side: the client's too, or told to stop sending
+static void stream_done(conn_t *conn, h2stream_t *s) {
+    s->state = H2S_DONE;
+    if (!s->remote_closed) send_rst(conn, s->id, H2_NO_ERROR);
+}
+
+// Queue the response head of s, FAILED when it has to wait for room
+static int stream_head(conn_t *conn, h2_t *h2, h2stream_t *s) {
+    res_t *res = &s->res;
+    unsigned char *block;
+    const dateline_t *date = httpdate_line();
+    size_t len = 0, cap = HDR_LEN_MAX;
+    char status[8], length[24];
+    header_t *header;
+    int body;
+    if (OUT_BUF_MAX - conn->outlen < H2_FRAME_HEADER + HDR_LEN_MAX + H2_CONTROL_ROOM) return FAILED;
+    block = (unsigned char *)conn->out + conn->outlen + H2_FRAME_HEADER;
+    len = hpack_begin(&h2->enc, block, len, cap);
+    len = hpack_encode(&h2->enc, block, len, cap, ":status", 7, status, snprintf(status, sizeof(status), "%d", res->status), 1);
+    for(header = res->header; header; header = header->next) {
+        len = hpack_encode(&h2->enc, block, len, cap, header->name, header->namelen, header->value, header->valuelen,
+                           strcasecmp(header->name, "Content-Range") != 0);
+    }
+    len = hpack_encode(&h2->enc, block, len, cap, "server", 6, SERVER_NAME, sizeof(SERVER_NAME) - 1, 1);
+    len = hpack_encode(&h2->enc, block, len, cap, "date", 4, date->line + 6, HTTPDATE_LEN, 1);
+    if (res->status != 204 && res->status != 304) {
+        len = hpack_encode(&h2->enc, block, len, cap, "content-length", 14, length,
+                           snprintf(length, sizeof(length), "%zu", res->length), 0);
+    }
+    body = res->length > 0 && !s->head && res->status != 204 && res->status != 304;
+    METRIC_STATUS(res->status);
+    PROBE3(response, conn->fd, res->status, res->length);
+    // the block is in place already, its frame header goes in front
+    put_frame(conn, len, H2_HEADERS, H2_END_HEADERS | (body ? 0 : H2_END_STREAM), s->id);
+    conn_queue(conn, conn->out + conn->outlen, len);
+    conn->outlen += len;
+    if (body) s->state = H2S_DATA;
+    else stream_done(conn, s);
+    return OK;
+}
+
+// Next contiguous piece of s's body, in memory at *buf or else in the file
+// at *off, the same walk conn_send_parts does. Its length, 0 once all sent.
+static size_t stream_segment(h2stream_t *s, char **buf, off_t *off) {
+    res_t *res = &s->res;
+    range_t *part;
+    size_t done;
+    *buf = NULL;
+    *off = 0;
+    if (!res->nranges) {
+        *buf = res->fd >= 0 ? NULL : res->body + s->bodysent;
+        *off = res->offset + s->bodysent;
+        return res->length - s->bodysent;
+    }
+    while(s->part <= res->nranges) {
+        part = &res->ranges[s->part];
+        if (s->partsent < part->headlen) {
+            *buf = part->head + s->partsent;
+            return part->headlen - s->partsent;
+        }
+        if ((done = s->partsent - part->headlen) < part->len) {
+            *buf = res->fd >= 0 ? NULL : res->body + part->start + done;
+            *off = part->start + done;
+            return part->len - done;
+        }
+        s->part++;
+        s->partsent = 0;
+    }
+    return 0;
+}
+
+// Queue one DATA frame of s as windows allow. 1 if queued, 0 if it has to
+// wait, FAILED when its file can't be read.
+static int stream_data(conn_t *conn, h2_t *h2, h2stream_t *s) {
+    char *buf;
+    off_t off;
+    size_t n = stream_segment(s, &buf, &off);
+    ssize_t got;
+    int end;
+    if ((int64_t)n > s->window) n = s->window > 0 ? s->window : 0;
+    if ((int64_t)n > h2->window) n = h2->window > 0 ? h2->window : 0;
+    if (n > h2->peer_frame) n = h2->peer_frame;
+    if (n > H2_FRAME_MAX) n = H2_FRAME_MAX;
+    if (!buf) {
+        // read into this round's file buffer, written before it is reused
+        if (n > H2_FILE_BUF - h2->filelen) n = H2_FILE_BUF - h2->filelen;
+        if (n == 0) return 0;
+        if ((got = pread(s->res.fd, h2->file + h2->filelen, n, off)) <= 0) return FAILED;
+        n = got;
+        buf = h2->file + h2->filelen;
+        h2->filelen += n;
+    }
+    if (n == 0) return 0;
+    end = s->bodysent + n == s->res.length;
+    put_frame(conn, n, H2_DATA, end ? H2_END_STREAM : 0, s->id);
+    // small payloads share the frame header's segment
+    if (n <= H2_COPY_MAX && OUT_BUF_MAX - conn->outlen >= n + H2_CONTROL_ROOM) out_bytes(conn, buf, n);
+    else conn_queue(conn, buf, n);
+    s->bodysent += n;
+    s->partsent += n;
+    s->window -= n;
+    h2->window -= n;
+    if (end) stream_done(conn, s);
+    return 1;
+}
+
+// Fill the queue: response heads as soon as there is room for them, then
+// one DATA frame per stream per turn, so bodies interleave.
+static void h2_send(conn_t *conn, h2_t *h2) {
+    h2stream_t *s, *prev, *next;
+    int progress = 1, ret;
+    // after an upgrade, stream 1 waits for the client preface: clients
+    // buffer little of what follows the 101 until they speak HTTP/2 too
+    if (h2->preface) return;
+    while(progress) {
+        progress = 0;
+        for(prev = NULL, s = h2->streams; s; prev = s, s = next) {
+            next = s->next;
+            if (OUT_BUF_MAX - conn->outlen < H2_FRAME_HEADER + H2_COPY_MAX + H2_CONTROL_ROOM ||
+                conn->niov + 3 > CONN_IOV_MAX) {
+                stream_rotate(h2, prev, s);
+                return;
+            }
+            if (s->state == H2S_HEADERS) {
+                if (stream_head(conn, h2, s) != OK) {
+                    stream_rotate(h2, prev, s);
+                    return;
+                }
+                progress = 1;
+            } else if (s->state == H2S_DATA) {
+                if ((ret = stream_data(conn, h2, s)) == FAILED) {
+                    // the file shrank under us, the length can't be honored
+                    send_rst(conn, s->id, H2_INTERNAL_ERROR);
+                    s->state = H2S_DONE;
+                    METRIC_ADD(errors, 1);
+                }
+                if (ret != 0) progress = 1;
+            }
+        }
+    }
+}
+
+// HTTP/2 counterpart of conn_process, called the same way: take the input,
+// queue what can be sent. Returns 1 with conn switched to CONN_WRITE when
+// there is something to write, or to CONN_CLOSE when the connection is done.
+int h2_process(server_t *app, conn_t *conn) {
+    h2_t *h2 = conn->h2;
+    h2stream_t *s, *next;
+    int active = 0;
+    // everything queued last round is written, finished streams can go
+    for(s = h2->streams; s; s = next) {
+        next = s->next;
+        if (s->state == H2S_DONE) stream_free(h2, s);
+    }
+    h2->filelen = 0;
+    h2_input(app, conn, h2);
+    if (!h2->failed) h2_send(conn, h2);
+    for(s = h2->streams; s; s = s->next) active += s->state != H2S_DONE;
+    if (h2->goaway && !active) conn->keep_alive = 0;
+    if (conn->niov > 0) {
+        conn->state = CONN_WRITE;
+        conn->batch = conn->sent;
+        conn->stamp = mono_ns();
+        return 1;
+    }
+    if (!conn->keep_alive) {
+        conn->state = CONN_CLOSE;
+        return 1;
+    }
+    return 0;
+}
+
+// An HTTP/1.1 request asking to switch to h2c, with the settings to start
+// from and no body. Answered 101 and then on stream 1; FAILED leaves it
+// to be served on HTTP/1.1.
+int h2_upgrade(server_t *app, conn_t *conn, req_t *req) {
+    unsigned char settings[64];
+    size_t len;
+    char *value;
+    uint32_t code;
+    h2stream_t *s;
+    if ((value = find_header(req->header, "Upgrade")) == NULL || !has_token(value, "h2c") ||
+        (value = find_header(req->header, "HTTP2-Settings")) == NULL ||
+        find_header(req->header, "Content-Length") || find_header(req->header, "Transfer-Encoding") ||
+        decode_settings(value, settings, sizeof(settings), &len) != OK) return FAILED;
+    out_bytes(conn, upgrade_reply, sizeof(upgrade_reply) - 1);
+    h2_start(conn);
+    if (apply_settings(conn->h2, settings, len, &code) != OK) {
+        h2_fail(conn, conn->h2, code);
+        return OK;
+    }
+    conn->h2->last_id = 1;
+    s = stream_new(conn->h2, 1);
+    s->remote_closed = 1;
+    stream_respond(app, conn, s, req, conn->stamp);
+    return OK;
+}
@@ -0,0 +1,349 @@
+#include "./inc/hpack.h"
+#include "./inc/http.h"
+
+// RFC 7541 appendix A
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[HPACK_STATIC] = {
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+    { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+    { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// RFC 7541 appendix B, code and length in bits per byte value. EOS is
+// left out, it may only show up as padding.
+static const struct {
+    uint32_t code;
+    int len;
+} huff_codes[256] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 }, { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 }, { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 }, { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 }, { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 }, { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 }, { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 }, { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 }, { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 }, { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 }, { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 }, { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+};
+
+// The code is canonical: within a length, codes are consecutive in
+// symbol order. So one bit at a time, a code of len bits is symbol
+// huff_sorted[huff_base[len] + code - huff_first[len]] if that lands
+// within huff_count[len].
+#define HUFF_LEN_MAX 30
+static uint32_t huff_first[HUFF_LEN_MAX + 1];
+static int huff_base[HUFF_LEN_MAX + 1];
+static int huff_count[HUFF_LEN_MAX + 1];
+static unsigned char huff_sorted[256];
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+
+static void huff_build(void) {
+    int len, sym, n = 0;
+    for(len = 1; len <= HUFF_LEN_MAX; len++) {
+        huff_base[len] = n;
+        for(sym = 0; sym < 256; sym++) {
+            if (huff_codes[sym].len != len) continue;
+            if (!huff_count[len]) huff_first[len] = huff_codes[sym].code;
+            huff_count[len]++;
+            huff_sorted[n++] = sym;
+        }
+    }
+}
+
+static int huff_decode(const unsigned char *p, size_t n, char *out, size_t *outlen) {
+    uint32_t code = 0;
+    int len = 0, bit;
+    size_t o = 0;
+    while(n--) {
+        for(bit = 7; bit >= 0; bit--) {
+            code = code << 1 | ((*p >> bit) & 1);
+            len++;
+            if (code - huff_first[len] < (uint32_t)huff_count[len]) {
+                out[o++] = huff_sorted[huff_base[len] + code - huff_first[len]];
+                code = len = 0;
+            } else if (len == HUFF_LEN_MAX) {
+                return FAILED;
+            }
+        }
+        p++;
+    }
+    // padding is the start of EOS: under a byte of 1 bits
+    if (len > 7 || code != (1u << len) - 1) return FAILED;
+    *outlen = o;
+    return OK;
+}
+
+static size_t huff_size(const char *s, size_t n, int lower) {
+    size_t bits = 0;
+    while(n--) {
+        bits += huff_codes[(unsigned char)(lower ? tolower(*s) : *s)].len;
+        s++;
+    }
+    return (bits + 7) / 8;
+}
+
+static size_t huff_encode(unsigned char *buf, size_t len, const char *s, size_t n, int lower) {
+    uint64_t acc = 0;
+    int bits = 0;
+    unsigned char c;
+    while(n--) {
+        c = lower ? tolower(*s) : *s;
+        s++;
+        acc = acc << huff_codes[c].len | huff_codes[c].code;
+        bits += huff_codes[c].len;
+        while(bits >= 8) {
+            bits -= 8;
+            buf[len++] = acc >> bits;
+        }
+    }
+    if (bits) buf[len++] = (acc << (8 - bits)) | ((1u << (8 - bits)) - 1);
+    return len;
+}
+
+// 5.1 integer behind a prefix of bits, FAILED if truncated or too big
+static int get_int(const unsigned char **p, const unsigned char *end, int bits, size_t *out) {
+    size_t mask = (1u << bits) - 1, v = **p & mask;
+    int shift = 0;
+    (*p)++;
+    if (v < mask) {
+        *out = v;
+        return OK;
+    }
+    while(*p < end && shift <= 28) {
+        v += (size_t)(**p & 0x7f) << shift;
+        shift += 7;
+        if (!(*(*p)++ & 0x80)) {
+            *out = v;
+            return OK;
+        }
+    }
+    return FAILED;
+}
+
+static size_t put_int(unsigned char *buf, size_t len, unsigned char first, int bits, size_t v) {
+    size_t mask = (1u << bits) - 1;
+    if (v < mask) {
+        buf[len++] = first | v;
+        return len;
+    }
+    buf[len++] = first | mask;
+    for(v -= mask; v >= 0x80; v >>= 7) buf[len++] = (v & 0x7f) | 0x80;
+    buf[len++] = v;
+    return len;
+}
+
+// 5.2 string literal, into the arena
+static char *get_string(const unsigned char **p, const unsigned char *end, arena_t *ap, size_t *outlen) {
+    int huff = **p & 0x80;
+    size_t n;
+    char *s;
+    if (get_int(p, end, 7, &n) != OK || n > (size_t)(end - *p)) return NULL;
+    if (huff) {
+        // codes are at least 5 bits long
+        s = (char *)arena_alloc(ap, n * 8 / 5 + 1);
+        if (huff_decode(*p, n, s, outlen) != OK) return NULL;
+        s[*outlen] = 0;
+    } else {
+        s = arena_strndup(ap, (const char *)*p, n);
+        *outlen = n;
+    }
+    *p += n;
+    return s;
+}
+
+// Huffman coded when that comes out shorter, names lowercased as HTTP/2 wants
+static size_t put_string(unsigned char *buf, size_t len, const char *s, size_t n, int lower) {
+    size_t i, hn = huff_size(s, n, lower);
+    if (hn < n) {
+        len = put_int(buf, len, 0x80, 7, hn);
+        return huff_encode(buf, len, s, n, lower);
+    }
+    len = put_int(buf, len, 0, 7, n);
+    for(i = 0; i < n; i++) buf[len++] = lower ? tolower(s[i]) : s[i];
+    return len;
+}
+
+void hpack_init(hpack_t *hp) {
+    pthread_once(&huff_once, huff_build);
+    memset(hp, 0, sizeof(*hp));
+    hp->max = HPACK_TABLE_SIZE;
+}
+
+static hpack_field_t *table_get(hpack_t *hp, size_t index) {
+    if (index == 0 || index > hp->count) return NULL;
+    return &hp->ents[(hp->head + HPACK_ENTRIES - (index - 1)) % HPACK_ENTRIES];
+}
+
+// drop the oldest entries until room more bytes fit
+static void table_evict(hpack_t *hp, size_t room) {
+    hpack_field_t *f;
+    while(hp->count && hp->size + room > hp->max) {
+        f = table_get(hp, hp->count);
+        hp->size -= f->namelen + f->valuelen + 32;
+        free(f->name);
+        hp->count--;
+    }
+}
+
+static void table_add(hpack_t *hp, const char *name, size_t namelen, const char *value, size_t valuelen) {
+    size_t size = namelen + valuelen + 32, i;
+    hpack_field_t *f;
+    // too big for the table empties it and is not added
+    table_evict(hp, size);
+    if (size > hp->max) return;
+    hp->head = (hp->head + 1) % HPACK_ENTRIES;
+    f = &hp->ents[hp->head];
+    if ((f->name = (char *)malloc(namelen + valuelen + 2)) == NULL) fatal_exit(1, "Failed allocate header table");
+    for(i = 0; i < namelen; i++) f->name[i] = tolower(name[i]);
+    f->name[namelen] = 0;
+    f->value = f->name + namelen + 1;
+    memcpy(f->value, value, valuelen);
+    f->value[valuelen] = 0;
+    f->namelen = namelen;
+    f->valuelen = valuelen;
+    hp->count++;
+    hp->size += size;
+}
+
+void hpack_free(hpack_t *hp) {
+    hp->max = 0;
+    table_evict(hp, 0);
+}
+
+// New limit from the peer's SETTINGS_HEADER_TABLE_SIZE (encoder side)
+void hpack_resize(hpack_t *hp, size_t max) {
+    if (max > HPACK_TABLE_SIZE) max = HPACK_TABLE_SIZE;
+    if (max == hp->max) return;
+    hp->max = max;
+    hp->resized = 1;
+    table_evict(hp, 0);
+}
+
+// Field at index in the static then the dynamic table. Dynamic strings are
+// copied out, a later insertion may evict them.
+static int lookup(hpack_t *hp, size_t index, arena_t *ap, char **name, size_t *namelen, char **value, size_t *valuelen) {
+    hpack_field_t *f;
+    if (index >= 1 && index <= HPACK_STATIC) {
+        *name = (char *)static_table[index - 1].name;
+        *value = (char *)static_table[index - 1].value;
+        *namelen = strlen(*name);
+        *valuelen = strlen(*value);
+        return OK;
+    }
+    if ((f = table_get(hp, index - HPACK_STATIC)) == NULL) return FAILED;
+    *name = arena_strndup(ap, f->name, f->namelen);
+    *value = arena_strndup(ap, f->value, f->valuelen);
+    *namelen = f->namelen;
+    *valuelen = f->valuelen;
+    return OK;
+}
+
+// Decode a whole header block, handing every field to emit. FAILED on a
+// malformed block, or when emit fails.
+int hpack_decode(hpack_t *hp, const unsigned char *p, size_t n, arena_t *ap, hpack_emit_t emit, void *arg) {
+    const unsigned char *end = p + n;
+    char *name, *value, *ignored;
+    size_t index, namelen, valuelen, ignoredlen;
+    int add;
+    while(p < end) {
+        if (*p & 0x80) {
+            // indexed field
+            if (get_int(&p, end, 7, &index) != OK ||
+                lookup(hp, index, ap, &name, &namelen, &value, &valuelen) != OK) return FAILED;
+        } else if ((*p & 0xe0) == 0x20) {
+            // table size update, within what our settings allow
+            if (get_int(&p, end, 5, &index) != OK || index > HPACK_TABLE_SIZE) return FAILED;
+            hp->max = index;
+            table_evict(hp, 0);
+            continue;
+        } else {
+            // literal, with incremental indexing, without or never indexed
+            add = (*p & 0x40) != 0;
+            if (get_int(&p, end, add ? 6 : 4, &index) != OK) return FAILED;
+            if (index) {
+                if (lookup(hp, index, ap, &name, &namelen, &ignored, &ignoredlen) != OK) return FAILED;
+            } else if (p >= end || (name = get_string(&p, end, ap, &namelen)) == NULL) {
+                return FAILED;
+            }
+            if (p >= end || (value = get_string(&p, end, ap, &valuelen)) == NULL) return FAILED;
+            if (add) table_add(hp, name, namelen, value, valuelen);
+        }
+        if (emit(arg, name, namelen, value, valuelen) != OK) return FAILED;
+    }
+    return OK;
+}
+
+// Start a header block at buf + len, owning up to a table size change first
+size_t hpack_begin(hpack_t *hp, unsigned char *buf, size_t len, size_t cap) {
+    if (!hp->resized || len + 8 > cap) return len;
+    hp->resized = 0;
+    return put_int(buf, len, 0x20, 5, hp->max);
+}
+
+// Append one field to the block in buf, as an index when either table has
+// it whole, else as a literal that index adds to the dynamic table. Like
+// put, a field that doesn't fit is dropped whole.
+size_t hpack_encode(hpack_t *hp, unsigned char *buf, size_t len, size_t cap, const char *name, size_t namelen,
+                    const char *value, size_t valuelen, int index) {
+    hpack_field_t *f;
+    size_t i, nameidx = 0;
+    if (len + namelen + valuelen + 16 > cap) return len;
+    for(i = 0; i < HPACK_STATIC; i++) {
+        if (strncasecmp(static_table[i].name, name, namelen) != 0 || static_table[i].name[namelen]) continue;
+        if (strlen(static_table[i].value) == valuelen && memcmp(static_table[i].value, value, valuelen) == 0) {
+            return put_int(buf, len, 0x80, 7, i + 1);
+        }
+        if (!nameidx) nameidx = i + 1;
+    }
+    for(i = 1; i <= hp->count; i++) {
+        f = table_get(hp, i);
+        if (f->namelen != namelen || strncasecmp(f->name, name, namelen) != 0) continue;
+        if (f->valuelen == valuelen && memcmp(f->value, value, valuelen) == 0) {
+            return put_int(buf, len, 0x80, 7, HPACK_STATIC + i);
+        }
+        if (!nameidx) nameidx = HPACK_STATIC + i;
+    }
+    len = index ? put_int(buf, len, 0x40, 6, nameidx) : put_int(buf, len, 0, 4, nameidx);
+    if (!nameidx) len = put_string(buf, len, name, namelen, 1);
+    len = put_string(buf, len, value, valuelen, 0);
+    if (index) table_add(hp, name, namelen, value, valuelen);
+    return len;
+}
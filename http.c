@@ -1,66 +1,49 @@
 #include "./inc/http.h"
+#include "./inc/conn.h"
+#include "./inc/h2.h"
+#include "./inc/proxy.h"
+
+// Generated from mime.types, replaced once at startup when -m extends it
+static const phash_t *mime_types = &mime_tab;
+static phash_t mime_custom;
+
+// spans end on a delimiter the parser already consumed, so terminate in place
+static char *span_str(char *head, span_t *sp) {
+    head[sp->off + sp->len] = 0;
+    return head + sp->off;
+}
 
-char *mime_table[][2] = {
-    {"html", "text/html"},
-    {"css", "text/css"},
-    {"js", "application/javascript"},
-    {"png", "image/png"},
-};
-// Supported methods
-char *methods[] = {
-    "GET",
-    "HEAD",
-};
-
-int read_startline(rio_t *rp, req_t *req, res_t *res) {
-    char line[HDR_LEN_MAX];
-    char url[URI_LEN_MAX];
-    if (rio_readline(rp, line, HDR_LEN_MAX) < 0) {
-        res->status = 400;
-        return FAILED;
-    }
-    trimright_line(line);
-    if ((sscanf(line, "%7s %s %*s", req->method, url)) != 2) {
+int read_startline(parser_t *pp, char *head, req_t *req, res_t *res) {
+    char *url;
+    if (pp->state != PARSE_DONE) {
         res->status = 400;
         return FAILED;
     }
+    memcpy(req->method, head + pp->method.off, pp->method.len);
+    req->method[pp->method.len] = 0;
+    req->keep_alive = pp->version.len == 8 && memcmp(head + pp->version.off, "HTTP/1.1", 8) == 0;
+    url = span_str(head, &pp->uri);
 
-    req->location = (location_t *)malloc(sizeof(location_t));
+    req->location = (location_t *)arena_alloc(req->arena, sizeof(location_t));
     if (parse_location(url, req->location) != OK) {
         res->status = 400;
         return FAILED; 
     }
-
-    if (check_method(req->method) != OK) {
-        res->status = 405;
-        return FAILED;
-    }
-
     return OK;
 }
 
-int read_request_headers(rio_t *rp, req_t *req) {
-    char line[HDR_LEN_MAX];
-    size_t n;
-    char *nameptr, *valueptr, *colonptr;
+// header names and values point into the rio buffer, only the nodes are allocated
+int read_request_headers(parser_t *pp, char *head, req_t *req) {
+    int i;
+    char *valueptr;
     header_t *prev_header = NULL, *temp_header = NULL;
-    while((n = rio_readline(rp, line, HDR_LEN_MAX)) > 0) {
-        n -= trimright_line(line);
-        if (n == 0) break; // empty line, end of headers
-        // if less than 3, we can surely know that's not a valid header
-        if (n < 3) continue;
-
-        nameptr = line;
-        if ((colonptr = strnstr(line, ":", n - 1)) == NULL) {
-            continue; // invalid header line
-        }
-        *colonptr = 0;
-        valueptr = colonptr + 1;
-        while(isspace(*valueptr)) {
-            valueptr++;
-            if (*valueptr == 0) break;
-        }
-        temp_header = new_header(nameptr, valueptr);
+    for(i = 0; i < pp->nheaders; i++) {
+        temp_header = (header_t *)arena_alloc(req->arena, sizeof(header_t));
+        temp_header->name = span_str(head, &pp->names[i]);
+        temp_header->value = span_str(head, &pp->values[i]);
+        temp_header->namelen = pp->names[i].len;
+        temp_header->valuelen = pp->values[i].len;
+        temp_header->next = NULL;
         if (prev_header) {
             prev_header->next = temp_header;
         } else {
@@ -68,6 +51,13 @@ int read_request_headers(rio_t *rp, req_t *req) {
         }
         prev_header = temp_header;
     }
+    if ((valueptr = find_header(req->header, "Connection")) != NULL) {
+        if (has_token(valueptr, "close")) req->keep_alive = 0;
+        else if (has_token(valueptr, "keep-alive")) req->keep_alive = 1;
+    }
+    if (find_header(req->header, "Content-Length") || find_header(req->header, "Transfer-Encoding")) {
+        req->body = 1;
+    }
     return OK;
 }
 
@@ -86,88 +76,442 @@ int trimright_line(char *line) {
     return 0;
 }
 
+// Whether etag occurs in an If-None-Match list. GET and HEAD use the weak
+// comparison, so a W/ prefix on either side is ignored.
+static int etag_match(const char *list, const char *etag) {
+    const char *p = list, *end;
+    size_t len;
+    if (strncmp(etag, "W/", 2) == 0) etag += 2;
+    len = strlen(etag);
+    while(*p) {
+        while(*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        // an entity tag is quoted and may hold commas
+        if (*p == '"' && (end = strchr(p + 1, '"')) != NULL) {
+            if ((size_t)(end + 1 - p) == len && memcmp(p, etag, len) == 0) return 1;
+            p = end + 1;
+        }
+        while(*p && *p != ',') p++;
+    }
+    return 0;
+}
+
+// RFC 7232 evaluation for GET and HEAD: If-None-Match wins, If-Modified-Since
+// only counts without it. True if a 304 should go out instead of the body.
+int not_modified(req_t *req, const char *etag, time_t mtime) {
+    char *value;
+    time_t since;
+    if ((value = find_header(req->header, "If-None-Match")) != NULL) {
+        return etag_match(value, etag);
+    }
+    if ((value = find_header(req->header, "If-Modified-Since")) != NULL) {
+        // a date in the future can't be trusted to mean anything
+        return httpdate_parse(value, &since) == 0 && mtime <= since && since <= time(NULL);
+    }
+    return 0;
+}
+
+// Parse a Range value against a representation of size bytes, keeping the
+// satisfiable ranges. Returns how many, 0 if none is satisfiable, or -1 if
+// the header is malformed or asks for more than RANGES_MAX and is ignored.
+static int parse_ranges(const char *value, size_t size, range_t *ranges) {
+    const char *p = value + 6;
+    char *end;
+    unsigned long long first, last;
+    int n = 0, specs = 0;
+    if (strncasecmp(value, "bytes=", 6) != 0) return -1;
+    while(*p) {
+        while(*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (!*p) break;
+        specs++;
+        if (*p == '-') {
+            // suffix, the last bytes of the file
+            if (!isdigit((unsigned char)p[1])) return -1;
+            last = strtoull(p + 1, &end, 10);
+            if (last == 0) first = size;
+            else first = last >= size ? 0 : size - last;
+            last = size - 1;
+        } else {
+            if (!isdigit((unsigned char)*p)) return -1;
+            first = strtoull(p, &end, 10);
+            if (*end++ != '-') return -1;
+            if (isdigit((unsigned char)*end)) {
+                last = strtoull(end, &end, 10);
+                if (last < first) return -1;
+            } else {
+                last = size - 1;
+            }
+            if (last >= size) last = size - 1;
+        }
+        p = end;
+        while(*p == ' ' || *p == '\t') p++;
+        if (*p && *p != ',') return -1;
+        if (first >= size) continue;
+        if (n == RANGES_MAX) return -1;
+        ranges[n].start = first;
+        ranges[n].len = last - first + 1;
+        n++;
+    }
+    return specs ? n : -1;
+}
+
+// Range only applies if If-Range, when present, still names the current
+// version: the same strong entity tag or exactly its modification date
+static int range_current(req_t *req, const char *etag, time_t mtime) {
+    char *value = find_header(req->header, "If-Range");
+    time_t t;
+    if (!value) return 1;
+    if (*value == '"') return strcmp(value, etag) == 0;
+    if (strncmp(value, "W/", 2) == 0) return 0;
+    return httpdate_parse(value, &t) == 0 && t == mtime;
+}
+
+// random enough that a file won't contain it, one per response
+static void make_boundary(char *buf, size_t cap) {
+    static __thread unsigned long long state;
+    if (!state) state = (unsigned long long)time(NULL) ^ (unsigned long long)(uintptr_t)&state;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    snprintf(buf, cap, "%016llx", state);
+}
+
+// Set up offset and length of the body for a file of size bytes and append
+// Content-Type. A GET with a satisfiable Range becomes 206, one range as a
+// slice at offset, several as multipart/byteranges parts in res->ranges.
+// Returns FAILED with a 416 when no range is satisfiable.
+int select_ranges(req_t *req, res_t *res, const char *etag, time_t mtime, size_t size, char *mime) {
+    range_t ranges[RANGES_MAX];
+    char boundary[20], buf[256];
+    char *value;
+    int n, i, len;
+    res->offset = 0;
+    res->length = size;
+    append_header(res, header_ref(res->arena, "Accept-Ranges", "bytes"));
+    if (strcmp(req->method, "GET") != 0 || (value = find_header(req->header, "Range")) == NULL ||
+        !range_current(req, etag, mtime) || (n = parse_ranges(value, size, ranges)) < 0) {
+        if (mime) append_header(res, header_ref(res->arena, "Content-Type", mime));
+        return OK;
+    }
+    if (n == 0) {
+        res->header = res->last = NULL;
+        res->status = 416;
+        snprintf(buf, sizeof(buf), "bytes */%zu", size);
+        append_header(res, new_header(res->arena, "Content-Range", buf));
+        return FAILED;
+    }
+    res->status = 206;
+    if (n == 1) {
+        if (mime) append_header(res, header_ref(res->arena, "Content-Type", mime));
+        snprintf(buf, sizeof(buf), "bytes %zu-%zu/%zu", ranges[0].start, ranges[0].start + ranges[0].len - 1, size);
+        append_header(res, new_header(res->arena, "Content-Range", buf));
+        res->offset = ranges[0].start;
+        res->length = ranges[0].len;
+        return OK;
+    }
+    make_boundary(boundary, sizeof(boundary));
+    snprintf(buf, sizeof(buf), "multipart/byteranges; boundary=%s", boundary);
+    append_header(res, new_header(res->arena, "Content-Type", buf));
+    res->ranges = (range_t *)arena_alloc(res->arena, (n + 1) * sizeof(range_t));
+    res->length = 0;
+    for(i = 0; i <= n; i++) {
+        if (i < n) {
+            res->ranges[i] = ranges[i];
+            len = snprintf(buf, sizeof(buf), "\r\n--%s\r\n%s%s%sContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                           boundary, mime ? "Content-Type: " : "", mime ? mime : "", mime ? "\r\n" : "",
+                           ranges[i].start, ranges[i].start + ranges[i].len - 1, size);
+        } else {
+            res->ranges[i].start = res->ranges[i].len = 0;
+            len = snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", boundary);
+        }
+        res->ranges[i].head = arena_strndup(res->arena, buf, len);
+        res->ranges[i].headlen = len;
+        res->length += len + res->ranges[i].len;
+    }
+    res->nranges = n;
+    return OK;
+}
+
+// Resolve key (www + request path) by stat'ing, a directory to its default
+// page, into filename and doc just like the docroot index would
+static int resolve_file(const char *key, char *filename, docent_t *doc) {
+    struct stat st;
+    char *pos;
+    strcpy(filename, key);
+    if (stat(filename, &st) < 0) return FAILED;
+    if (S_ISDIR(st.st_mode)) {
+        pos = &filename[strlen(filename) - 1];
+        if (*pos != '/') {
+            *(pos + 1) = '/';
+            *(pos + 2) = 0;
+        }
+        // Default page
+        strcat(filename, DOCROOT_INDEX);
+        if (stat(filename, &st) < 0) return FAILED;
+    }
+    if (!S_ISREG(st.st_mode)) return FAILED;
+    docent_fill(doc, filename, &st);
+    return OK;
+}
+
+// An up to date path.gz next to the file in doc, from the index when there
+// is one. On success doc describes the sibling, dated like the file.
+static int find_sibling(server_t *app, char *filename, docent_t *doc) {
+    char gzname[URI_LEN_MAX], gzpath[URI_LEN_MAX];
+    docent_t gzdoc;
+    if (snprintf(gzname, sizeof(gzname), "%s%s", filename, GZIP_SUFFIX) >= (int)sizeof(gzname)) return FAILED;
+    if (app->docroot) {
+        // index paths are www followed by their url
+        if (docroot_lookup(app->docroot, gzname + strlen(app->www), &gzdoc, gzpath, sizeof(gzpath)) != OK) return FAILED;
+    } else if (resolve_file(gzname, gzpath, &gzdoc) != OK) {
+        return FAILED;
+    }
+    if (gzdoc.st.st_mtime < doc->st.st_mtime) return FAILED;
+    strcpy(filename, gzpath);
+    gzdoc.st.st_mtime = doc->st.st_mtime;
+    doc->st = gzdoc.st;
+    cache_etag(&doc->st, doc->etag);
+    return OK;
+}
+
+// The metrics endpoint, rendered into the arena on every scrape
+static int serve_metrics(req_t *req, res_t *res) {
+    res->status = 200;
+    append_header(res, header_ref(res->arena, "Content-Type", METRICS_CONTENT_TYPE));
+    append_header(res, header_ref(res->arena, "Cache-Control", "no-store"));
+    if (strncasecmp(req->method, "HEAD", 4) == 0) return OK;
+    res->body = (char *)arena_alloc(res->arena, METRICS_BODY_MAX);
+    res->length = metrics_render(res->body, METRICS_BODY_MAX);
+    return OK;
+}
+
+// Answer from the site bundle: one probe, headers precomputed, the body
+// borrowed from the mapping. res holds the bundle version it came from.
+static int serve_bundle(req_t *req, res_t *res) {
+    bundle_t *bp = res->bundle = bundle_get();
+    const char *path = req->location->path;
+    size_t len = strlen(path), off, size;
+    bundle_ent_t *ent;
+    char *value, *mime, *etag;
+    while(len && path[len - 1] == '/') len--;
+    if ((ent = bundle_find(bp, path, len)) == NULL) {
+        res->status = 404;
+        return FAILED;
+    }
+    res->status = 200;
+    mime = bundle_str(bp, ent->mime);
+    off = ent->off;
+    size = ent->size;
+    etag = ent->etag;
+    if (ent->gzsize) {
+        append_header(res, header_ref(res->arena, "Vary", "Accept-Encoding"));
+        if ((value = find_header(req->header, "Accept-Encoding")) != NULL && gzip_accepted(value)) {
+            append_header(res, header_ref(res->arena, "Content-Encoding", "gzip"));
+            off = ent->gzoff;
+            size = ent->gzsize;
+            etag = ent->gzetag;
+        }
+    }
+    append_header(res, header_ref(res->arena, "ETag", etag));
+    append_header(res, header_ref(res->arena, "Last-Modified", ent->lastmod));
+    if (not_modified(req, etag, ent->mtime)) {
+        if (mime) append_header(res, header_ref(res->arena, "Content-Type", mime));
+        res->status = 304;
+        return OK;
+    }
+    if (select_ranges(req, res, etag, ent->mtime, size, mime) != OK) return FAILED;
+    if (strncasecmp(req->method, "HEAD", 4) == 0) {
+        res->body = NULL;
+        res->length = 0;
+        return OK;
+    }
+    res->body = bp->map + off + res->offset;
+    return OK;
+}
+
 int handle_request(server_t *app, req_t *req, res_t *res) {
     // serve static file
     char filename[URI_LEN_MAX];
-    strcpy(filename, app->www);
-    strcat(filename, req->location->path);
-    struct stat st;
-    char *pos, *mime;
-    if (stat(filename, &st) == 0) {
-        if (S_ISDIR(st.st_mode)) {
-             pos = &filename[strlen(filename) - 1];
-             if (*pos != '/') {
-                 *(pos + 1) = '/';
-                 *(pos + 2) = 0;
-             }
-             // Default page
-             strcat(filename, "index.html");
-         }
-    }
-    if (stat(filename, &st) < 0) {
+    char key[URI_LEN_MAX];
+    docent_t doc;
+    char *value;
+    entry_t *entry;
+    if (app->metrics_path && strcmp(req->location->path, app->metrics_path) == 0) return serve_metrics(req, res);
+    // any method goes upstream, the web_handle caller forwards it
+    if (app->nroutes && (res->route = proxy_route(app, req->location->path)) != NULL) return OK;
+    if (check_method(req->method) != OK) {
+        res->status = 405;
+        return FAILED;
+    }
+    if (app->bundle) return serve_bundle(req, res);
+    if (app->docroot) {
+        // a single probe and no syscall, whatever the index lacks is a 404
+        if (docroot_lookup(app->docroot, req->location->path, &doc, filename, sizeof(filename)) != OK) {
+            res->status = 404;
+            return FAILED;
+        }
+        if (app->cache && ((entry = cache_get(app->cache, req->location->path, &doc.st)) != NULL ||
+            (entry = cache_put(app->cache, req->location->path, filename, &doc.st, doc.mime)) != NULL)) {
+            return serve_entry(app, req, res, entry);
+        }
+    } else {
+        // leave room for a trailing "/index.html"
+        if (snprintf(key, sizeof(key) - 11, "%s%s", app->www, req->location->path) >= (int)sizeof(key) - 11) {
+            res->status = 404;
+            return FAILED;
+        }
+        if (app->cache && (entry = cache_get(app->cache, key, NULL)) != NULL) {
+            return serve_entry(app, req, res, entry);
+        }
+        if (resolve_file(key, filename, &doc) != OK) {
+            res->status = 404;
+            return FAILED;
+        }
+        if (app->cache && (entry = cache_put(app->cache, key, filename, &doc.st, doc.mime)) != NULL) {
+            return serve_entry(app, req, res, entry);
+        }
+    }
+    res->status = 200;
+    if (gzip_compressible(doc.mime)) {
+        // uncached, so only a precompressed sibling can be offered
+        append_header(res, header_ref(res->arena, "Vary", "Accept-Encoding"));
+        if ((value = find_header(req->header, "Accept-Encoding")) != NULL && gzip_accepted(value) &&
+            find_sibling(app, filename, &doc) == OK) {
+            append_header(res, header_ref(res->arena, "Content-Encoding", "gzip"));
+        }
+    }
+    append_header(res, new_header(res->arena, "ETag", doc.etag));
+    append_header(res, new_header(res->arena, "Last-Modified", doc.lastmod));
+    if (not_modified(req, doc.etag, doc.st.st_mtime)) {
+        if (doc.mime) append_header(res, header_ref(res->arena, "Content-Type", doc.mime));
+        res->status = 304;
+        return OK;
+    }
+    if (select_ranges(req, res, doc.etag, doc.st.st_mtime, doc.st.st_size, doc.mime) != OK) return FAILED;
+    if (strncasecmp(req->method, "HEAD", 4) == 0) {
+        res->body = NULL;
+        res->length = 0;
+        return OK;
+    }
+    if ((res->fd = open(filename, O_RDONLY | O_CLOEXEC, 0)) < 0) {
+        res->header = res->last = NULL;
         res->status = 404;
         return FAILED;
     }
+    return OK;
+}
 
+// Answer from a cached file, or its gzip variant when the client takes it.
+// Headers and body are borrowed rather than copied; res holds the entry
+// until the response is out.
+int serve_entry(server_t *app, req_t *req, res_t *res, entry_t *entry) {
+    entry_t *variant;
+    char *value;
     res->status = 200;
-    append_header(res, new_header("Last-Modified", stringify_time(st.st_mtime)));
-    mime = get_mime(get_extension(filename));
-    if (mime) append_header(res, new_header("Content-Type", mime));
+    if (gzip_compressible(entry->mime)) {
+        append_header(res, header_ref(res->arena, "Vary", "Accept-Encoding"));
+        if ((value = find_header(req->header, "Accept-Encoding")) != NULL && gzip_accepted(value) &&
+            (variant = cache_variant(app->cache, entry)) != NULL) {
+            append_header(res, header_ref(res->arena, "Content-Encoding", "gzip"));
+            cache_release(entry);
+            entry = variant;
+        }
+    }
+    res->entry = entry;
+    append_header(res, header_ref(res->arena, "ETag", entry->etag));
+    append_header(res, header_ref(res->arena, "Last-Modified", entry->lastmod));
+    if (not_modified(req, entry->etag, entry->mtime)) {
+        if (entry->mime) append_header(res, header_ref(res->arena, "Content-Type", entry->mime));
+        res->status = 304;
+        return OK;
+    }
+    if (select_ranges(req, res, entry->etag, entry->mtime, entry->size, entry->mime) != OK) return FAILED;
     if (strncasecmp(req->method, "HEAD", 4) == 0) {
         res->body = NULL;
         res->length = 0;
         return OK;
     }
-    int fd = open(filename, O_RDONLY, 0);
-    char *bodybuf = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    res->body = (char *)malloc(st.st_size);
-    memcpy(res->body, bodybuf, st.st_size);
-    res->length = st.st_size;
-    close(fd);
-    munmap(bodybuf, st.st_size);
+    if (!entry->body) {
+        // metadata only, the file is too big for memory
+        if ((res->fd = open(entry->path, O_RDONLY | O_CLOEXEC, 0)) < 0) {
+            res->header = res->last = NULL;
+            res->status = 404;
+            return FAILED;
+        }
+        return OK;
+    }
+    res->body = entry->body + res->offset;
     return OK;
 }
 
-void web_handle(server_t *app, int connfd) {
-    rio_t rio;
-    req_t req;
-    res_t res;
-    rio_init(&rio, connfd);
-    req_init(&req);
-    res_init(&res);
-    if (read_startline(&rio, &req, &res) == OK) {
-        if (read_request_headers(&rio, &req) == OK) {
-            if (handle_request(app, &req, &res) == OK) {
-                httpsend(connfd, &res);
+// Called once conn->parser has a whole request head, queues the response on conn
+void web_handle(server_t *app, conn_t *conn) {
+    parser_t *pp = &conn->parser;
+    char *head = conn->rio.cursor;
+    req_t *req = &conn->req;
+    res_t *res = &conn->res;
+    int ret;
+    req_init(req, &conn->arena);
+    res_init(res, &conn->arena);
+    PROBE2(request, conn->fd, pp->headlen);
+    if (read_startline(pp, head, req, res) == OK) {
+        PROBE3(startline, conn->fd, (char *)req->method, req->location->path);
+        if (read_request_headers(pp, head, req) == OK) {
+            PROBE2(headers, conn->fd, pp->nheaders);
+            conn->keep_alive = req->keep_alive &&
+                (app->max_requests <= 0 || conn->requests < app->max_requests);
+            if (app->h2 && h2_upgrade(app, conn, req) == OK) {
+                // answered on stream 1, once the connection speaks HTTP/2
             } else {
-                httpsend_error(connfd, &res);
+                conn->stamp = metrics_time(HIST_PARSE, conn->stamp);
+                ret = handle_request(app, req, res);
+                metrics_time(HIST_LOOKUP, conn->stamp);
+                PROBE4(resolved, conn->fd, req->location->path, res->status, res->length);
+                if (ret == OK && res->route && proxy_start(app, conn, req, res->route) != OK) {
+                    res->route = NULL;
+                    ret = FAILED;
+                }
+                // request bodies are never read here, so the stream can't be trusted after one
+                if (req->body && !res->route) conn->keep_alive = 0;
+                if (ret == OK && res->route) {
+                    // the upstream answers once the queue ahead of it is out
+                } else if (ret == OK) {
+                    httpsend(conn, res);
+                } else {
+                    httpsend_error(conn, res);
+                }
             }
         } else {
-            httpsend_error(connfd, &res);
+            conn->keep_alive = 0;
+            httpsend_error(conn, res);
         }
     } else {
-        httpsend_error(connfd, &res);
+        // a broken start line leaves the stream out of sync
+        conn->keep_alive = 0;
+        httpsend_error(conn, res);
     }
-    free_request(&req);
-    free_response(&res);
+    // response does not refer to request anymore, its memory goes with the arena
+    req_init(req, &conn->arena);
+    rio_consume(&conn->rio, pp->headlen);
+    parser_init(pp);
 }
 
-
-void httpsend_error(int connfd, res_t *res) {
+// The canned page for an error status, as res's body
+void error_response(res_t *res) {
     char bodybuf[BODY_MAX];
     char *message = get_http_message(res->status);
-    sprintf(bodybuf, "<html>");
-    sprintf(bodybuf, "%s  <head><title>%d %s</title></head>", bodybuf, res->status, message);
-    sprintf(bodybuf, "%s  <body>", bodybuf);
-    sprintf(bodybuf, "%s    <h3>%d %s</h3>", bodybuf, res->status, message);
-    sprintf(bodybuf, "%s  </body></html>", bodybuf);
-    size_t bodylen = strlen(bodybuf);
-    char *body = (char *)malloc(bodylen + 1);
-    strncpy(body, bodybuf, bodylen + 1);
-    res->body = body;
+    int bodylen = snprintf(bodybuf, sizeof(bodybuf),
+        "<html>  <head><title>%d %s</title></head>  <body>    <h3>%d %s</h3>  </body></html>",
+        res->status, message, res->status, message);
+    res->body = arena_strndup(res->arena, bodybuf, bodylen);
     res->length = bodylen;
-    append_header(res, new_header("Content-Type", "text/html"));
-    httpsend(connfd, res);
+    append_header(res, new_header(res->arena, "Content-Type", "text/html"));
+}
+
+void httpsend_error(conn_t *conn, res_t *res) {
+    error_response(res);
+    httpsend(conn, res);
 }
 
 void append_header(res_t *res, header_t *header) {
@@ -179,38 +523,207 @@ void append_header(res_t *res, header_t *header) {
     }
 }
 
-void httpsend(int connfd, res_t *res) {
-    char valuebuf[16];
-    char headbuf[HDR_LEN_MAX];
-    header_t *header = NULL;
-    sprintf(valuebuf, "%ld", res->length);
-    append_header(res, new_header("Server", SERVER_NAME));
-    append_header(res, new_header("Date", stringify_time(time(NULL))));
-    append_header(res, new_header("Content-Length", valuebuf));
-    sprintf(headbuf, "HTTP/1.1 %d %s%s", res->status, get_http_message(res->status), CRLF);
-    header = res->header;
+#define STATUS_LINE(code, message) { code, "HTTP/1.1 " #code " " message CRLF, sizeof("HTTP/1.1 " #code " " message CRLF) - 1 }
+#define CONST_HEADER(name, value) name ": " value CRLF
+static const struct {
+    int code;
+    const char *line;
+    size_t len;
+} status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(503, "Service Unavailable"),
+};
+static const char server_line[] = CONST_HEADER("Server", SERVER_NAME);
+static const char close_line[] = CONST_HEADER("Connection", "close");
+static const char keepalive_line[] = CONST_HEADER("Connection", "keep-alive");
+static const char length_name[] = "Content-Length: ";
+
+// Append n bytes to a head being built in buf, a header that doesn't fit is dropped whole
+static size_t put(char *buf, size_t len, size_t cap, const char *s, size_t n) {
+    if (len + n > cap) return len;
+    memcpy(buf + len, s, n);
+    return len + n;
+}
 
-    while(header) {
-        sprintf(headbuf, "%s%s: %s%s", headbuf, header->name, header->value, CRLF);
-        header = header->next;
+static size_t put_header(char *buf, size_t len, size_t cap, header_t *header) {
+    if (len + header->namelen + header->valuelen + 4 > cap) return len;
+    len = put(buf, len, cap, header->name, header->namelen);
+    len = put(buf, len, cap, ": ", 2);
+    len = put(buf, len, cap, header->value, header->valuelen);
+    return put(buf, len, cap, CRLF, 2);
+}
+
+static size_t put_number(char *buf, size_t len, size_t cap, size_t n) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while(n);
+    return put(buf, len, cap, p, digits + sizeof(digits) - p);
+}
+
+static size_t put_status(char *buf, size_t len, size_t cap, int status) {
+    size_t i;
+    char line[64];
+    for(i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+        if (status_lines[i].code == status) return put(buf, len, cap, status_lines[i].line, status_lines[i].len);
     }
+    return put(buf, len, cap, line, snprintf(line, sizeof(line), "HTTP/1.1 %d %s%s", status, get_http_message(status), CRLF));
+}
 
-    sprintf(headbuf, "%s%s", headbuf, CRLF);
-    rio_writen(connfd, headbuf, strlen(headbuf));
-    rio_writen(connfd, res->body, res->length);
+static void log_header(char *dst, size_t cap, req_t *req, const char *name) {
+    char *value = find_header(req->header, name);
+    accesslog_field(dst, cap, value, value ? strlen(value) : 0);
 }
 
-header_t * new_header(const char *name, const char *value) {
-    header_t *header = (header_t *)malloc(sizeof(header_t));
-    size_t namelen = strlen(name), valuelen = strlen(value);
-    char *nameptr = (char *)malloc(namelen + 1);
-    char *valueptr = (char *)malloc(valuelen + 1);
-    if (!header || !nameptr || !valueptr) fatal_exit(1, "Failed allocate memory for header");
-    strncpy(nameptr, name, namelen + 1);
-    strncpy(valueptr, value, valuelen + 1);
+// Path and query of a resolved request
+static void log_uri(logrec_t *rec, location_t *loc) {
+    size_t n = strlen(loc->path);
+    accesslog_field(rec->uri, sizeof(rec->uri), loc->path, n);
+    if (loc->query && n + 1 < sizeof(rec->uri)) {
+        rec->uri[n] = '?';
+        accesslog_field(rec->uri + n + 1, sizeof(rec->uri) - n - 1, loc->query, strlen(loc->query));
+    }
+}
+
+// Capture the exchange for the access log. Only copies, the logger thread formats.
+static void log_access(conn_t *conn, res_t *res) {
+    parser_t *pp = &conn->parser;
+    char *head = conn->rio.cursor;
+    req_t *req = &conn->req;
+    location_t *loc = req->location;
+    logrec_t *rec;
+    if ((rec = accesslog_reserve()) == NULL) return;
+    rec->time = time(NULL);
+    rec->addr = conn->peer;
+    rec->status = res->status;
+    rec->bytes = res->status == 304 ? 0 : res->length;
+    rec->method[0] = rec->version[0] = rec->uri[0] = 0;
+    if (pp->state == PARSE_DONE) {
+        accesslog_field(rec->method, sizeof(rec->method), head + pp->method.off, pp->method.len);
+        accesslog_field(rec->version, sizeof(rec->version), head + pp->version.off, pp->version.len);
+        if (loc && loc->path) {
+            log_uri(rec, loc);
+        } else {
+            accesslog_field(rec->uri, sizeof(rec->uri), head + pp->uri.off, strnlen(head + pp->uri.off, pp->uri.len));
+        }
+    }
+    log_header(rec->referer, sizeof(rec->referer), req, "Referer");
+    log_header(rec->agent, sizeof(rec->agent), req, "User-Agent");
+    accesslog_commit();
+}
+
+// An exchange that did not come through the HTTP/1 parser
+void log_request(struct in_addr addr, req_t *req, res_t *res, const char *version) {
+    logrec_t *rec;
+    if ((rec = accesslog_reserve()) == NULL) return;
+    rec->time = time(NULL);
+    rec->addr = addr;
+    rec->status = res->status;
+    rec->bytes = res->status == 304 ? 0 : res->length;
+    rec->uri[0] = 0;
+    accesslog_field(rec->method, sizeof(rec->method), req->method, strlen(req->method));
+    accesslog_field(rec->version, sizeof(rec->version), version, strlen(version));
+    if (req->location && req->location->path) log_uri(rec, req->location);
+    log_header(rec->referer, sizeof(rec->referer), req, "Referer");
+    log_header(rec->agent, sizeof(rec->agent), req, "User-Agent");
+    accesslog_commit();
+}
+
+// Append status line and headers to conn->out in one linear pass and queue
+// them. Small generated bodies are copied right behind; cache bodies are
+// queued by reference, so pipelined responses leave in a single writev.
+// File bodies, bundle bodies too big to copy and multipart ranges stay in res
+// and go out after everything queued.
+void httpsend(conn_t *conn, res_t *res) {
+    char *headbuf = conn->out + conn->outlen;
+    size_t len = 0, cap = HDR_LEN_MAX;
+    const dateline_t *date = httpdate_line();
+    header_t *header;
+    METRIC_STATUS(res->status);
+    PROBE3(response, conn->fd, res->status, res->length);
+    // proxied exchanges are logged with the request they saved
+    if (accesslog_enabled() && !res->route) log_access(conn, res);
+    len = put_status(headbuf, len, cap, res->status);
+    for(header = res->header; header; header = header->next) {
+        len = put_header(headbuf, len, cap, header);
+    }
+    len = put(headbuf, len, cap, server_line, sizeof(server_line) - 1);
+    len = put(headbuf, len, cap, date->line, date->len);
+    // 204 and 304 never carry a body, and a length would describe the file
+    if (res->status != 204 && res->status != 304) {
+        len = put(headbuf, len, cap, length_name, sizeof(length_name) - 1);
+        len = put_number(headbuf, len, cap, res->length);
+        len = put(headbuf, len, cap, CRLF, 2);
+    }
+    if (!conn->keep_alive) {
+        len = put(headbuf, len, cap, close_line, sizeof(close_line) - 1);
+    } else if (find_header(conn->req.header, "Connection")) {
+        // client asked to keep alive explicitly (HTTP/1.0 style), confirm it
+        len = put(headbuf, len, cap, keepalive_line, sizeof(keepalive_line) - 1);
+    }
+    len = put(headbuf, len, cap, CRLF, 2);
+    conn->outlen += len;
+    conn_queue(conn, headbuf, len);
+
+    if (res->bundle && res->body >= res->bundle->map && res->body < res->bundle->map + res->bundle->size &&
+        !res->nranges && res->length > OUT_BUF_MAX - conn->outlen) {
+        // a big bundle body goes out like a file, from its offset in the bundle
+        res->offset = res->body - res->bundle->map;
+        res->fd = res->bundle->fd;
+    }
+    if (res->fd >= 0 || res->nranges) {
+        conn->pending = 1;
+        conn->bodysent = 0;
+        return;
+    }
+    if (res->entry && res->length) {
+        // borrowed, not copied; the queue holds the reference from now on
+        conn_queue(conn, res->body, res->length);
+        conn_hold(conn, res->entry);
+        res->entry = NULL;
+    } else if (res->length == 0) {
+        // nothing to send
+    } else if (res->length <= OUT_BUF_MAX - conn->outlen) {
+        memcpy(conn->out + conn->outlen, res->body, res->length);
+        conn_queue(conn, conn->out + conn->outlen, res->length);
+        conn->outlen += res->length;
+    } else {
+        // generated in the arena, which lives until the queue is flushed
+        conn_queue(conn, res->body, res->length);
+    }
+    free_response(res);
+    res_init(res, res->arena);
+}
+
+header_t * new_header(arena_t *ap, const char *name, const char *value) {
+    header_t *header = (header_t *)arena_alloc(ap, sizeof(header_t));
     header->next = NULL;
-    header->name = nameptr;
-    header->value = valueptr;
+    header->namelen = strlen(name);
+    header->valuelen = strlen(value);
+    header->name = arena_strndup(ap, name, header->namelen);
+    header->value = arena_strndup(ap, value, header->valuelen);
+    return header;
+}
+
+// header node whose strings outlive the response, nothing is copied
+header_t *header_ref(arena_t *ap, const char *name, const char *value) {
+    header_t *header = (header_t *)arena_alloc(ap, sizeof(header_t));
+    header->next = NULL;
+    header->name = (char *)name;
+    header->value = (char *)value;
+    header->namelen = strlen(name);
+    header->valuelen = strlen(value);
     return header;
 }
 
@@ -230,9 +743,13 @@ char *get_http_message(int code) {
                 return "OK";
             case 204:
                 return "No Content";
+            case 206:
+                return "Partial Content";
         }
     }
 
+    if (code == 304) return "Not Modified";
+
     if (code < 500) {
         switch(code) {
             case 400:
@@ -243,55 +760,79 @@ char *get_http_message(int code) {
                 return "Not Found";
             case 405:
                 return "Method Not Allowed";
+            case 411:
+                return "Length Required";
+            case 416:
+                return "Range Not Satisfiable";
         }
     }
     if (code == 500) return "Internal Server Error";
+    if (code == 502) return "Bad Gateway";
+    if (code == 503) return "Service Unavailable";
     return "";
 }
 
-void free_headers(header_t *header) {
-    header_t *curr = header, *next;
-    while(curr) {
-        next = curr->next;
-        free(curr->name);
-        free(curr->value);
-        free(curr);
-        curr = next;
+// Value of the first header called name, case-insensitive
+char *find_header(header_t *header, const char *name) {
+    while(header) {
+        if (strcasecmp(header->name, name) == 0) return header->value;
+        header = header->next;
     }
+    return NULL;
 }
 
-void free_request(req_t *req) {
-    if (req->location) {
-        if (req->location->path) free(req->location->path);
-        if (req->location->hash) free(req->location->hash);
-        if (req->location->query) free(req->location->query);
-        free(req->location);
+// Whether comma separated list value holds token, case-insensitive
+int has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    const char *p = value;
+    while(*p) {
+        while(*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (strncasecmp(p, token, len) == 0 && (p[len] == 0 || p[len] == ',' || p[len] == ' ' || p[len] == '\t')) {
+            return 1;
+        }
+        while(*p && *p != ',') p++;
     }
-    if (req->header) free_headers(req->header);
+    return 0;
 }
 
+// Headers, location and generated bodies live in the connection arena,
+// only what the response borrows from elsewhere is given back here
 void free_response(res_t *res) {
-    if (res->body) free(res->body);
-    if (res->header) free_headers(res->header);
+    if (res->entry) cache_release(res->entry);
+    // a bundle's fd is shared by all its responses
+    if (res->bundle) bundle_release(res->bundle);
+    else if (res->fd >= 0) close(res->fd);
 }
 
-void req_init(req_t *req) {
+void req_init(req_t *req, arena_t *ap) {
+    req->arena = ap;
+    req->keep_alive = 0;
+    req->body = 0;
     req->header = NULL;
     req->location = NULL;
 }
 
-void res_init(res_t *res) {
+void res_init(res_t *res, arena_t *ap) {
+    res->arena = ap;
     res->body = NULL;
     res->length = 0;
+    res->offset = 0;
+    res->fd = -1;
+    res->entry = NULL;
+    res->bundle = NULL;
+    res->route = NULL;
+    res->ranges = NULL;
+    res->nranges = 0;
     res->header = NULL;
     res->last = NULL;
     res->status = 0;
 }
 
+// IMF-fixdate, in a per-thread buffer
 char *stringify_time(time_t t) {
-    char *ret = ctime(&t);
-    trimright_line(ret);
-    return ret;
+    static __thread char buf[HTTPDATE_LEN + 1];
+    httpdate_format(t, buf);
+    return buf;
 }
 
 char *get_extension(const char *name) {
@@ -299,15 +840,17 @@ char *get_extension(const char *name) {
     return ret ? ret + 1 : NULL;
 }
 
+// Exact, case-insensitive, a single probe
 char *get_mime(const char *ext) {
     if (!ext) return NULL;
-    size_t len = sizeof(mime_table) / sizeof(mime_table[0]), i;
-    for(i = 0; i < len; i++) {
-        if (strncasecmp(mime_table[i][0], ext, strlen(ext)) == 0) {
-            return mime_table[i][1];
-        }
-    }
-    return NULL;
+    return (char *)phash_find(mime_types, ext, strlen(ext));
+}
+
+// Add or override types from a mime.types format file, before serving
+int load_mime_types(const char *path) {
+    if (phash_extend(&mime_tab, path, &mime_custom) < 0) return FAILED;
+    mime_types = &mime_custom;
+    return OK;
 }
 
 
@@ -343,27 +886,14 @@ int parse_location(char *url, location_t* loc) {
         hashptr++;
     }
 
-    loc->path = (char *)malloc(len + 1);
-    strncpy(loc->path, pathptr, len + 1);
-
-    if (queryptr && (len = strlen(queryptr)) > 0) {
-        loc->query = (char *)malloc(len + 1);
-        strncpy(loc->query, queryptr, len + 1);
-    }
-
-    if (hashptr && (len = strlen(hashptr)) > 0) {
-        loc->hash = (char *)malloc(len + 1);
-        strncpy(loc->hash, hashptr, len + 1);
-    }
+    // url is terminated in place, pieces point right into it
+    loc->path = pathptr;
+    if (queryptr && *queryptr) loc->query = queryptr;
+    if (hashptr && *hashptr) loc->hash = hashptr;
     return OK;
 }
 
+// Methods are case-sensitive tokens, exact match against methods.list
 int check_method(char *method) {
-    size_t i, len = sizeof(methods) / sizeof(methods[0]);
-    for(i = 0; i < len; i++) {
-        if (strncasecmp(methods[i], method, strlen(method)) == 0) {
-            return OK;
-        }
-    }
-    return FAILED;
+    return phash_find(&method_tab, method, strlen(method)) ? OK : FAILED;
 }
\ No newline at end of file
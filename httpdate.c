@@ -0,0 +1,105 @@
+#include "./inc/httpdate.h"
+
+static const char *wdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static dateline_t slots[HTTPDATE_SLOTS];
+static dateline_t *current = NULL;
+// second whose line is published or being rendered, claimed with a CAS
+static time_t claimed = -1;
+
+static char *put2(char *p, int n) {
+    *p++ = '0' + n / 10;
+    *p++ = '0' + n % 10;
+    return p;
+}
+
+// RFC 7231 IMF-fixdate into buf (HTTPDATE_LEN + 1 bytes), thread-safe
+size_t httpdate_format(time_t t, char *buf) {
+    struct tm tm;
+    char *p = buf;
+    gmtime_r(&t, &tm);
+    memcpy(p, wdays[tm.tm_wday], 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = put2(p, tm.tm_mday);
+    *p++ = ' ';
+    memcpy(p, months[tm.tm_mon], 3);
+    p += 3;
+    *p++ = ' ';
+    p = put2(p, (tm.tm_year + 1900) / 100);
+    p = put2(p, (tm.tm_year + 1900) % 100);
+    *p++ = ' ';
+    p = put2(p, tm.tm_hour);
+    *p++ = ':';
+    p = put2(p, tm.tm_min);
+    *p++ = ':';
+    p = put2(p, tm.tm_sec);
+    memcpy(p, " GMT", 5);
+    return HTTPDATE_LEN;
+}
+
+static int month_of(const char *s) {
+    int i;
+    for(i = 0; i < 12; i++) {
+        if (strncmp(s, months[i], 3) == 0) return i;
+    }
+    return -1;
+}
+
+// Parse an HTTP-date: IMF-fixdate, plus the obsolete RFC 850 and asctime
+// forms recipients must still accept. Returns 0, or -1 if it is invalid.
+int httpdate_parse(const char *s, time_t *t) {
+    struct tm tm;
+    char mon[4];
+    const char *comma = strchr(s, ',');
+    int n = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (!comma) {
+        // "Sun Nov  6 08:49:37 1994"
+        if (sscanf(s, "%*3s %3s %2d %2d:%2d:%2d %4d%n", mon, &tm.tm_mday,
+                   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_year, &n) != 6 || !n) return -1;
+        tm.tm_year -= 1900;
+    } else if (sscanf(comma, ", %2d %3s %4d %2d:%2d:%2d GMT%n", &tm.tm_mday, mon, &tm.tm_year,
+                      &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n) {
+        // "Sun, 06 Nov 1994 08:49:37 GMT"
+        tm.tm_year -= 1900;
+    } else if (sscanf(comma, ", %2d-%3s-%2d %2d:%2d:%2d GMT%n", &tm.tm_mday, mon, &tm.tm_year,
+                      &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n) {
+        // "Sunday, 06-Nov-94 08:49:37 GMT", years before 70 are this century
+        if (tm.tm_year < 70) tm.tm_year += 100;
+    } else {
+        return -1;
+    }
+    if ((tm.tm_mon = month_of(mon)) < 0) return -1;
+    if ((*t = timegm(&tm)) == (time_t)-1) return -1;
+    return 0;
+}
+
+// Current "Date: ...\r\n" line. The first caller in a new second renders it
+// into a spare slot and swaps the published pointer; everyone else just
+// loads the pointer.
+const dateline_t *httpdate_line(void) {
+    time_t now = time(NULL);
+    dateline_t *line = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    time_t seen;
+    if (line && line->second == now) return line;
+    seen = __atomic_load_n(&claimed, __ATOMIC_RELAXED);
+    if (seen < now && __atomic_compare_exchange_n(&claimed, &seen, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        // the slot after the published one, never the one readers are copying
+        dateline_t *next = line ? &slots[(line - slots + 1) % HTTPDATE_SLOTS] : slots;
+        next->second = now;
+        memcpy(next->line, "Date: ", 6);
+        httpdate_format(now, next->line + 6);
+        memcpy(next->line + 6 + HTTPDATE_LEN, "\r\n", 2);
+        next->len = 6 + HTTPDATE_LEN + 2;
+        __atomic_store_n(&current, next, __ATOMIC_RELEASE);
+        return next;
+    }
+    // someone else is rendering this second, last second's line is close enough
+    while((line = __atomic_load_n(&current, __ATOMIC_ACQUIRE)) == NULL);
+    return line;
+}
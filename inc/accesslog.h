@@ -0,0 +1,57 @@
+#ifndef accesslog_h
+#define accesslog_h
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include "utils.h"
+#include "metrics.h"
+
+#define LOG_RING_SIZE 1024      // records per thread, power of 2
+#define LOG_URI_MAX 256
+#define LOG_FIELD_MAX 128
+#define LOG_METHOD_MAX 8
+#define LOG_VERSION_MAX 12
+// escaping at most quadruples the quoted fields; the address, timestamp,
+// status, byte count and punctuation take under 128 more
+#define LOG_LINE_MAX ((LOG_URI_MAX + 2 * LOG_FIELD_MAX + LOG_METHOD_MAX + LOG_VERSION_MAX) * 4 + 128)
+#define LOG_BATCH 64            // lines per writev
+#define LOG_IDLE_US 10000       // logger's nap when every ring is empty
+
+// One access, as captured on the request path. Fixed size, so a worker
+// fills it in place and all formatting is left to the logger thread.
+typedef struct {
+    time_t time;
+    struct in_addr addr;
+    int status;
+    size_t bytes;
+    char method[LOG_METHOD_MAX];
+    char version[LOG_VERSION_MAX];
+    char uri[LOG_URI_MAX];
+    char referer[LOG_FIELD_MAX];
+    char agent[LOG_FIELD_MAX];
+} logrec_t;
+
+// Single producer (the thread owning it), single consumer (the logger)
+typedef struct Logring {
+    size_t head __attribute__((aligned(METRICS_LINE)));     // next record to write out
+    size_t tail __attribute__((aligned(METRICS_LINE)));     // next record to fill
+    logrec_t recs[LOG_RING_SIZE];
+    struct Logring *next;   // registry of all threads' rings
+} logring_t;
+
+void accesslog_open(const char *);
+int accesslog_enabled(void);
+logrec_t *accesslog_reserve(void);
+void accesslog_commit(void);
+void accesslog_field(char *, size_t, const char *, size_t);
+
+#endif /* accesslog_h */
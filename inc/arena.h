@@ -0,0 +1,32 @@
+#ifndef arena_h
+#define arena_h
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN 16
+
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t size;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} chunk_t;
+
+// Bump allocator living with a connection. Everything a request needs is
+// carved from it and dropped at once by arena_reset; chunks are kept for
+// the next request, so a warmed up connection allocates nothing.
+typedef struct {
+    chunk_t *first;
+    chunk_t *curr;
+    size_t used;        // bytes used in curr
+} arena_t;
+
+void arena_init(arena_t *);
+void *arena_alloc(arena_t *, size_t);
+char *arena_strndup(arena_t *, const char *, size_t);
+char *arena_strdup(arena_t *, const char *);
+void arena_reset(arena_t *);
+void arena_free(arena_t *);
+
+#endif /* arena_h */
@@ -0,0 +1,76 @@
+#ifndef bundle_h
+#define bundle_h
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "phash.h"
+#include "cache.h"
+#include "httpdate.h"
+
+#define BUNDLE_MAGIC "CRVBND01"
+#define BUNDLE_ALIGN 4096       // file bodies start on a page
+// the bundle file is checked for a replacement at most this often
+#define BUNDLE_CHECK_INTERVAL 1
+
+// A site packed by mkbundle into one file: header, perfect hash over the
+// urls, fixed-size entries, strings, then the bodies page aligned. All
+// offsets are from the start of the file, integers in host byte order.
+typedef struct {
+    char magic[8];
+    uint32_t nentries;
+    uint32_t nbuckets;
+    uint32_t nslots;        // power of 2
+    uint32_t reserved;
+    uint64_t disp;          // nbuckets uint32_t seeds
+    uint64_t slots;         // nslots uint32_t, entry index + 1 or 0 for empty
+    uint64_t entries;       // nentries bundle_ent_t
+    uint64_t size;          // of the whole file, a truncated one is refused
+} bundle_hdr_t;
+
+// One url, keyed without trailing slashes like the docroot index;
+// directories get an entry of their own sharing their index.html's body
+typedef struct {
+    uint64_t url;           // NUL terminated
+    uint64_t mime;          // NUL terminated, 0 for none
+    uint64_t off;
+    uint64_t size;
+    uint64_t gzoff;         // gzip variant, gzsize 0 when there is none
+    uint64_t gzsize;
+    int64_t mtime;
+    uint32_t urllen;
+    char etag[ETAG_LEN_MAX];    // from the content, stable across bundle versions
+    char gzetag[ETAG_LEN_MAX];
+    char lastmod[HTTPDATE_LEN + 1];
+} bundle_ent_t;
+
+// A mapped bundle version. Refcounted, so a response keeps sending from
+// the version it started with while a newer one is swapped in.
+typedef struct {
+    char *map;
+    size_t size;
+    int fd;                 // kept to sendfile bodies from
+    bundle_hdr_t *hdr;
+    const uint32_t *disp;
+    const uint32_t *slots;
+    bundle_ent_t *entries;
+    struct stat st;         // of the file as opened
+    int refs;               // being current, each thread serving it, and responses left on it once their thread moved on
+} bundle_t;
+
+int bundle_open(const char *);
+bundle_t *bundle_get(void);
+void bundle_release(bundle_t *);
+bundle_ent_t *bundle_find(bundle_t *, const char *, size_t);
+
+static inline char *bundle_str(bundle_t *bp, uint64_t off) {
+    return off ? bp->map + off : NULL;
+}
+
+#endif /* bundle_h */
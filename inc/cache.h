@@ -0,0 +1,68 @@
+#ifndef cache_h
+#define cache_h
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "httpdate.h"
+#include "gzip.h"
+#include "metrics.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024      // per shard, power of 2
+#define CACHE_ENTRY_MAX (1 << 20)
+// entries are checked against the file at most this often, hits in between cost no syscall
+#define CACHE_CHECK_INTERVAL 1
+#define ETAG_LEN_MAX 48
+
+// A cached file. Refcounted, so a response can keep sending a body the
+// cache has already evicted or replaced.
+struct Entry {
+    char *key;          // www + request path
+    char *path;         // file actually read, index.html resolved
+    char *body;         // NULL for files too big to keep, sent from path instead
+    size_t size;
+    size_t cost;        // bytes charged against the budget, body and bookkeeping
+    time_t mtime;
+    ino_t ino;
+    char *mime;
+    char lastmod[HTTPDATE_LEN + 1];
+    char etag[ETAG_LEN_MAX]; // strong validator from inode, size and mtime
+    struct Entry *gz;   // gzip variant, owned by and charged to this entry
+    time_t checked;     // last revalidation against the filesystem
+    int refs;           // one for the table plus one per response using it
+    int referenced;     // CLOCK bit, set on every hit
+    unsigned hash;
+    struct Entry *next; // hash chain
+    struct Entry *prev_clock;
+    struct Entry *next_clock;
+};
+typedef struct Entry entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    entry_t *buckets[CACHE_BUCKETS];
+    entry_t *hand;      // CLOCK hand, entries form a ring
+    size_t bytes;
+    size_t budget;
+} shard_t;
+
+typedef struct {
+    size_t entry_max;
+    shard_t shards[CACHE_SHARDS];
+} cache_t;
+
+cache_t *cache_create(size_t);
+entry_t *cache_get(cache_t *, const char *, const struct stat *);
+entry_t *cache_put(cache_t *, const char *, const char *, struct stat *, char *);
+entry_t *cache_variant(cache_t *, entry_t *);
+void cache_release(entry_t *);
+void cache_etag(const struct stat *, char *);
+
+#endif /* cache_h */
@@ -0,0 +1,91 @@
+#ifndef conn_h
+#define conn_h
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "rio.h"
+#include "http.h"
+#include "arena.h"
+#include "parser.h"
+#include "wheel.h"
+#include "stats.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "probe.h"
+
+// What a connection waits for after conn_drive returns
+#define CONN_READ 1
+#define CONN_WRITE 2
+#define CONN_CLOSE 3
+#define CONN_PROXY 4    // an upstream exchange, either socket may wake it
+
+// What a connection's deadline is counting down for
+#define PHASE_HEADER 1  // receiving a request head
+#define PHASE_WRITE 2   // sending responses
+#define PHASE_IDLE 3    // keep-alive, waiting for the next request
+
+// Sent to connections refused at admission
+#define RETRY_AFTER "1"
+
+// Responses of pipelined requests are batched here, small bodies included
+#define OUT_BUF_MAX 4096
+// Segments one writev may carry: heads in out plus borrowed cache bodies
+#define CONN_IOV_MAX 16
+
+// Per-connection state machine, driven by readiness (epoll) or by a
+// blocking worker alike. A blocking fd simply never reports EAGAIN.
+struct Conn {
+    int fd;
+    struct in_addr peer;    // client address, for the access log
+    int state;
+    int keep_alive;     // reuse connection once queued responses are out
+    int requests;       // requests served on this connection
+    int pending;        // res holds a file or multipart body, sent after the queued segments
+    int blocking;       // fd blocks, deadlines are enforced with socket timeouts
+    int phase;          // whose deadline is running
+    time_t deadline;    // of the phase, blocking connections only
+    wtimer_t timer;     // of the phase, in the owning loop's wheel
+    uint64_t stamp;     // mono_ns the request or batch being timed started
+    size_t sent;        // bytes written on this connection
+    size_t batch;       // sent when the batch being written was queued
+    rio_t rio;
+    parser_t parser;    // progress on the request head at rio's cursor
+    arena_t arena;      // request and response memory, reset per batch
+    req_t req;
+    res_t res;
+    int part;           // multipart part being sent
+    size_t bodysent;    // of the pending body, or of the current part
+    size_t outlen;
+    int niov;           // queued segments, written with a single writev
+    int iovsent;        // segments fully written
+    struct iovec iov[CONN_IOV_MAX];
+    int nheld;          // cache entries whose bodies are queued
+    entry_t *held[CONN_IOV_MAX];
+    struct H2 *h2;      // HTTP/2 session once the connection switched, NULL on HTTP/1
+    struct Proxy *px;   // upstream exchange state, from the first proxied request
+    int epfd;           // event loop watching fd and the upstream, -1 outside one
+    char out[OUT_BUF_MAX];
+};
+
+void conn_init(conn_t *, int);
+int conn_admit(server_t *);
+void conn_shed(int);
+int conn_phase(conn_t *);
+int conn_timeout(server_t *, int);
+void conn_timed_out(conn_t *);
+int conn_can_queue(conn_t *);
+void conn_queue(conn_t *, char *, size_t);
+void conn_hold(conn_t *, entry_t *);
+void conn_advance(conn_t *, size_t);
+void conn_wrote(conn_t *, size_t);
+int conn_process(server_t *, conn_t *);
+void conn_overflow(conn_t *);
+void conn_sent(conn_t *);
+void conn_deadline(server_t *, wheel_t *, conn_t *, unsigned long);
+int conn_drive(server_t *, conn_t *);
+void conn_close(conn_t *);
+
+#endif /* conn_h */
@@ -2,18 +2,25 @@
 #define core_h
 #include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include "sock.h"
 #include "sbuf.h"
 #include "http.h"
+#include "conn.h"
+#include "event.h"
+#include "uring.h"
+#include "proxy.h"
+#include "accesslog.h"
 #include "utils.h"
 
 #define NTHREADS 8
 #define MAX_HTTP_BUF 2048
 #define MAX_PATH_LEN 512
 
-void run_server(int, char *);
+void run_server(server_t *);
 void *thread_handle(void *);
+void serve_conn(int);
 
 #endif /* core_h */
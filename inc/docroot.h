@@ -0,0 +1,59 @@
+#ifndef docroot_h
+#define docroot_h
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "utils.h"
+#include "cache.h"
+#include "httpdate.h"
+
+#define DOCROOT_SLOTS_MIN 1024      // power of 2
+#define DOCROOT_INDEX "index.html"
+#define DOCROOT_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                        IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// What a request path resolves to, everything handle_request would
+// otherwise stat and format per request. Directories map to their index.html.
+typedef struct {
+    char *url;          // request path without trailing slashes, "" for the root
+    size_t urllen;
+    unsigned hash;
+    char *path;         // file to send
+    struct stat st;     // of path
+    char *mime;
+    char etag[ETAG_LEN_MAX];
+    char lastmod[HTTPDATE_LEN + 1];
+} docent_t;
+
+// Open addressing with linear probing, half full at most
+typedef struct {
+    docent_t **slots;   // NULL empty, or a node, or the tombstone
+    size_t nslots;
+    size_t used;        // nodes plus tombstones
+} doctable_t;
+
+// Index of every file under root, kept fresh by a watcher thread reading
+// inotify. Readers copy a node out under the read lock, never a syscall.
+typedef struct {
+    const char *root;
+    int nthreads;       // walkers for a full (re)scan
+    pthread_rwlock_t lock;
+    doctable_t *table;
+    int ifd;
+    pthread_mutex_t wdlock;
+    char **wdurl;       // watched directory's url by watch descriptor
+    int nwd;
+    pthread_t watcher;
+} docroot_t;
+
+docroot_t *docroot_create(const char *, int);
+int docroot_lookup(docroot_t *, const char *, docent_t *, char *, size_t);
+void docent_fill(docent_t *, char *, struct stat *);
+
+#endif /* docroot_h */
@@ -0,0 +1,29 @@
+#ifndef event_h
+#define event_h
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include "sock.h"
+#include "conn.h"
+#include "wheel.h"
+#include "utils.h"
+
+#define MAX_EVENTS 256
+
+// One edge-triggered epoll loop per core, each accepting on the shared
+// non-blocking listen socket and owning the connections it accepted.
+typedef struct {
+    int id;
+    int epfd;
+    int listenfd;
+    server_t *app;
+    pthread_t tid;
+    unsigned long now;  // wheel tick, refreshed after every wakeup
+    wheel_t wheel;      // deadlines of the loop's connections
+} loop_t;
+
+void loop_init(loop_t *, int, int, server_t *);
+void *loop_run(void *);
+
+#endif /* event_h */
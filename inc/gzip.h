@@ -0,0 +1,18 @@
+#ifndef gzip_h
+#define gzip_h
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+// Bodies smaller than this don't win enough to be worth a variant
+#define GZIP_MIN_SIZE 256
+#define GZIP_LEVEL 6
+#define GZIP_SUFFIX ".gz"
+
+int gzip_accepted(const char *);
+int gzip_compressible(const char *);
+char *gzip_compress(const char *, size_t, size_t *);
+void gzip_precompress(const char *, int);
+
+#endif /* gzip_h */
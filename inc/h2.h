@@ -0,0 +1,114 @@
+#ifndef h2_h
+#define h2_h
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "http.h"
+#include "conn.h"
+#include "hpack.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_FRAME_MAX 16384      // SETTINGS_MAX_FRAME_SIZE, the default both ways
+#define H2_WINDOW 65535         // initial flow control windows
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_STREAMS_MAX 100      // SETTINGS_MAX_CONCURRENT_STREAMS advertised
+#define H2_BLOCK_MAX 65536      // header block spread over CONTINUATION frames
+#define H2_FILE_BUF (4 * H2_FRAME_MAX)  // file bodies read per write round
+#define H2_COPY_MAX 1024        // DATA payloads up to this are copied next to their frame header
+// Left free in conn->out for the control frames one input frame may cause
+#define H2_CONTROL_ROOM 64
+
+// Frame types
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// Frame flags
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+// Error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+// Settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// What a stream still has to send
+#define H2S_HEADERS 1   // its response head
+#define H2S_DATA 2      // body, as windows allow
+#define H2S_DONE 3      // all queued, freed once written
+
+// One request and its response. The request is answered as soon as its
+// head is in; res borrows from the cache, bundle or a file like on HTTP/1.
+typedef struct H2stream {
+    uint32_t id;
+    int state;
+    int remote_closed;  // the client has ended its side
+    int head;           // HEAD, the response has no DATA
+    int64_t window;     // send window
+    arena_t arena;      // request and response memory, the stream's own
+    res_t res;
+    size_t bodysent;    // of the whole body, parts included
+    int part;           // multipart part being sent
+    size_t partsent;    // of that part
+    struct H2stream *next;
+} h2stream_t;
+
+// HTTP/2 connection state hung off a conn_t. Frames are read out of the
+// conn's rio and answered into its out buffer and segment queue, so every
+// engine writes them like pipelined HTTP/1 responses.
+struct H2 {
+    int preface;        // the client preface is still expected
+    int goaway;         // no new streams, close once the open ones are done
+    int failed;         // connection error, closed once the GOAWAY is out
+    hpack_t dec;        // the client's header table
+    hpack_t enc;        // ours
+    int64_t window;     // connection send window
+    int64_t peer_window;    // SETTINGS_INITIAL_WINDOW_SIZE for new streams
+    uint32_t peer_frame;    // SETTINGS_MAX_FRAME_SIZE
+    uint32_t recv;      // DATA received since the last connection WINDOW_UPDATE
+    uint32_t last_id;   // highest stream the client opened
+    int nstreams;
+    h2stream_t *streams, *tail;     // round robin order, served ones go to the tail
+    uint32_t cont;      // stream whose header block CONTINUATION frames extend, 0 for none
+    int cont_new;       // that block opens the stream
+    int cont_end;       // and ends it
+    unsigned char *block;
+    size_t blocklen;
+    size_t inpos, inlen;
+    unsigned char in[H2_FRAME_HEADER + H2_FRAME_MAX];
+    size_t filelen;
+    char file[H2_FILE_BUF];
+};
+
+int h2_preface(conn_t *);
+void h2_start(conn_t *);
+int h2_upgrade(server_t *, conn_t *, req_t *);
+int h2_process(server_t *, conn_t *);
+void h2_free(conn_t *);
+
+#endif /* h2_h */
@@ -0,0 +1,44 @@
+#ifndef hpack_h
+#define hpack_h
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "utils.h"
+#include "arena.h"
+
+// Dynamic table size on both sides, the SETTINGS_HEADER_TABLE_SIZE default
+#define HPACK_TABLE_SIZE 4096
+// Every entry costs its strings plus 32, so this many fit at most
+#define HPACK_ENTRIES (HPACK_TABLE_SIZE / 32)
+#define HPACK_STATIC 61
+
+typedef struct {
+    char *name;         // one allocation holding both strings
+    size_t namelen;
+    char *value;
+    size_t valuelen;
+} hpack_field_t;
+
+// RFC 7541 dynamic table, one per direction of a connection: a ring with
+// the newest entry at head, evicted oldest first as it outgrows max.
+typedef struct {
+    hpack_field_t ents[HPACK_ENTRIES];
+    unsigned head;
+    unsigned count;
+    size_t size;        // of the entries, as RFC 7541 counts it
+    size_t max;
+    int resized;        // encoder: max changed, the next block must say so
+} hpack_t;
+
+// Receives each decoded field, strings NUL terminated in the arena
+typedef int (*hpack_emit_t)(void *, char *, size_t, char *, size_t);
+
+void hpack_init(hpack_t *);
+void hpack_free(hpack_t *);
+void hpack_resize(hpack_t *, size_t);
+int hpack_decode(hpack_t *, const unsigned char *, size_t, arena_t *, hpack_emit_t, void *);
+size_t hpack_begin(hpack_t *, unsigned char *, size_t, size_t);
+size_t hpack_encode(hpack_t *, unsigned char *, size_t, size_t, const char *, size_t, const char *, size_t, int);
+
+#endif /* hpack_h */
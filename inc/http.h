@@ -2,6 +2,7 @@
 #define http_h
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
 #include <ctype.h>
@@ -10,23 +11,69 @@
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include "utils.h"
-#include "core.h"
 #include "rio.h"
+#include "cache.h"
+#include "arena.h"
+#include "parser.h"
+#include "httpdate.h"
+#include "docroot.h"
+#include "bundle.h"
+#include "phash.h"
+#include "metrics.h"
 
 #define SERVER_NAME "Cerver"
 #define CRLF "\r\n"
 #define HDR_LEN_MAX 2048
 #define URI_LEN_MAX 1024
 #define BODY_MAX 4096
+// Byte ranges one response may carry, a Range asking for more is ignored
+#define RANGES_MAX 8
 // According to Posix style convention, -1 failed, 0 ok
 #define FAILED -1
 #define OK 0
 
+// Connection engines
+#define ENGINE_EPOLL 0
+#define ENGINE_THREAD 1
+#define ENGINE_URING 2
+
+typedef struct Route route_t;
+typedef struct Proxy proxy_t;
+
 typedef struct {
   int port;
   char *www;
+  int engine;
+  int nthreads;     // event loops or workers, 0 picks the engine default
+  int reuseport;    // one SO_REUSEPORT listener per loop or worker, no handoff
+  int pin;          // pin loop or worker i to cpu i
+  int max_requests; // per keep-alive connection, 0 for unlimited
+  int idle_timeout; // seconds a keep-alive connection may wait for its next request
+  int header_timeout; // seconds to receive a whole request head
+  int write_timeout; // seconds a response may go without the peer reading any of it
+  int max_conns;    // connections served at once, more are shed with 503, 0 for unlimited
+  int queue_size;   // accepted connections waiting for a worker (thread engine), 0 blocks the acceptor instead
+  char *metrics_path; // serves the metrics there instead of a file, NULL disables it
+  char *access_log; // combined format log file, reopened on SIGHUP, NULL disables it
+  size_t cache_size; // content cache budget in bytes, 0 disables it
+  int precompress;  // write .gz siblings for the document root before serving
+  char *mime_file;  // mime.types format additions to the built-in table
+  int index;        // resolve paths through a startup index of www, no stat per request
+  char *bundle;     // serve the site packed in this mkbundle file instead of www
+  int h2;           // accept cleartext HTTP/2, by prior knowledge or Upgrade: h2c
+  route_t *routes;  // path prefixes forwarded to upstreams, tried in order
+  int nroutes;
+  cache_t *cache;
+  docroot_t *docroot;
 } server_t;
 
+typedef struct Conn conn_t;
+typedef struct H2 h2_t;
+
+// perfect hash tables generated by mkphash
+extern const phash_t mime_tab;
+extern const phash_t method_tab;
+
 typedef struct Location {
     char *hash;
     char *path;
@@ -35,51 +82,85 @@ typedef struct Location {
 struct Header {
     char *name;
     char *value;
+    size_t namelen;
+    size_t valuelen;
     struct Header *next;
 };
 typedef struct Header header_t;
 struct Request {
     // longest methods are `options` and `connect`, 8 bytes is ok
     char method[8];
+    // HTTP/1.1 defaults to persistent, Connection header may override
+    int keep_alive;
+    int body;           // Content-Length or Transfer-Encoding, only upstreams read it
     header_t *header;
     location_t *location;
+    arena_t *arena;     // backs header nodes and location, strings stay in rio buffer
 };
 typedef struct Request req_t;
 
+// One part of a multipart/byteranges body: delimiter and part headers,
+// then len bytes of the file from start
+typedef struct {
+    size_t start;
+    size_t len;
+    char *head;
+    size_t headlen;
+} range_t;
+
 struct Response {
     char *body;
     size_t length;
+    // file-backed body, sent straight from page cache when fd >= 0
+    off_t offset;
+    int fd;
+    // body borrowed from the content cache, released with the response
+    entry_t *entry;
+    // body mapped from a site bundle, which is held until the response is out
+    bundle_t *bundle;
+    // forwarded there instead, the upstream writes the response
+    route_t *route;
+    // multipart parts plus a closing one with len 0, sliced from fd or body
+    range_t *ranges;
+    int nranges;
     header_t *header;
     // remember last header, thus don't have to search entire linked list for appending
     header_t *last;
+    arena_t *arena;     // backs headers and generated bodies
     // keep int last, minimize memory while satisfy align requirement on 64-bit
     int status;
 };
 typedef struct Response res_t;
 
-void web_handle(server_t *, int);
-void report_client(struct sockaddr_in *);
-int read_startline(rio_t *, req_t *, res_t *);
-int read_request_headers(rio_t *, req_t *);
+void web_handle(server_t *, conn_t *);
+int read_startline(parser_t *, char *, req_t *, res_t *);
+int read_request_headers(parser_t *, char *, req_t *);
 int trimright_line(char *);
 int get_request(rio_t *, req_t *, res_t *);
 int handle_request(server_t *, req_t *, res_t *);
-void free_request(req_t *);
+int not_modified(req_t *, const char *, time_t);
+int select_ranges(req_t *, res_t *, const char *, time_t, size_t, char *);
+int serve_entry(server_t *, req_t *, res_t *, entry_t *);
 void print_headers(header_t *);
 void append_header(res_t *, header_t *);
 void free_response(res_t *);
-void free_headers(header_t *header);
 char *get_http_message(int);
+char *find_header(header_t *, const char *);
+int has_token(const char *, const char *);
 
-header_t *new_header(const char *, const char *);
-void httpsend_error(int connfd, res_t *res);
-void httpsend(int connfd, res_t *res);
-void req_init(req_t *);
-void res_init(res_t *);
+header_t *new_header(arena_t *, const char *, const char *);
+header_t *header_ref(arena_t *, const char *, const char *);
+void error_response(res_t *);
+void httpsend_error(conn_t *, res_t *);
+void httpsend(conn_t *, res_t *);
+void req_init(req_t *, arena_t *);
+void res_init(res_t *, arena_t *);
+void log_request(struct in_addr, req_t *, res_t *, const char *);
 
 char *stringify_time(time_t);
 char *get_extension(const char *);
 char *get_mime(const char *);
+int load_mime_types(const char *);
 int parse_location(char *, location_t*);
 int check_method(char *);
 
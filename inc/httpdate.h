@@ -0,0 +1,22 @@
+#ifndef httpdate_h
+#define httpdate_h
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define HTTPDATE_LEN 29     // "Sun, 06 Nov 1994 08:49:37 GMT"
+// Published Date lines rotate through these; a reader would have to stall
+// this many seconds mid-copy to see one being rewritten
+#define HTTPDATE_SLOTS 4
+
+typedef struct {
+    time_t second;
+    size_t len;
+    char line[48];          // "Date: <IMF-fixdate>\r\n"
+} dateline_t;
+
+size_t httpdate_format(time_t, char *);
+int httpdate_parse(const char *, time_t *);
+const dateline_t *httpdate_line(void);
+
+#endif /* httpdate_h */
@@ -0,0 +1,84 @@
+#ifndef metrics_h
+#define metrics_h
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "utils.h"
+#include "stats.h"
+
+#define METRICS_LINE 64
+// log-linear buckets: every power of 2 split in 2^METRICS_SUB_BITS
+#define METRICS_SUB_BITS 2
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+// exported range of the latency histograms, in ns: about 1us to 34s
+#define METRICS_EXPORT_MIN (1ULL << 10)
+#define METRICS_EXPORT_MAX (1ULL << 35)
+#define METRICS_BODY_MAX (64 << 10)
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+// Latency phases of a request
+#define HIST_QUEUE 0    // accept to dequeue by a thread worker
+#define HIST_PARSE 1    // request head to req_t
+#define HIST_LOOKUP 2   // req_t to response, finding the file included
+#define HIST_SEND 3     // first to last byte of a batch of responses
+#define HIST_MAX 4
+
+// Response status codes counted one by one, anything else is "other"
+#define METRICS_CODES 200, 204, 206, 304, 400, 403, 404, 405, 416, 500, 502, 503
+#define METRICS_STATUS_MAX 13
+
+typedef struct {
+    uint64_t sum;       // ns
+    uint64_t buckets[METRICS_BUCKETS];
+} hist_t;
+
+// One per thread that records, alone on its cache lines. Only the owner
+// writes, so an update is a plain load and store; scrapes read it racily
+// but untorn and sum all threads on demand.
+typedef struct Metrics {
+    uint64_t requests;
+    uint64_t status[METRICS_STATUS_MAX];
+    uint64_t bytes_sent;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t errors;        // connections ended by a socket error
+    uint64_t upstream_connects; // proxied requests that needed a new upstream connection
+    uint64_t upstream_reused;   // and those sent over a pooled one
+    uint64_t log_dropped;   // access log records lost to a full ring
+    hist_t hist[HIST_MAX];
+    struct Metrics *next;   // registry of all threads' metrics
+} __attribute__((aligned(METRICS_LINE))) metrics_t;
+
+extern __thread metrics_t *metrics_self;
+metrics_t *metrics_register(void);
+int metrics_status_index(int);
+size_t metrics_render(char *, size_t);
+
+static inline metrics_t *metrics_local(void) {
+    return __builtin_expect(metrics_self != NULL, 1) ? metrics_self : metrics_register();
+}
+
+static inline void metrics_bump(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline int metrics_bucket(uint64_t v) {
+    int msb = 63 - __builtin_clzll(v | 1);
+    if (msb < METRICS_SUB_BITS) return (int)v;
+    return ((msb - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + (int)((v >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+}
+
+// Record the time since start in histogram h, returns now for the next phase
+static inline uint64_t metrics_time(int h, uint64_t start) {
+    uint64_t now = mono_ns(), ns = now > start ? now - start : 0;
+    hist_t *hp = &metrics_local()->hist[h];
+    metrics_bump(&hp->buckets[metrics_bucket(ns)], 1);
+    metrics_bump(&hp->sum, ns);
+    return now;
+}
+
+#define METRIC_ADD(field, n) metrics_bump(&metrics_local()->field, (n))
+#define METRIC_STATUS(code) metrics_bump(&metrics_local()->status[metrics_status_index(code)], 1)
+
+#endif /* metrics_h */
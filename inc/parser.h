@@ -0,0 +1,42 @@
+#ifndef parser_h
+#define parser_h
+#include <stddef.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define PARSE_AGAIN 0   // head incomplete, feed more bytes
+#define PARSE_DONE 1
+#define PARSE_ERROR 2
+#define MAX_HEADERS 32
+
+// (offset, length) slice of the request head, relative to its first byte
+typedef struct {
+    unsigned off;
+    unsigned len;
+} span_t;
+
+// Incremental request head parser working in place on the rio_t buffer.
+// Nothing is copied; it records where tokens are and resumes from where
+// the last call stopped when a head arrives in pieces.
+typedef struct {
+    int state;
+    int started;        // request line seen
+    size_t pos;         // next byte to scan
+    size_t line;        // start of the current line
+    size_t headlen;     // bytes of the whole head, valid once done
+    span_t method;
+    span_t uri;
+    span_t version;
+    int nheaders;
+    span_t names[MAX_HEADERS];
+    span_t values[MAX_HEADERS];
+} parser_t;
+
+void parser_init(parser_t *);
+int parse_head(parser_t *, const char *, size_t);
+// first occurrence of a byte in [p, end), the widest compare the cpu has
+extern const char *(*find_byte)(const char *, const char *, char);
+
+#endif /* parser_h */
@@ -0,0 +1,34 @@
+#ifndef phash_h
+#define phash_h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// Seeds tried per bucket before the table is made bigger
+#define PHASH_TRIES 100000
+
+typedef struct {
+    const char *key;    // NULL in empty slots
+    size_t keylen;
+    const char *value;
+} phash_entry_t;
+
+// Perfect hash, hash-and-displace: the key's bucket picks a seed, the
+// seeded hash its slot. One probe and one compare, no collisions.
+typedef struct {
+    size_t nbuckets;
+    size_t nslots;      // power of 2
+    const unsigned *disp;
+    const phash_entry_t *slots;
+    int nocase;
+} phash_t;
+
+unsigned phash_hash(const char *, size_t, unsigned, int);
+const char *phash_find(const phash_t *, const char *, size_t);
+int phash_build(phash_t *, phash_entry_t *, size_t, int);
+int phash_load(const char *, int, phash_entry_t **, size_t *);
+int phash_extend(const phash_t *, const char *, phash_t *);
+
+#endif /* phash_h */
@@ -0,0 +1,27 @@
+#ifndef probe_h
+#define probe_h
+
+// Static tracepoints on the request lifecycle, provider "cerver". Built on
+// sys/sdt.h when it is around: each probe is a single nop plus an ELF note
+// bpftrace or perf attach to, costing nothing until then. Without it, or
+// with -DCERVER_NO_PROBES, they compile to nothing. See tools/ for scripts.
+#if !defined(CERVER_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CERVER_PROBES 1
+#endif
+#endif
+
+#ifdef CERVER_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(cerver, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(cerver, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(cerver, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(cerver, name, a, b, c, d)
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+#endif /* probe_h */
@@ -0,0 +1,89 @@
+#ifndef proxy_h
+#define proxy_h
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "http.h"
+#include "conn.h"
+
+#define PROXY_ROUTES_MAX 16
+#define PROXY_POOL_MAX 32       // idle upstream connections a worker keeps per route
+#define PROXY_HEAD_MAX 8192     // the request head sent upstream, the response head read back
+#define PROXY_PIPE 65536        // spliced at once, the default pipe capacity
+#define PROXY_LINE_MAX 256      // chunk size line, extensions included
+
+// Where an exchange is, in order
+#define PX_IDLE 0
+#define PX_CONNECT 1    // taking a pooled upstream, or waiting for a fresh one
+#define PX_REQUEST 2    // sending the request head
+#define PX_BODY 3       // relaying the request body
+#define PX_HEAD 4       // reading the response head
+#define PX_REPLY 5      // sending the rewritten head to the client
+#define PX_DATA 6       // relaying the response body
+
+// How the end of a response body is found
+#define BODY_NONE 0
+#define BODY_LENGTH 1
+#define BODY_CHUNKED 2
+#define BODY_EOF 3      // upstream closes after it, and so do we
+
+// Chunked bodies are passed through unchanged, the framing is only followed
+#define CHUNK_SIZE 0    // at a chunk size line
+#define CHUNK_DATA 1    // in a chunk's data and its CRLF
+#define CHUNK_TRAILER 2 // after the last chunk, until an empty line
+#define CHUNK_DONE 3
+
+// Requests whose path starts with prefix go to an upstream instead of www
+struct Route {
+    char *prefix;
+    size_t prefixlen;
+    char *upstream;     // as configured, the Host of requests without one
+    int id;             // index into each worker's pools
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+// One proxied exchange at a time, hung off the conn until it closes. Heads
+// go through user space, bodies are spliced socket to pipe to socket;
+// bytes read along with a head are forwarded from buf first.
+struct Proxy {
+    int state;
+    route_t *route;
+    int fd;             // upstream, -1 for none
+    int reused;         // came from the pool, may have been closed under us
+    int keep;           // upstream may go back to the pool once done
+    int headonly;       // HEAD, no response body whatever the head says
+    int framing;
+    int chunk;
+    int eof;            // BODY_EOF: upstream closed
+    int status;
+    int pipe[2];
+    size_t piped;       // in the pipe, not yet written out
+    size_t bodylen;     // request body
+    size_t left;        // of the request body, or of the response body or chunk
+    size_t body;        // response body bytes relayed, for the log
+    size_t headlen, headsent;
+    size_t pos, len, fwd;   // buf: parsed up to pos, filled up to len, fwd from pos approved for the client
+    req_t req;          // for the access log, valid until the arena is reset
+    char version[9];
+    char head[PROXY_HEAD_MAX + 64];
+    char buf[PROXY_HEAD_MAX];
+};
+
+static inline int proxy_active(conn_t *conn) {
+    return conn->px && conn->px->state != PX_IDLE;
+}
+
+int proxy_add_route(server_t *, char *);
+route_t *proxy_route(server_t *, char *);
+int proxy_start(server_t *, conn_t *, req_t *, route_t *);
+int proxy_drive(server_t *, conn_t *);
+void proxy_free(conn_t *);
+
+#endif /* proxy_h */
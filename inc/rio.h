@@ -9,7 +9,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-#define IO_BUF_MAX 2048
+#define IO_BUF_MAX 16384  // a whole request head, cookies included, must fit
 typedef struct {
     int fd;             // Binded file descriptor
     int unread;         // unread data in buffer
@@ -18,6 +18,8 @@ typedef struct {
 } rio_t;
 
 void rio_init(rio_t *, int);
+ssize_t rio_fill(rio_t *);
+void rio_consume(rio_t *, size_t);
 ssize_t rio_read(rio_t *, char *, size_t);
 ssize_t rio_readline(rio_t *, void *, size_t);
 ssize_t rio_writen(int, char *, size_t);
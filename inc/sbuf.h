@@ -1,23 +1,49 @@
 #ifndef sbuf_h
 #define sbuf_h
-#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <semaphore.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "utils.h"
+#include "probe.h"
 
+#define CACHE_LINE 64
+// tries before a blocked side goes to sleep on the futex
+#define SBUF_SPIN 64
+
+// One slot of the ring. seq tells whose turn it is: == pos free for the
+// producer of pos, == pos + 1 full for the consumer of pos.
+typedef struct {
+    size_t seq;
+    int fd;
+    uint64_t stamp;     // mono_ns when inserted
+} cell_t;
+
+// Bounded lock-free MPMC ring (Vyukov). Producers and consumers only meet
+// on the cells; a side that finds the ring full or empty sleeps on a futex
+// word the other side bumps.
 typedef struct {
-    int *buf;
+    cell_t *buf;
+    size_t mask;
     int capacity;
-    int head;
-    int tail;
-    sem_t *items;
-    sem_t *mutex;
-    sem_t *slots;
+    size_t tail __attribute__((aligned(CACHE_LINE)));   // next enqueue position
+    size_t head __attribute__((aligned(CACHE_LINE)));   // next dequeue position
+    unsigned items __attribute__((aligned(CACHE_LINE))); // bumped on enqueue, consumers wait on it
+    int consumers_waiting;
+    unsigned slots __attribute__((aligned(CACHE_LINE))); // bumped on dequeue, producers wait on it
+    int producers_waiting;
 } sbuf_t;
 
 void sbuf_init(sbuf_t *, int);
 void sbuf_insert(sbuf_t *, int);
+int sbuf_try_insert(sbuf_t *, int);
+int sbuf_depth(sbuf_t *);
 int sbuf_delete(sbuf_t *);
+int sbuf_delete_stamped(sbuf_t *, uint64_t *);
+int sbuf_insert_batch(sbuf_t *, int *, int);
+int sbuf_delete_batch(sbuf_t *, int *, int);
 void sbuf_destroy(sbuf_t *);
 void print_sbuf(char *, sbuf_t *);
 #endif /* sbuf_h */
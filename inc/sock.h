@@ -1,6 +1,7 @@
 #ifndef sock_h
 #define sock_h
 #include <strings.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include "utils.h"
@@ -9,5 +10,7 @@
 
 typedef struct sockaddr SA;
 int open_listenfd(int);
+int open_reuseport_listenfd(int, int);
+int set_nonblocking(int);
 
 #endif /* sock_h */
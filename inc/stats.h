@@ -0,0 +1,19 @@
+#ifndef stats_h
+#define stats_h
+
+// Process wide counters, bumped by every thread with relaxed atomics
+typedef struct {
+    long accepted;
+    long inflight;          // connections being served right now
+    long shed;              // refused with a 503 at admission
+    long timeout_header;    // request head not complete in time
+    long timeout_write;     // peer stopped reading a response
+    long timeout_idle;      // keep-alive connection left unused
+} stats_t;
+
+extern stats_t stats;
+
+#define STAT_ADD(name, n) __atomic_add_fetch(&stats.name, (n), __ATOMIC_RELAXED)
+#define STAT_GET(name) __atomic_load_n(&stats.name, __ATOMIC_RELAXED)
+
+#endif /* stats_h */
@@ -0,0 +1,71 @@
+#ifndef uring_h
+#define uring_h
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "sock.h"
+#include "conn.h"
+#include "wheel.h"
+#include "utils.h"
+
+#define URING_ENTRIES 1024      // submission queue, completions get twice as many
+#define URING_BUFS 512          // provided receive buffers per ring, power of 2
+#define URING_BUF_SIZE 2048     // per receive, gathered into rio
+#define URING_BGID 0
+#define URING_PIPE_SIZE (256 << 10)  // splice pipe, a file body goes through in chunks of it
+
+// What a completion is for, in the low bits of its conn pointer
+#define UD_RECV 0
+#define UD_SEND 1
+#define UD_SPLICE_IN 2          // file to pipe
+#define UD_SPLICE_OUT 3         // pipe to socket
+#define UD_MASK 3
+#define UD_ACCEPT 0             // user_data of the multishot accept, no conn
+
+// A connection on a ring: the shared state machine plus what its
+// operations in flight need to stay put until they complete
+typedef struct Uconn {
+    conn_t conn;
+    int ops;            // submitted, not yet completed
+    int recving;        // a receive is armed
+    int writing;        // send or splice operations in flight
+    int closing;        // shut down, freed once ops drops to 0
+    char *spill;        // received bytes that did not fit in rio yet
+    size_t spilllen;
+    int spillbid;       // provided buffer holding them
+    int pipe[2];        // for file bodies, made on first use
+    size_t pipesz;
+    size_t inpipe;      // body bytes spliced in, not yet out
+    struct msghdr msg;  // of the send in flight
+    struct Uconn *starved;  // waiting for a receive buffer
+} uconn_t;
+
+// One ring per core, driven by a single thread through raw syscalls
+typedef struct {
+    int id;
+    int fd;
+    int listenfd;
+    server_t *app;
+    pthread_t tid;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned sq_local;          // tail including unsubmitted entries
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned short br_tail;
+    uconn_t *starved;           // receives to retry once buffers come back
+    unsigned long now;
+    wheel_t wheel;
+} uring_t;
+
+int uring_probe(void);
+void uring_init(uring_t *, int, int, server_t *);
+void *uring_run(void *);
+
+#endif /* uring_h */
@@ -2,5 +2,13 @@
 #define utils_h
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 void fatal_exit(int, char *);
+size_t parse_size(const char *);
+int pin_cpu(int);
+uint64_t mono_ns(void);
 #endif /* utils_h */
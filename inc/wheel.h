@@ -0,0 +1,36 @@
+#ifndef wheel_h
+#define wheel_h
+#include <stddef.h>
+#include <time.h>
+
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)    // slots per level
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4                  // 2^24 ticks, about 19 days
+
+// Intrusive timer, embedded in whatever it times out
+typedef struct Wtimer {
+    struct Wtimer *prev;
+    struct Wtimer *next;
+    unsigned long expires;  // tick
+} wtimer_t;
+
+typedef void (*expire_fn)(wtimer_t *, void *);
+
+// Hierarchical timing wheel. Level 0 has one slot per tick, every level up
+// covers WHEEL_SIZE times as much and is cascaded down as time reaches it.
+// Arming and cancelling are O(1) list operations.
+typedef struct {
+    unsigned long now;      // last tick processed
+    int count;              // armed timers
+    wtimer_t slots[WHEEL_LEVELS][WHEEL_SIZE];   // list heads
+} wheel_t;
+
+unsigned long wheel_ticks(void);
+void wheel_init(wheel_t *, unsigned long);
+void wheel_arm(wheel_t *, wtimer_t *, unsigned long);
+void wheel_cancel(wheel_t *, wtimer_t *);
+void wheel_advance(wheel_t *, unsigned long, expire_fn, void *);
+
+#endif /* wheel_h */
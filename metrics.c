@@ -0,0 +1,124 @@
+#include "./inc/metrics.h"
+
+__thread metrics_t *metrics_self;
+static metrics_t *registry;
+static const int codes[] = { METRICS_CODES };
+static const char *hist_names[HIST_MAX] = { "queue", "parse", "lookup", "send" };
+
+// First record on a thread: give it its own metrics and publish them to
+// scrapes. Threads live as long as the server, so nothing is ever removed.
+metrics_t *metrics_register(void) {
+    metrics_t *mp = (metrics_t *)aligned_alloc(METRICS_LINE, sizeof(metrics_t));
+    if (!mp) fatal_exit(1, "Failed allocate metrics");
+    memset(mp, 0, sizeof(metrics_t));
+    mp->next = __atomic_load_n(&registry, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&registry, &mp->next, mp, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return metrics_self = mp;
+}
+
+int metrics_status_index(int code) {
+    int i;
+    for(i = 0; i < (int)(sizeof(codes) / sizeof(codes[0])); i++) {
+        if (codes[i] == code) return i;
+    }
+    return METRICS_STATUS_MAX - 1;
+}
+
+// lowest value of a bucket, in ns
+static uint64_t bucket_lower(int i) {
+    int msb;
+    if (i < METRICS_SUB) return i;
+    msb = (i >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    return (uint64_t)(METRICS_SUB + (i & (METRICS_SUB - 1))) << (msb - METRICS_SUB_BITS);
+}
+
+static uint64_t load(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+// every thread's metrics added up
+static void metrics_sum(metrics_t *total) {
+    metrics_t *mp;
+    int i, h;
+    memset(total, 0, sizeof(metrics_t));
+    for(mp = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); mp; mp = mp->next) {
+        total->requests += load(&mp->requests);
+        for(i = 0; i < METRICS_STATUS_MAX; i++) total->status[i] += load(&mp->status[i]);
+        total->bytes_sent += load(&mp->bytes_sent);
+        total->cache_hits += load(&mp->cache_hits);
+        total->cache_misses += load(&mp->cache_misses);
+        total->errors += load(&mp->errors);
+        total->upstream_connects += load(&mp->upstream_connects);
+        total->upstream_reused += load(&mp->upstream_reused);
+        total->log_dropped += load(&mp->log_dropped);
+        for(h = 0; h < HIST_MAX; h++) {
+            total->hist[h].sum += load(&mp->hist[h].sum);
+            for(i = 0; i < METRICS_BUCKETS; i++) total->hist[h].buckets[i] += load(&mp->hist[h].buckets[i]);
+        }
+    }
+}
+
+#define EMIT(...) do { \
+    int n = snprintf(buf + len, len < cap ? cap - len : 0, __VA_ARGS__); \
+    if (n > 0) len += n; \
+} while(0)
+
+static size_t render_counter(char *buf, size_t len, size_t cap, const char *name, const char *help, uint64_t v) {
+    EMIT("# HELP cerver_%s %s\n# TYPE cerver_%s counter\ncerver_%s %lu\n", name, help, name, name, (unsigned long)v);
+    return len;
+}
+
+// Cumulative buckets at the log-linear boundaries within the export range,
+// so the set of series stays the same from scrape to scrape
+static size_t render_hist(char *buf, size_t len, size_t cap, const char *name, hist_t *hp) {
+    int i, first = metrics_bucket(METRICS_EXPORT_MIN), last = metrics_bucket(METRICS_EXPORT_MAX);
+    uint64_t count = 0;
+    EMIT("# HELP cerver_%s_seconds Time spent in the %s phase.\n# TYPE cerver_%s_seconds histogram\n",
+         name, name, name);
+    for(i = 0; i < first; i++) count += hp->buckets[i];
+    for(i = first; i <= last; i++) {
+        EMIT("cerver_%s_seconds_bucket{le=\"%.12g\"} %lu\n", name, bucket_lower(i) / 1e9, (unsigned long)count);
+        count += hp->buckets[i];
+    }
+    for(; i < METRICS_BUCKETS; i++) count += hp->buckets[i];
+    EMIT("cerver_%s_seconds_bucket{le=\"+Inf\"} %lu\ncerver_%s_seconds_sum %.9f\ncerver_%s_seconds_count %lu\n",
+         name, (unsigned long)count, name, hp->sum / 1e9, name, (unsigned long)count);
+    return len;
+}
+
+// Prometheus text exposition of everything counted so far. Returns the
+// length, cut short rather than overflowing cap.
+size_t metrics_render(char *buf, size_t cap) {
+    metrics_t total;
+    size_t len = 0;
+    int i, h;
+    metrics_sum(&total);
+    len = render_counter(buf, len, cap, "requests_total", "Requests parsed.", total.requests);
+    EMIT("# HELP cerver_responses_total Responses by status code.\n# TYPE cerver_responses_total counter\n");
+    for(i = 0; i < METRICS_STATUS_MAX - 1; i++) {
+        EMIT("cerver_responses_total{code=\"%d\"} %lu\n", codes[i], (unsigned long)total.status[i]);
+    }
+    EMIT("cerver_responses_total{code=\"other\"} %lu\n", (unsigned long)total.status[METRICS_STATUS_MAX - 1]);
+    len = render_counter(buf, len, cap, "sent_bytes_total", "Bytes written to clients.", total.bytes_sent);
+    len = render_counter(buf, len, cap, "cache_hits_total", "Content cache lookups that hit.", total.cache_hits);
+    len = render_counter(buf, len, cap, "cache_misses_total", "Content cache lookups that missed.", total.cache_misses);
+    len = render_counter(buf, len, cap, "errors_total", "Connections ended by a socket error.", total.errors);
+    len = render_counter(buf, len, cap, "upstream_connects_total", "Upstream connections opened.",
+                         total.upstream_connects);
+    len = render_counter(buf, len, cap, "upstream_reused_total", "Proxied requests sent on a pooled upstream connection.",
+                         total.upstream_reused);
+    len = render_counter(buf, len, cap, "access_log_dropped_total", "Access log records dropped on a full ring.",
+                         total.log_dropped);
+    len = render_counter(buf, len, cap, "connections_accepted_total", "Connections accepted.", STAT_GET(accepted));
+    EMIT("# HELP cerver_connections_inflight Connections being served.\n# TYPE cerver_connections_inflight gauge\n"
+         "cerver_connections_inflight %ld\n", STAT_GET(inflight));
+    len = render_counter(buf, len, cap, "connections_shed_total", "Connections refused with 503.", STAT_GET(shed));
+    EMIT("# HELP cerver_connections_timed_out_total Connections closed for missing a deadline.\n"
+         "# TYPE cerver_connections_timed_out_total counter\n"
+         "cerver_connections_timed_out_total{phase=\"header\"} %ld\n"
+         "cerver_connections_timed_out_total{phase=\"write\"} %ld\n"
+         "cerver_connections_timed_out_total{phase=\"idle\"} %ld\n",
+         STAT_GET(timeout_header), STAT_GET(timeout_write), STAT_GET(timeout_idle));
+    for(h = 0; h < HIST_MAX; h++) len = render_hist(buf, len, cap, hist_names[h], &total.hist[h]);
+    return len < cap ? len : cap - 1;
+}
@@ -0,0 +1,231 @@
+#include <ftw.h>
+#include "./inc/http.h"
+#include "./inc/gzip.h"
+
+// Build-time packer: turn a directory into one site bundle that cerver -b
+// maps and serves. Paths, types and validators are worked out here once;
+// -z adds gzip variants of compressible files that come out smaller.
+// The bundle is written next to out and renamed over it, so a server
+// serving out picks up the whole new version or none of it.
+
+typedef struct {
+  char *url;          // "/a/b.css", "" for the root
+  char *path;         // on disk, NULL for a directory
+  char *mime;
+  struct stat st;
+  bundle_ent_t ent;
+} rec_t;
+
+static rec_t *recs;
+static size_t nrecs, caprecs;
+static size_t rootlen;
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-z] dir out\n", prog);
+  exit(1);
+}
+
+static int collect(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  struct stat target;
+  rec_t *r;
+  (void)ftw;
+  // symlinks to files are followed, to directories not, like the docroot index
+  if (flag == FTW_SL) {
+    if (stat(path, &target) < 0 || !S_ISREG(target.st_mode)) return 0;
+    st = &target;
+  } else if (!(flag == FTW_F && S_ISREG(st->st_mode)) && flag != FTW_D) {
+    return 0;
+  }
+  if (strlen(path + rootlen) >= URI_LEN_MAX) return 0;
+  if (nrecs == caprecs) {
+    caprecs = caprecs ? caprecs * 2 : 256;
+    if ((recs = (rec_t *)realloc(recs, caprecs * sizeof(rec_t))) == NULL) return -1;
+  }
+  r = &recs[nrecs++];
+  memset(r, 0, sizeof(*r));
+  r->url = strdup(path + rootlen);
+  r->path = S_ISDIR(st->st_mode) ? NULL : strdup(path);
+  r->st = *st;
+  return 0;
+}
+
+// FNV-1a over the content, so the ETag survives repacking an unchanged file
+static uint64_t hash_content(const char *buf, size_t n) {
+  uint64_t h = 14695981039346656037ull;
+  while(n--) {
+    h ^= (unsigned char)*buf++;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static char *read_file(const char *path, size_t size) {
+  char *buf = (char *)malloc(size ? size : 1);
+  size_t done = 0;
+  ssize_t n;
+  int fd;
+  if (!buf || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+  while(done < size && (n = read(fd, buf + done, size - done)) > 0) done += n;
+  close(fd);
+  if (done < size) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+static uint64_t align(uint64_t off) {
+  return (off + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+}
+
+static void put(int fd, const void *buf, size_t n, uint64_t off) {
+  ssize_t w;
+  while(n) {
+    if ((w = pwrite(fd, buf, n, off)) < 0) {
+      perror("write");
+      exit(1);
+    }
+    buf = (const char *)buf + w;
+    n -= w;
+    off += w;
+  }
+}
+
+// where dir's index.html is in recs, or -1
+static long find_index(size_t dir) {
+  char url[URI_LEN_MAX + sizeof(DOCROOT_INDEX) + 1];
+  size_t i;
+  snprintf(url, sizeof(url), "%s/%s", recs[dir].url, DOCROOT_INDEX);
+  for(i = 0; i < nrecs; i++) {
+    if (recs[i].path && strcmp(recs[i].url, url) == 0) return i;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  phash_entry_t *keys;
+  phash_t ph;
+  bundle_hdr_t hdr;
+  uint32_t *slots;
+  bundle_ent_t alias;
+  char tmp[URI_LEN_MAX], *data, *gz;
+  size_t i, n, gzlen;
+  uint64_t off, strings, hash;
+  long idx;
+  int opt, compress = 0, fd;
+  while((opt = getopt(argc, argv, "z")) != -1) {
+    switch(opt) {
+      case 'z':
+        compress = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) usage(argv[0]);
+  rootlen = strlen(argv[optind]);
+  while(rootlen > 1 && argv[optind][rootlen - 1] == '/') argv[optind][--rootlen] = 0;
+  if (nftw(argv[optind], collect, 16, FTW_PHYS) < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  // directories stand for their index.html, or for nothing
+  for(i = n = 0; i < nrecs; i++) {
+    if (recs[i].path || find_index(i) >= 0) recs[n++] = recs[i];
+  }
+  nrecs = n;
+
+  if ((keys = (phash_entry_t *)calloc(nrecs + 1, sizeof(phash_entry_t))) == NULL) return 1;
+  for(i = 0; i < nrecs; i++) {
+    keys[i].key = recs[i].url;
+    keys[i].keylen = strlen(recs[i].url);
+    keys[i].value = (const char *)&recs[i];
+  }
+  if (phash_build(&ph, keys, nrecs, 0) < 0) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic));
+  hdr.nentries = nrecs;
+  hdr.nbuckets = ph.nbuckets;
+  hdr.nslots = ph.nslots;
+  hdr.disp = sizeof(hdr);
+  hdr.slots = hdr.disp + hdr.nbuckets * sizeof(uint32_t);
+  hdr.entries = (hdr.slots + hdr.nslots * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+  strings = hdr.entries + nrecs * sizeof(bundle_ent_t);
+  if ((slots = (uint32_t *)calloc(ph.nslots, sizeof(uint32_t))) == NULL) return 1;
+  for(i = 0; i < ph.nslots; i++) {
+    if (ph.slots[i].key) slots[i] = (const rec_t *)ph.slots[i].value - recs + 1;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", argv[optind + 1]);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    perror(tmp);
+    return 1;
+  }
+  // urls and types, then the bodies from the first page after them
+  for(i = 0; i < nrecs; i++) {
+    recs[i].ent.urllen = strlen(recs[i].url);
+    recs[i].ent.url = strings;
+    put(fd, recs[i].url, recs[i].ent.urllen + 1, strings);
+    strings += recs[i].ent.urllen + 1;
+    if (recs[i].path && (recs[i].mime = get_mime(get_extension(recs[i].path))) != NULL) {
+      recs[i].ent.mime = strings;
+      put(fd, recs[i].mime, strlen(recs[i].mime) + 1, strings);
+      strings += strlen(recs[i].mime) + 1;
+    }
+  }
+  off = align(strings);
+  for(i = 0; i < nrecs; i++) {
+    bundle_ent_t *ent = &recs[i].ent;
+    if (!recs[i].path) continue;
+    if ((data = read_file(recs[i].path, recs[i].st.st_size)) == NULL) {
+      perror(recs[i].path);
+      return 1;
+    }
+    ent->off = off;
+    ent->size = recs[i].st.st_size;
+    ent->mtime = recs[i].st.st_mtime;
+    put(fd, data, ent->size, off);
+    off = align(off + ent->size);
+    hash = hash_content(data, ent->size);
+    snprintf(ent->etag, sizeof(ent->etag), "\"%llx-%016llx\"",
+             (unsigned long long)ent->size, (unsigned long long)hash);
+    httpdate_format(ent->mtime, ent->lastmod);
+    if (compress && gzip_compressible(recs[i].mime) && (gz = gzip_compress(data, ent->size, &gzlen)) != NULL) {
+      if (gzlen < ent->size) {
+        ent->gzoff = off;
+        ent->gzsize = gzlen;
+        put(fd, gz, gzlen, off);
+        off = align(off + gzlen);
+        // the file's tag with -gz, like cached variants
+        snprintf(ent->gzetag, sizeof(ent->gzetag), "%.*s-gz\"", (int)strlen(ent->etag) - 1, ent->etag);
+      }
+      free(gz);
+    }
+    free(data);
+  }
+  for(i = 0; i < nrecs; i++) {
+    if (recs[i].path || (idx = find_index(i)) < 0) continue;
+    alias = recs[idx].ent;
+    alias.url = recs[i].ent.url;
+    alias.urllen = recs[i].ent.urllen;
+    recs[i].ent = alias;
+  }
+  // the header last, a bundle cut short is never taken for a whole one
+  for(i = 0; i < nrecs; i++) put(fd, &recs[i].ent, sizeof(bundle_ent_t), hdr.entries + i * sizeof(bundle_ent_t));
+  for(i = 0; i < ph.nbuckets; i++) {
+    uint32_t seed = ph.disp[i];
+    put(fd, &seed, sizeof(seed), hdr.disp + i * sizeof(seed));
+  }
+  put(fd, slots, ph.nslots * sizeof(uint32_t), hdr.slots);
+  hdr.size = off;
+  if (ftruncate(fd, hdr.size) < 0 || (put(fd, &hdr, sizeof(hdr), 0), fsync(fd)) < 0 ||
+      close(fd) < 0 || rename(tmp, argv[optind + 1]) < 0) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  printf("Packed %zu entries, %llu bytes into %s\n", nrecs, (unsigned long long)hdr.size, argv[optind + 1]);
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "./inc/phash.h"
+
+// Build-time generator: compile a mime.types format file (or with -s a
+// plain list of keys) into a perfect hash table, written to stdout as C.
+// -i makes lookups case-insensitive.
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-i] [-s] name file\n", prog);
+  exit(1);
+}
+
+static void put_string(const char *s) {
+  putchar('"');
+  for(; *s; s++) {
+    if (*s == '"' || *s == '\\') putchar('\\');
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+int main(int argc, char **argv) {
+  phash_entry_t *entries = NULL;
+  phash_t ph;
+  size_t i, n = 0;
+  int nocase = 0, set = 0, opt;
+  while((opt = getopt(argc, argv, "is")) != -1) {
+    switch(opt) {
+      case 'i':
+        nocase = 1;
+        break;
+      case 's':
+        set = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) usage(argv[0]);
+  if (phash_load(argv[optind + 1], set, &entries, &n) < 0) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  if (phash_build(&ph, entries, n, nocase) < 0) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  printf("// Generated by mkphash from %s, do not edit\n", argv[optind + 1]);
+  printf("#include \"./inc/phash.h\"\n\n");
+  printf("static const unsigned %s_disp[] = {", argv[optind]);
+  for(i = 0; i < ph.nbuckets; i++) printf("%s%u", !i ? "\n    " : i % 16 ? ", " : ",\n    ", ph.disp[i]);
+  printf("\n};\n\nstatic const phash_entry_t %s_slots[] = {\n", argv[optind]);
+  for(i = 0; i < ph.nslots; i++) {
+    if (!ph.slots[i].key) {
+      printf("    { NULL, 0, NULL },\n");
+      continue;
+    }
+    printf("    { ");
+    put_string(ph.slots[i].key);
+    printf(", %zu, ", ph.slots[i].keylen);
+    put_string(ph.slots[i].value);
+    printf(" },\n");
+  }
+  printf("};\n\nconst phash_t %s = { %zu, %zu, %s_disp, %s_slots, %d };\n",
+         argv[optind], ph.nbuckets, ph.nslots, argv[optind], argv[optind], nocase);
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "./inc/parser.h"
+
+void parser_init(parser_t *pp) {
+    pp->state = PARSE_AGAIN;
+    pp->started = 0;
+    pp->pos = pp->line = 0;
+    pp->headlen = 0;
+    pp->nheaders = 0;
+}
+
+// first c in [p, end), byte by byte
+static const char *find_byte_scalar(const char *p, const char *end, char c) {
+    while(p < end) {
+        if (*p == c) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#if defined(__SSE2__)
+// 16 bytes per compare, SSE2 is part of every x86-64
+static const char *find_byte_sse2(const char *p, const char *end, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    int mask;
+    while(end - p >= 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+// 32 bytes per compare, built whatever -march says and only picked when
+// the cpu has AVX2
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *p, const char *end, char c) {
+    // one vpbroadcastb, where set1 spells out all 32 bytes unoptimized
+    __m256i needle = _mm256_broadcastb_epi8(_mm_cvtsi32_si128(c));
+    int mask = 0;
+    while(end - p >= 32) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle));
+        if (mask) break;
+        p += 32;
+    }
+    // the rest of the program is SSE code, mixing it with dirty upper
+    // halves stalls; the compiler only adds this itself when optimizing
+    _mm256_zeroupper();
+    return end - p >= 32 ? p + __builtin_ctz(mask) : find_byte_sse2(p, end, c);
+}
+
+const char *(*find_byte)(const char *, const char *, char) = find_byte_sse2;
+
+// once at startup, before any head is parsed
+__attribute__((constructor))
+static void find_byte_select(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) find_byte = find_byte_avx2;
+}
+#else
+const char *(*find_byte)(const char *, const char *, char) = find_byte_scalar;
+#endif
+
+static void set_span(span_t *sp, const char *base, const char *start, const char *end) {
+    sp->off = start - base;
+    sp->len = end - start;
+}
+
+// METHOD SP URI [SP VERSION]
+static int parse_startline(parser_t *pp, const char *base, const char *p, const char *end) {
+    const char *sp;
+    if ((sp = find_byte(p, end, ' ')) == NULL || sp == p || sp - p > 7) return PARSE_ERROR;
+    set_span(&pp->method, base, p, sp);
+    p = sp + 1;
+    while(p < end && *p == ' ') p++;
+    if ((sp = find_byte(p, end, ' ')) == NULL) sp = end;
+    if (sp == p) return PARSE_ERROR;
+    set_span(&pp->uri, base, p, sp);
+    p = sp;
+    while(p < end && *p == ' ') p++;
+    set_span(&pp->version, base, p, end);
+    return PARSE_AGAIN;
+}
+
+// NAME ":" OWS VALUE OWS, lines without a colon are ignored
+static int parse_header(parser_t *pp, const char *base, const char *p, const char *end) {
+    const char *colon;
+    if ((colon = find_byte(p, end, ':')) == NULL || colon == p) return PARSE_AGAIN;
+    if (pp->nheaders == MAX_HEADERS) return PARSE_ERROR;
+    set_span(&pp->names[pp->nheaders], base, p, colon);
+    p = colon + 1;
+    while(p < end && (*p == ' ' || *p == '\t')) p++;
+    while(end > p && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    set_span(&pp->values[pp->nheaders], base, p, end);
+    pp->nheaders++;
+    return PARSE_AGAIN;
+}
+
+// Feed the whole buffered head (buf, len) again after every read; only
+// bytes past the previous call are scanned.
+int parse_head(parser_t *pp, const char *buf, size_t len) {
+    const char *lf, *p, *end;
+    while(pp->state == PARSE_AGAIN) {
+        if ((lf = find_byte(buf + pp->pos, buf + len, '\n')) == NULL) {
+            pp->pos = len;
+            return PARSE_AGAIN;
+        }
+        p = buf + pp->line;
+        end = lf;
+        // both CRLF and LF are valid as line terminator
+        if (end > p && end[-1] == '\r') end--;
+        pp->line = pp->pos = lf - buf + 1;
+        if (end == p) {
+            // empty lines before the request line are tolerated, after it they end the head
+            if (!pp->started) continue;
+            pp->headlen = pp->pos;
+            pp->state = PARSE_DONE;
+        } else if (!pp->started) {
+            pp->started = 1;
+            pp->state = parse_startline(pp, buf, p, end);
+        } else {
+            pp->state = parse_header(pp, buf, p, end);
+        }
+    }
+    return pp->state;
+}
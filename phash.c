@@ -0,0 +1,165 @@
+#include "./inc/phash.h"
+
+// FNV-1a with a seed and a final mix, folding ASCII case when asked
+unsigned phash_hash(const char *key, size_t len, unsigned seed, int nocase) {
+    unsigned h = 2166136261u ^ (seed * 0x9e3779b9u), c;
+    while(len--) {
+        c = (unsigned char)*key++;
+        if (nocase && c - 'A' < 26) c |= 0x20;
+        h ^= c;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+const char *phash_find(const phash_t *ph, const char *key, size_t len) {
+    const phash_entry_t *e;
+    unsigned seed;
+    if (!ph->nslots) return NULL;
+    seed = ph->disp[phash_hash(key, len, 0, ph->nocase) % ph->nbuckets];
+    e = &ph->slots[phash_hash(key, len, seed, ph->nocase) & (ph->nslots - 1)];
+    if (!e->key || e->keylen != len) return NULL;
+    if (ph->nocase ? strncasecmp(e->key, key, len) : strncmp(e->key, key, len)) return NULL;
+    return e->value;
+}
+
+static size_t *bucket_of;
+static size_t *bucket_size;
+
+// biggest buckets first, they are the hardest to place
+static int by_size(const void *a, const void *b) {
+    size_t x = bucket_size[*(const size_t *)a], y = bucket_size[*(const size_t *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// try to place one bucket's keys (members) with seed, marking their slots
+static int place(phash_entry_t *entries, size_t *members, size_t n, unsigned seed,
+                 size_t mask, char *taken, size_t *slot, int nocase) {
+    size_t i, j;
+    for(i = 0; i < n; i++) {
+        slot[i] = phash_hash(entries[members[i]].key, entries[members[i]].keylen, seed, nocase) & mask;
+        if (taken[slot[i]]) return -1;
+        for(j = 0; j < i; j++) {
+            if (slot[j] == slot[i]) return -1;
+        }
+    }
+    for(i = 0; i < n; i++) taken[slot[i]] = 1;
+    return 0;
+}
+
+// Build ph over n entries. A key given twice keeps its last value, so
+// later definitions override earlier ones. Not thread-safe, meant for
+// build time and startup. Returns 0, or -1 when out of memory.
+int phash_build(phash_t *ph, phash_entry_t *entries, size_t n, int nocase) {
+    size_t i, j, b, m, nbuckets, nslots, *order, *members, *slot;
+    unsigned *disp, seed;
+    phash_entry_t *slots;
+    char *taken;
+    // drop overridden duplicates
+    for(i = m = 0; i < n; i++) {
+        for(j = i + 1; j < n; j++) {
+            if (entries[i].keylen == entries[j].keylen &&
+                (nocase ? strncasecmp : strncmp)(entries[i].key, entries[j].key, entries[i].keylen) == 0) break;
+        }
+        if (j == n) entries[m++] = entries[i];
+    }
+    n = m;
+    nbuckets = n / 4 + 1;
+    for(nslots = 4; nslots < n + n / 4; nslots <<= 1);
+    bucket_of = (size_t *)calloc(n + 1, sizeof(size_t));
+    bucket_size = (size_t *)calloc(nbuckets, sizeof(size_t));
+    order = (size_t *)calloc(nbuckets, sizeof(size_t));
+    members = (size_t *)calloc(n + 1, sizeof(size_t));
+    slot = (size_t *)calloc(n + 1, sizeof(size_t));
+    if (!bucket_of || !bucket_size || !order || !members || !slot) return -1;
+    for(i = 0; i < n; i++) {
+        bucket_of[i] = phash_hash(entries[i].key, entries[i].keylen, 0, nocase) % nbuckets;
+        bucket_size[bucket_of[i]]++;
+    }
+    for(b = 0; b < nbuckets; b++) order[b] = b;
+    qsort(order, nbuckets, sizeof(size_t), by_size);
+    while(1) {
+        disp = (unsigned *)calloc(nbuckets, sizeof(unsigned));
+        taken = (char *)calloc(nslots, 1);
+        if (!disp || !taken) return -1;
+        for(b = 0; b < nbuckets && bucket_size[order[b]]; b++) {
+            for(i = m = 0; i < n; i++) {
+                if (bucket_of[i] == order[b]) members[m++] = i;
+            }
+            for(seed = 1; seed < PHASH_TRIES; seed++) {
+                if (place(entries, members, m, seed, nslots - 1, taken, slot, nocase) == 0) break;
+            }
+            if (seed == PHASH_TRIES) break;
+            disp[order[b]] = seed;
+        }
+        if (b == nbuckets || !bucket_size[order[b]]) break;
+        // unlucky, retry with more room
+        free(disp);
+        free(taken);
+        nslots <<= 1;
+    }
+    if ((slots = (phash_entry_t *)calloc(nslots, sizeof(phash_entry_t))) == NULL) return -1;
+    for(i = 0; i < n; i++) {
+        slots[phash_hash(entries[i].key, entries[i].keylen, disp[bucket_of[i]], nocase) & (nslots - 1)] = entries[i];
+    }
+    ph->nbuckets = nbuckets;
+    ph->nslots = nslots;
+    ph->disp = disp;
+    ph->slots = slots;
+    ph->nocase = nocase;
+    free(taken);
+    free(bucket_of);
+    free(bucket_size);
+    free(order);
+    free(members);
+    free(slot);
+    return 0;
+}
+
+// Append the entries of a mime.types format file (a value, then its keys)
+// to *entries, or with set just keys that map to themselves. '#' starts a
+// comment. Returns 0, or -1 if the file can't be read.
+int phash_load(const char *path, int set, phash_entry_t **entries, size_t *n) {
+    char line[1024], *tok, *value, *save;
+    size_t cap = *n;
+    FILE *fp;
+    if ((fp = fopen(path, "r")) == NULL) return -1;
+    while(fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "#\r\n")] = 0;
+        if ((tok = strtok_r(line, " \t", &save)) == NULL) continue;
+        value = set ? NULL : strdup(tok);
+        if (!set) tok = strtok_r(NULL, " \t", &save);
+        for(; tok; tok = strtok_r(NULL, " \t", &save)) {
+            if (*n == cap) {
+                cap = cap ? cap * 2 : 256;
+                if ((*entries = (phash_entry_t *)realloc(*entries, cap * sizeof(phash_entry_t))) == NULL) return -1;
+            }
+            (*entries)[*n].key = strdup(tok);
+            (*entries)[*n].keylen = strlen(tok);
+            (*entries)[*n].value = set ? (*entries)[*n].key : value;
+            (*n)++;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Rebuild base plus the entries of a mime.types format file into out,
+// the file winning over base. Lookups stay a single probe.
+int phash_extend(const phash_t *base, const char *path, phash_t *out) {
+    phash_entry_t *entries;
+    size_t i, n = 0;
+    if ((entries = (phash_entry_t *)malloc(base->nslots * sizeof(phash_entry_t))) == NULL) return -1;
+    for(i = 0; i < base->nslots; i++) {
+        if (base->slots[i].key) entries[n++] = base->slots[i];
+    }
+    if (phash_load(path, 0, &entries, &n) < 0 || phash_build(out, entries, n, base->nocase) < 0) {
+        free(entries);
+        return -1;
+    }
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,680 @@
+#include "./inc/proxy.h"
+
+// Idle upstream connections of this worker for one route, newest last
+typedef struct {
+    int n;
+    int fds[PROXY_POOL_MAX];
+} pool_t;
+
+// Workers never share an upstream connection, so pools need no lock
+static __thread pool_t *pools;
+
+static const char continue_line[] = "HTTP/1.1 100 Continue" CRLF CRLF;
+static const char close_line[] = "Connection: close" CRLF;
+static const char keepalive_line[] = "Connection: keep-alive" CRLF;
+
+// Parse "prefix=host:port" or "prefix=unix:/path" into one more route
+int proxy_add_route(server_t *app, char *spec) {
+    struct addrinfo hints = { 0 }, *ai;
+    struct sockaddr_un *un;
+    char *eq = strchr(spec, '='), *colon;
+    route_t *route;
+    if (!eq || spec[0] != '/' || app->nroutes == PROXY_ROUTES_MAX) return FAILED;
+    if (!app->routes && (app->routes = (route_t *)calloc(PROXY_ROUTES_MAX, sizeof(route_t))) == NULL) return FAILED;
+    route = &app->routes[app->nroutes];
+    *eq = 0;
+    route->prefix = spec;
+    route->prefixlen = eq - spec;
+    // "/api/" and "/api" both mean the /api subtree
+    while(route->prefixlen > 1 && spec[route->prefixlen - 1] == '/') spec[--route->prefixlen] = 0;
+    route->upstream = eq + 1;
+    if (strncmp(route->upstream, "unix:", 5) == 0) {
+        un = (struct sockaddr_un *)&route->addr;
+        if (strlen(route->upstream + 5) >= sizeof(un->sun_path)) return FAILED;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, route->upstream + 5);
+        route->addrlen = sizeof(struct sockaddr_un);
+    } else {
+        if ((colon = strrchr(route->upstream, ':')) == NULL) return FAILED;
+        *colon = 0;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        // resolved once, at startup
+        if (getaddrinfo(route->upstream, colon + 1, &hints, &ai) != 0) return FAILED;
+        *colon = ':';
+        memcpy(&route->addr, ai->ai_addr, ai->ai_addrlen);
+        route->addrlen = ai->ai_addrlen;
+        freeaddrinfo(ai);
+    }
+    route->id = app->nroutes++;
+    return OK;
+}
+
+// Bytes of p spelling one '.', literally or as %2e, 0 for none
+static int dot_at(const char *p) {
+    if (p[0] == '.') return 1;
+    return p[0] == '%' && p[1] == '2' && (p[2] == 'e' || p[2] == 'E') ? 3 : 0;
+}
+
+// Dots in the segment starting at p: 1 for ".", 2 for "..", 0 for a name
+static int dot_segment(const char *p, const char **next) {
+    int dots = 0, n;
+    while(dots < 3 && (n = dot_at(p)) > 0) {
+        p += n;
+        dots++;
+    }
+    *next = p;
+    return (*p == '/' || *p == 0) && dots <= 2 ? dots : 0;
+}
+
+// Resolve "." and ".." segments of an absolute path in place, like
+// RFC 3986 remove_dot_segments, so no path climbs out of a prefix
+static void remove_dots(char *path) {
+    const char *in = path, *next;
+    char *out = path;
+    int dots;
+    while(*in) {
+        // in is at a '/'
+        if ((dots = dot_segment(in + 1, &next)) > 0) {
+            if (dots == 2) {
+                while(out > path && *--out != '/');
+            }
+            in = next;
+            // "/a/." and "/a/.." still name a directory
+            if (!*in) *out++ = '/';
+            continue;
+        }
+        do *out++ = *in++; while(*in && *in != '/');
+    }
+    if (out == path) *out++ = '/';
+    *out = 0;
+}
+
+// The first route whose prefix is path or one of its parent directories.
+// Dot segments are resolved in path first, so matching and forwarding
+// both see the path an upstream would.
+route_t *proxy_route(server_t *app, char *path) {
+    route_t *route;
+    int i;
+    if (strstr(path, "/.") || strcasestr(path, "/%2e")) remove_dots(path);
+    for(i = 0; i < app->nroutes; i++) {
+        route = &app->routes[i];
+        if (strncmp(path, route->prefix, route->prefixlen) == 0 &&
+            (route->prefixlen == 1 || path[route->prefixlen] == 0 || path[route->prefixlen] == '/')) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+static pool_t *pool_of(server_t *app, route_t *route) {
+    if (!pools) pools = (pool_t *)calloc(app->nroutes, sizeof(pool_t));
+    return pools ? &pools[route->id] : NULL;
+}
+
+// A pooled connection the upstream hasn't closed meanwhile, or -1
+static int pool_take(server_t *app, route_t *route) {
+    pool_t *pool = pool_of(app, route);
+    char c;
+    int fd;
+    while(pool && pool->n > 0) {
+        fd = pool->fds[--pool->n];
+        // idle means nothing to read and no EOF
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+static void pool_put(server_t *app, route_t *route, int fd) {
+    pool_t *pool = pool_of(app, route);
+    if (pool && pool->n < PROXY_POOL_MAX) pool->fds[pool->n++] = fd;
+    else close(fd);
+}
+
+// Event loop connections wake up for their upstream too
+static void watch(conn_t *conn, int fd) {
+    struct epoll_event ev;
+    if (conn->epfd < 0) return;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    epoll_ctl(conn->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Done with the upstream: back to the pool if it can serve another request
+static void release(server_t *app, conn_t *conn, proxy_t *px) {
+    if (px->fd < 0) return;
+    if (px->keep) {
+        if (conn->epfd >= 0) epoll_ctl(conn->epfd, EPOLL_CTL_DEL, px->fd, NULL);
+        pool_put(app, px->route, px->fd);
+    } else {
+        close(px->fd);
+    }
+    px->fd = -1;
+}
+
+static size_t put(char *buf, size_t len, size_t cap, const char *s, size_t n) {
+    // past cap once anything didn't fit
+    if (len > cap || n > cap - len) return cap + 1;
+    memcpy(buf + len, s, n);
+    return len + n;
+}
+
+static size_t put_str(char *buf, size_t len, size_t cap, const char *s) {
+    return put(buf, len, cap, s, strlen(s));
+}
+
+// Headers that only concern one hop, or that we deal with ourselves
+static int hop_header(const char *name, const char *connection) {
+    return strcasecmp(name, "Connection") == 0 || strcasecmp(name, "Keep-Alive") == 0 ||
+           strcasecmp(name, "Proxy-Connection") == 0 || strcasecmp(name, "TE") == 0 ||
+           strcasecmp(name, "Trailer") == 0 || strcasecmp(name, "Upgrade") == 0 ||
+           strcasecmp(name, "Expect") == 0 || (connection && has_token(connection, name));
+}
+
+// The request head as the upstream gets it: same target, hop-by-hop
+// headers dropped, the client added to X-Forwarded-For
+static size_t build_request(conn_t *conn, proxy_t *px, req_t *req) {
+    char *connection = find_header(req->header, "Connection"), *forwarded = NULL, addr[INET_ADDRSTRLEN];
+    size_t len = 0, cap = PROXY_HEAD_MAX;
+    header_t *h;
+    len = put_str(px->head, len, cap, req->method);
+    len = put(px->head, len, cap, " ", 1);
+    // the target as parsed, its query split off in place
+    len = put_str(px->head, len, cap, req->location->path);
+    if (req->location->query) {
+        len = put(px->head, len, cap, "?", 1);
+        len = put_str(px->head, len, cap, req->location->query);
+    }
+    // a 1.0 client can't take a chunked response, so ask as 1.0 too
+    len = put_str(px->head, len, cap, strcmp(px->version, "HTTP/1.0") == 0 ? " HTTP/1.0" CRLF : " HTTP/1.1" CRLF);
+    for(h = req->header; h; h = h->next) {
+        if (hop_header(h->name, connection)) continue;
+        if (strcasecmp(h->name, "X-Forwarded-For") == 0) {
+            forwarded = h->value;
+            continue;
+        }
+        len = put(px->head, len, cap, h->name, h->namelen);
+        len = put(px->head, len, cap, ": ", 2);
+        len = put(px->head, len, cap, h->value, h->valuelen);
+        len = put(px->head, len, cap, CRLF, 2);
+    }
+    if (!find_header(req->header, "Host")) {
+        len = put_str(px->head, len, cap, "Host: ");
+        len = put_str(px->head, len, cap, px->route->addr.ss_family == AF_UNIX ? "localhost" : px->route->upstream);
+        len = put(px->head, len, cap, CRLF, 2);
+    }
+    inet_ntop(AF_INET, &conn->peer, addr, sizeof(addr));
+    len = put_str(px->head, len, cap, "X-Forwarded-For: ");
+    if (forwarded) {
+        len = put_str(px->head, len, cap, forwarded);
+        len = put(px->head, len, cap, ", ", 2);
+    }
+    len = put_str(px->head, len, cap, addr);
+    len = put(px->head, len, cap, CRLF CRLF, 4);
+    return len;
+}
+
+// Take over req for route. The head is rewritten right away, while it is
+// still in rio; the body is left there and on the socket to be relayed.
+// Fails with res->status set when the request can't be forwarded.
+int proxy_start(server_t *app, conn_t *conn, req_t *req, route_t *route) {
+    parser_t *pp = &conn->parser;
+    char *head = conn->rio.cursor, *value, *end;
+    proxy_t *px = conn->px;
+    (void)app;
+    // the end of a chunked request body could only be found by decoding it
+    if (find_header(req->header, "Transfer-Encoding")) {
+        conn->res.status = 411;
+        return FAILED;
+    }
+    if (!px) {
+        if ((px = (proxy_t *)malloc(sizeof(proxy_t))) == NULL) {
+            conn->res.status = 500;
+            return FAILED;
+        }
+        px->fd = -1;
+        px->pipe[0] = px->pipe[1] = -1;
+        px->state = PX_IDLE;
+        conn->px = px;
+    }
+    // a non-blocking pipe would make splice skip the socket timeouts of blocking workers
+    if (px->pipe[0] < 0 && pipe2(px->pipe, O_CLOEXEC | (conn->blocking ? 0 : O_NONBLOCK)) < 0) {
+        conn->res.status = 500;
+        return FAILED;
+    }
+    px->bodylen = 0;
+    if ((value = find_header(req->header, "Content-Length")) != NULL) {
+        errno = 0;
+        px->bodylen = strtoull(value, &end, 10);
+        if (errno || end == value || *end || *value == '-') {
+            conn->res.status = 400;
+            return FAILED;
+        }
+    }
+    px->route = route;
+    px->left = px->bodylen;
+    px->piped = 0;
+    px->reused = px->keep = px->eof = 0;
+    px->len = px->pos = px->fwd = 0;
+    px->body = 0;
+    px->status = 0;
+    px->headonly = strcmp(req->method, "HEAD") == 0;
+    px->req = *req;
+    memcpy(px->version, head + pp->version.off, pp->version.len < 8 ? pp->version.len : 8);
+    px->version[pp->version.len < 8 ? pp->version.len : 8] = 0;
+    px->headlen = build_request(conn, px, req);
+    px->headsent = 0;
+    if (px->headlen > PROXY_HEAD_MAX) {
+        conn->res.status = 500;
+        return FAILED;
+    }
+    // we read the body regardless, so tell a client waiting for a go ahead
+    if (px->bodylen && (value = find_header(req->header, "Expect")) != NULL && strcasecmp(value, "100-continue") == 0 &&
+        strcmp(px->version, "HTTP/1.1") == 0) {
+        conn_queue(conn, (char *)continue_line, sizeof(continue_line) - 1);
+    }
+    px->state = PX_CONNECT;
+    return OK;
+}
+
+// The upstream failed before the response began: answer the client
+// instead. An unread request body leaves the client stream unusable.
+static int fail(server_t *app, conn_t *conn, proxy_t *px, int status) {
+    res_t *res = &conn->res;
+    px->keep = 0;
+    release(app, conn, px);
+    if (px->state <= PX_BODY && px->left) conn->keep_alive = 0;
+    px->state = PX_IDLE;
+    METRIC_ADD(errors, 1);
+    free_response(res);
+    res_init(res, &conn->arena);
+    res->status = status;
+    error_response(res);
+    // logged below like every proxied exchange, not by httpsend
+    res->route = px->route;
+    conn->req = px->req;
+    if (accesslog_enabled()) log_request(conn->peer, &px->req, res, px->version);
+    httpsend(conn, res);
+    conn->state = CONN_WRITE;
+    conn->batch = conn->sent;
+    return OK;
+}
+
+// RFC 9110 9.2.2: sending these twice does no more than sending them once
+static int idempotent(const char *method) {
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 || strcmp(method, "OPTIONS") == 0 ||
+           strcmp(method, "TRACE") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0;
+}
+
+// Whether a broken pooled connection can be swapped for a fresh one: the
+// upstream closed it before answering anything, and the request is safe
+// to send again should it have acted on it all the same
+static int retry(proxy_t *px) {
+    if (!px->reused || px->bodylen || px->len || !idempotent(px->req.method)) return 0;
+    close(px->fd);
+    px->fd = -1;
+    px->reused = 0;
+    px->headsent = 0;
+    px->state = PX_CONNECT;
+    return 1;
+}
+
+static int would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static int upstream_connect(server_t *app, conn_t *conn, proxy_t *px) {
+    route_t *route = px->route;
+    struct timeval tv = { app->write_timeout, 0 };
+    int one = 1, ret;
+    if (px->fd < 0 && (px->fd = pool_take(app, route)) >= 0) {
+        px->reused = 1;
+        METRIC_ADD(upstream_reused, 1);
+        watch(conn, px->fd);
+        px->state = PX_REQUEST;
+        return OK;
+    }
+    if (px->fd < 0) {
+        px->fd = socket(route->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | (conn->blocking ? 0 : SOCK_NONBLOCK), 0);
+        if (px->fd < 0) return fail(app, conn, px, 502);
+        METRIC_ADD(upstream_connects, 1);
+        if (route->addr.ss_family != AF_UNIX) setsockopt(px->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (conn->blocking && app->write_timeout > 0) {
+            setsockopt(px->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(px->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+        watch(conn, px->fd);
+    }
+    // connecting again tells whether a connect under way has finished
+    while((ret = connect(px->fd, (struct sockaddr *)&route->addr, route->addrlen)) < 0 && errno == EINTR);
+    if (ret < 0 && (errno == EINPROGRESS || errno == EALREADY)) return CONN_PROXY;
+    if (ret < 0 && errno != EISCONN) return fail(app, conn, px, 502);
+    px->state = PX_REQUEST;
+    return OK;
+}
+
+static int send_request(server_t *app, conn_t *conn, proxy_t *px) {
+    ssize_t n;
+    while(px->headsent < px->headlen) {
+        while((n = send(px->fd, px->head + px->headsent, px->headlen - px->headsent,
+                        MSG_NOSIGNAL | (px->bodylen ? MSG_MORE : 0))) < 0 && errno == EINTR);
+        if (n < 0 && would_block()) return CONN_PROXY;
+        if (n < 0) return retry(px) ? OK : fail(app, conn, px, 502);
+        px->headsent += n;
+    }
+    px->state = px->bodylen ? PX_BODY : PX_HEAD;
+    return OK;
+}
+
+// Move up to left bytes from one socket to another through the pipe.
+// Returns OK with nothing in flight, CONN_PROXY when a socket would
+// block, FAILED on an error or, unless eof is wanted, on an early EOF.
+static int relay(conn_t *conn, proxy_t *px, int from, int to, int toclient, int *eof) {
+    int flags = SPLICE_F_MOVE | (conn->blocking ? 0 : SPLICE_F_NONBLOCK);
+    ssize_t n;
+    while(1) {
+        // drain before refilling, so nothing waits in the pipe for more input
+        if (px->piped) {
+            while((n = splice(px->pipe[0], NULL, to, NULL, px->piped, flags)) < 0 && errno == EINTR);
+            if (n < 0) return would_block() ? CONN_PROXY : FAILED;
+            px->piped -= n;
+            if (toclient) {
+                conn_wrote(conn, n);
+                px->body += n;
+            }
+            continue;
+        }
+        if (px->left == 0) return OK;
+        while((n = splice(from, NULL, px->pipe[1], NULL, px->left < PROXY_PIPE ? px->left : PROXY_PIPE, flags)) < 0 &&
+              errno == EINTR);
+        if (n < 0) return would_block() ? CONN_PROXY : FAILED;
+        if (n == 0) {
+            if (!eof) return FAILED;
+            *eof = 1;
+            return OK;
+        }
+        px->piped += n;
+        px->left -= n;
+    }
+}
+
+// Request body: what came along with the head is in rio, the rest is spliced
+static int send_body(server_t *app, conn_t *conn, proxy_t *px) {
+    rio_t *rp = &conn->rio;
+    size_t n;
+    ssize_t w;
+    int ret;
+    while(px->left && rp->unread > 0) {
+        n = (size_t)rp->unread < px->left ? (size_t)rp->unread : px->left;
+        while((w = send(px->fd, rp->cursor, n, MSG_NOSIGNAL | (n < px->left ? MSG_MORE : 0))) < 0 && errno == EINTR);
+        if (w < 0 && would_block()) return CONN_PROXY;
+        if (w < 0) return fail(app, conn, px, 502);
+        rio_consume(rp, w);
+        px->left -= w;
+    }
+    if ((ret = relay(conn, px, conn->fd, px->fd, 0, NULL)) == CONN_PROXY) return ret;
+    if (ret != OK) {
+        // the client hung up, or the upstream wouldn't take it all
+        METRIC_ADD(errors, 1);
+        return CONN_CLOSE;
+    }
+    px->state = PX_HEAD;
+    return OK;
+}
+
+// Ends of the lines of buf from p, NUL terminated in place; NULL at the blank one
+static char *next_line(char *p, char **eol) {
+    char *nl;
+    if (*p == 0 || (nl = strchr(p, '\n')) == NULL) return NULL;
+    if (nl > p && nl[-1] == '\r') nl[-1] = 0;
+    *nl = 0;
+    *eol = nl;
+    return p;
+}
+
+// Rewrite the upstream's response head for the client, and find out how
+// its body ends and whether the upstream connection can be reused
+static int parse_response(conn_t *conn, proxy_t *px, size_t end) {
+    char *p = px->buf, *eol = NULL, *colon, *value, *line;
+    size_t len = 0, cap = sizeof(px->head), clen = 0;
+    int has_len = 0, chunked = 0, close = 0, keepalive = 0, http11;
+    char saved = px->buf[end];
+    px->buf[end] = 0;
+    if (memcmp(p, "HTTP/1.", 7) != 0 || p[8] != ' ' || !isdigit((unsigned char)p[9]) || !isdigit((unsigned char)p[10]) ||
+        !isdigit((unsigned char)p[11]) || (p[12] != ' ' && p[12] != '\r')) return FAILED;
+    http11 = p[7] == '1';
+    px->status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    next_line(p, &eol);
+    len = put(px->head, len, cap, "HTTP/1.1", 8);
+    len = put_str(px->head, len, cap, p + 8);
+    len = put(px->head, len, cap, CRLF, 2);
+    for(p = eol + 1; (line = next_line(p, &eol)) != NULL; p = eol + 1) {
+        if ((colon = strchr(line, ':')) == NULL) return FAILED;
+        for(value = colon + 1; *value == ' ' || *value == '\t'; value++);
+        *colon = 0;
+        if (strcasecmp(line, "Connection") == 0) {
+            close = has_token(value, "close");
+            keepalive = has_token(value, "keep-alive");
+            continue;
+        }
+        if (strcasecmp(line, "Keep-Alive") == 0 || strcasecmp(line, "Proxy-Connection") == 0) continue;
+        if (strcasecmp(line, "Content-Length") == 0) {
+            clen = strtoull(value, NULL, 10);
+            has_len = 1;
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            chunked = has_token(value, "chunked");
+        }
+        *colon = ':';
+        len = put_str(px->head, len, cap, line);
+        len = put(px->head, len, cap, CRLF, 2);
+    }
+    px->buf[end] = saved;
+    px->chunk = CHUNK_SIZE;
+    if (px->headonly || px->status == 204 || px->status == 304) {
+        px->framing = BODY_NONE;
+    } else if (chunked) {
+        px->framing = BODY_CHUNKED;
+    } else if (has_len) {
+        px->framing = BODY_LENGTH;
+        px->left = clen;
+    } else {
+        px->framing = BODY_EOF;
+        conn->keep_alive = 0;
+    }
+    px->keep = px->framing != BODY_EOF && !close && (http11 || keepalive);
+    if (!conn->keep_alive) {
+        len = put(px->head, len, cap, close_line, sizeof(close_line) - 1);
+    } else if (find_header(px->req.header, "Connection")) {
+        len = put(px->head, len, cap, keepalive_line, sizeof(keepalive_line) - 1);
+    }
+    len = put(px->head, len, cap, CRLF, 2);
+    if (len > cap) return FAILED;
+    px->headlen = len;
+    px->headsent = 0;
+    return OK;
+}
+
+static int read_head(server_t *app, conn_t *conn, proxy_t *px) {
+    char *end;
+    size_t headend;
+    ssize_t n;
+    while(1) {
+        if ((end = (char *)memmem(px->buf, px->len, CRLF CRLF, 4)) != NULL) {
+            headend = end + 4 - px->buf;
+            // interim responses: we sent our own 100 Continue, the rest isn't passed on
+            if (px->len > 9 && px->buf[9] == '1' && memcmp(px->buf + 9, "101", 3) != 0) {
+                memmove(px->buf, px->buf + headend, px->len - headend);
+                px->len -= headend;
+                continue;
+            }
+            break;
+        }
+        if (px->len == sizeof(px->buf)) return fail(app, conn, px, 502);
+        while((n = recv(px->fd, px->buf + px->len, sizeof(px->buf) - px->len, 0)) < 0 && errno == EINTR);
+        if (n < 0 && would_block()) return CONN_PROXY;
+        if (n <= 0) return retry(px) ? OK : fail(app, conn, px, 502);
+        px->len += n;
+    }
+    if (parse_response(conn, px, headend - 2) != OK) return fail(app, conn, px, 502);
+    px->pos = headend;
+    METRIC_STATUS(px->status);
+    PROBE3(response, conn->fd, px->status, px->framing == BODY_LENGTH ? px->left : 0);
+    px->state = PX_REPLY;
+    return OK;
+}
+
+static int send_reply(conn_t *conn, proxy_t *px) {
+    ssize_t n;
+    while(px->headsent < px->headlen) {
+        while((n = send(conn->fd, px->head + px->headsent, px->headlen - px->headsent,
+                        MSG_NOSIGNAL | (px->framing != BODY_NONE ? MSG_MORE : 0))) < 0 && errno == EINTR);
+        if (n < 0) return would_block() ? CONN_PROXY : CONN_CLOSE;
+        conn_wrote(conn, n);
+        px->headsent += n;
+    }
+    // a body the head says isn't there can't be told from the next response
+    if (px->framing == BODY_NONE && px->len > px->pos) px->keep = 0;
+    px->state = PX_DATA;
+    return OK;
+}
+
+// Read more of the response into buf after what is left of it
+static int fill(proxy_t *px) {
+    ssize_t n;
+    if (px->pos) {
+        memmove(px->buf, px->buf + px->pos, px->len - px->pos);
+        px->len -= px->pos;
+        px->pos = 0;
+    }
+    while((n = recv(px->fd, px->buf + px->len, sizeof(px->buf) - px->len, 0)) < 0 && errno == EINTR);
+    if (n < 0) return would_block() ? CONN_PROXY : CONN_CLOSE;
+    // chunked bodies only end with their last chunk
+    if (n == 0) return CONN_CLOSE;
+    px->len += n;
+    return OK;
+}
+
+// Follow the chunked framing at pos over one line, approving it for the
+// client. Returns CONN_PROXY, or CONN_CLOSE, while no whole line is buffered.
+static int chunk_line(proxy_t *px) {
+    char *nl, *line = px->buf + px->pos, *end;
+    size_t size;
+    int ret;
+    while((nl = (char *)memchr(px->buf + px->pos, '\n', px->len - px->pos)) == NULL) {
+        if (px->len - px->pos >= PROXY_LINE_MAX) return CONN_CLOSE;
+        if ((ret = fill(px)) != OK) return ret;
+        line = px->buf + px->pos;
+    }
+    px->fwd = nl + 1 - line;
+    if (px->chunk == CHUNK_TRAILER) {
+        // trailers pass through, the empty line ends the body
+        if (nl == line || (nl == line + 1 && *line == '\r')) px->chunk = CHUNK_DONE;
+        return OK;
+    }
+    if (!isxdigit((unsigned char)*line)) return CONN_CLOSE;
+    size = strtoull(line, &end, 16);
+    if (size == 0) {
+        px->chunk = CHUNK_TRAILER;
+    } else {
+        // the data, then its CRLF
+        px->chunk = CHUNK_DATA;
+        px->left = size + 2;
+    }
+    return OK;
+}
+
+// Response body to the client: bytes that came with the head or a chunk
+// line go from buf, everything else is spliced straight through
+static int send_data(server_t *app, conn_t *conn, proxy_t *px) {
+    size_t n;
+    ssize_t w;
+    int ret;
+    while(1) {
+        while(px->fwd) {
+            while((w = send(conn->fd, px->buf + px->pos, px->fwd, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+            if (w < 0) return would_block() ? CONN_PROXY : CONN_CLOSE;
+            conn_wrote(conn, w);
+            px->body += w;
+            px->pos += w;
+            px->fwd -= w;
+        }
+        if (px->framing == BODY_NONE || px->chunk == CHUNK_DONE || px->eof) break;
+        if (px->framing == BODY_LENGTH && px->left == 0 && !px->piped) break;
+        if (px->framing == BODY_CHUNKED && px->chunk != CHUNK_DATA) {
+            if ((ret = chunk_line(px)) != OK) return ret;
+            continue;
+        }
+        if (px->framing == BODY_CHUNKED && px->left == 0 && !px->piped) {
+            px->chunk = CHUNK_SIZE;
+            continue;
+        }
+        if (px->len > px->pos && !px->piped) {
+            n = px->len - px->pos;
+            if (px->framing != BODY_EOF && n > px->left) n = px->left;
+            if (px->framing != BODY_EOF) px->left -= n;
+            px->fwd = n;
+            continue;
+        }
+        // until the upstream closes, for bodies without framing
+        if (px->framing == BODY_EOF) px->left = PROXY_PIPE;
+        if ((ret = relay(conn, px, px->fd, conn->fd, 1, px->framing == BODY_EOF ? &px->eof : NULL)) != OK) {
+            return ret == CONN_PROXY ? ret : CONN_CLOSE;
+        }
+    }
+    // leftovers past the body mean we misread the framing
+    if (px->len > px->pos) px->keep = 0;
+    release(app, conn, px);
+    px->state = PX_IDLE;
+    conn->res.status = px->status;
+    conn->res.length = px->body;
+    if (accesslog_enabled()) log_request(conn->peer, &px->req, &conn->res, px->version);
+    free_response(&conn->res);
+    res_init(&conn->res, &conn->arena);
+    conn_sent(conn);
+    return OK;
+}
+
+// Make as much progress on the exchange as both sockets allow. Returns OK
+// once it is over and conn moved on, CONN_PROXY while a socket would block,
+// CONN_CLOSE when the client connection is beyond saving.
+int proxy_drive(server_t *app, conn_t *conn) {
+    proxy_t *px = conn->px;
+    int ret = OK;
+    while(ret == OK && px->state != PX_IDLE) {
+        switch(px->state) {
+            case PX_CONNECT:
+                ret = upstream_connect(app, conn, px);
+                break;
+            case PX_REQUEST:
+                ret = send_request(app, conn, px);
+                break;
+            case PX_BODY:
+                ret = send_body(app, conn, px);
+                break;
+            case PX_HEAD:
+                ret = read_head(app, conn, px);
+                break;
+            case PX_REPLY:
+                ret = send_reply(conn, px);
+                break;
+            case PX_DATA:
+                ret = send_data(app, conn, px);
+                break;
+        }
+    }
+    if (ret == CONN_CLOSE) METRIC_ADD(errors, 1);
+    return ret;
+}
+
+void proxy_free(conn_t *conn) {
+    proxy_t *px = conn->px;
+    if (!px) return;
+    if (px->fd >= 0) close(px->fd);
+    if (px->pipe[0] >= 0) {
+        close(px->pipe[0]);
+        close(px->pipe[1]);
+    }
+    free(px);
+    conn->px = NULL;
+}
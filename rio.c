@@ -12,6 +12,32 @@ void rio_init(rio_t *rp, int fd) {
     rp->unread = 0;
 }
 
+// read once from fd, appending after the unread data, for non-blocking callers
+// returns bytes read, 0 on EOF, -1 on error (EAGAIN if nothing available yet)
+ssize_t rio_fill(rio_t *rp) {
+    ssize_t n;
+    if (rp->cursor != rp->buf) {
+        // compact, so free space is always at the tail
+        if (rp->unread > 0) memmove(rp->buf, rp->cursor, rp->unread);
+        rp->cursor = rp->buf;
+    }
+    if (rp->unread >= (int)sizeof(rp->buf)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    while((n = read(rp->fd, rp->buf + rp->unread, sizeof(rp->buf) - rp->unread)) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    rp->unread += n;
+    return n;
+}
+
+// drop n buffered bytes a parser already dealt with in place
+void rio_consume(rio_t *rp, size_t n) {
+    rp->cursor += n;
+    rp->unread -= n;
+}
+
 ssize_t rio_read(rio_t *rp, char *buf, size_t n) {
     int cnt;
     while(rp->unread <= 0) {
@@ -33,7 +59,7 @@ ssize_t rio_read(rio_t *rp, char *buf, size_t n) {
             rp->cursor = rp->buf;
         }
     }
-    cnt = (int)n > rp->unread ? rp->unread : n;
+    cnt = (int)n > rp->unread ? rp->unread : (int)n;
     memcpy(buf, rp->cursor, cnt);
     rp->cursor += cnt;
     rp->unread -= cnt;
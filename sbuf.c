@@ -1,34 +1,184 @@
 #include "./inc/sbuf.h"
 
 void sbuf_init(sbuf_t *sp, int n) {
-  sp->capacity = n;
-  sp->buf = (int *)calloc(n, sizeof(int));
-  if (!sp->buf) fatal_exit(1, "Failed calloc buf");
+  size_t i, capacity = 2;
+  // power of 2, so positions map to cells with a mask
+  while((int)capacity < n) capacity <<= 1;
+  sp->capacity = capacity;
+  sp->mask = capacity - 1;
+  sp->buf = (cell_t *)aligned_alloc(CACHE_LINE, ((capacity * sizeof(cell_t) + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE);
+  if (!sp->buf) fatal_exit(1, "Failed aligned_alloc buf");
+  for(i = 0; i < capacity; i++) {
+    sp->buf[i].seq = i;
+    sp->buf[i].fd = -1;
+  }
   sp->head = sp->tail = 0;
-  sp->items = sem_open("s_conn_lock", O_CREAT, 0644, 0);
-  sp->mutex = sem_open("s_buf_lock", O_CREAT, 0644, 1);
-  sp->slots = sem_open("s_slots_lock", O_CREAT, 0644, n);
+  sp->items = sp->slots = 0;
+  sp->consumers_waiting = sp->producers_waiting = 0;
+}
+
+static void futex_wait(unsigned *addr, unsigned val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned *addr, int n) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// claim up to n free cells at the tail and fill them, never blocks
+static int try_insert(sbuf_t *sp, int *fds, int n) {
+  size_t pos = __atomic_load_n(&sp->tail, __ATOMIC_RELAXED), seq;
+  uint64_t stamp = mono_ns();
+  int i, got;
+  while(1) {
+    // count free cells from pos on; they only ever get freer, so a won CAS keeps them ours
+    for(got = 0; got < n; got++) {
+      seq = __atomic_load_n(&sp->buf[(pos + got) & sp->mask].seq, __ATOMIC_ACQUIRE);
+      if (seq != pos + got) break;
+    }
+    if (got == 0) {
+      seq = __atomic_load_n(&sp->buf[pos & sp->mask].seq, __ATOMIC_ACQUIRE);
+      // cell still holds an item a lap behind: full
+      if ((long)(seq - pos) < 0) return 0;
+      // another producer moved on, catch up
+      pos = __atomic_load_n(&sp->tail, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&sp->tail, &pos, pos + got, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+  }
+  for(i = 0; i < got; i++) {
+    sp->buf[(pos + i) & sp->mask].fd = fds[i];
+    sp->buf[(pos + i) & sp->mask].stamp = stamp;
+    PROBE2(enqueue, fds[i], pos + i - __atomic_load_n(&sp->head, __ATOMIC_RELAXED));
+    __atomic_store_n(&sp->buf[(pos + i) & sp->mask].seq, pos + i + 1, __ATOMIC_RELEASE);
+  }
+  return got;
+}
+
+// claim up to n full cells at the head and empty them, never blocks.
+// stamps, if given, get when each fd was inserted.
+static int try_delete(sbuf_t *sp, int *fds, uint64_t *stamps, int n) {
+  size_t pos = __atomic_load_n(&sp->head, __ATOMIC_RELAXED), seq;
+  int i, got;
+  while(1) {
+    for(got = 0; got < n; got++) {
+      seq = __atomic_load_n(&sp->buf[(pos + got) & sp->mask].seq, __ATOMIC_ACQUIRE);
+      if (seq != pos + got + 1) break;
+    }
+    if (got == 0) {
+      seq = __atomic_load_n(&sp->buf[pos & sp->mask].seq, __ATOMIC_ACQUIRE);
+      // not filled yet: empty
+      if ((long)(seq - (pos + 1)) < 0) return 0;
+      pos = __atomic_load_n(&sp->head, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&sp->head, &pos, pos + got, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+  }
+  for(i = 0; i < got; i++) {
+    fds[i] = sp->buf[(pos + i) & sp->mask].fd;
+    if (stamps) stamps[i] = sp->buf[(pos + i) & sp->mask].stamp;
+    // when it was inserted, CLOCK_MONOTONIC ns like bpftrace's nsecs
+    PROBE2(dequeue, fds[i], sp->buf[(pos + i) & sp->mask].stamp);
+    // free for the producer one lap ahead
+    __atomic_store_n(&sp->buf[(pos + i) & sp->mask].seq, pos + i + sp->capacity, __ATOMIC_RELEASE);
+  }
+  return got;
+}
+
+// bump the futex word, wake a sleeper only if someone announced it sleeps
+static void signal_side(unsigned *word, int *waiting, int n) {
+  __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) > 0) futex_wake(word, n);
+}
+
+// Insert all n fds, sleeping while the ring is full. Returns n.
+int sbuf_insert_batch(sbuf_t *sp, int *fds, int n) {
+  int done = 0, got, spin = 0;
+  unsigned seen;
+  while(done < n) {
+    if ((got = try_insert(sp, fds + done, n - done)) > 0) {
+      done += got;
+      signal_side(&sp->items, &sp->consumers_waiting, got == 1 ? 1 : INT_MAX);
+      continue;
+    }
+    if (spin++ < SBUF_SPIN) {
+      cpu_relax();
+      continue;
+    }
+    // announce, re-check, then sleep unless a consumer bumped slots meanwhile
+    seen = __atomic_load_n(&sp->slots, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&sp->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    if ((got = try_insert(sp, fds + done, n - done)) > 0) {
+      done += got;
+      signal_side(&sp->items, &sp->consumers_waiting, got == 1 ? 1 : INT_MAX);
+    } else {
+      futex_wait(&sp->slots, seen);
+    }
+    __atomic_sub_fetch(&sp->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    spin = 0;
+  }
+  return n;
+}
+
+static int delete_batch(sbuf_t *sp, int *fds, uint64_t *stamps, int n) {
+  int got, spin = 0;
+  unsigned seen;
+  while(1) {
+    if ((got = try_delete(sp, fds, stamps, n)) > 0) break;
+    if (spin++ < SBUF_SPIN) {
+      cpu_relax();
+      continue;
+    }
+    seen = __atomic_load_n(&sp->items, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&sp->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    got = try_delete(sp, fds, stamps, n);
+    if (got == 0) futex_wait(&sp->items, seen);
+    __atomic_sub_fetch(&sp->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    if (got > 0) break;
+    spin = 0;
+  }
+  signal_side(&sp->slots, &sp->producers_waiting, got == 1 ? 1 : INT_MAX);
+  return got;
+}
+
+// Take between 1 and n fds, sleeping while the ring is empty. Returns the count.
+int sbuf_delete_batch(sbuf_t *sp, int *fds, int n) {
+  return delete_batch(sp, fds, NULL, n);
 }
 
 void sbuf_insert(sbuf_t *sp, int connfd) {
-  sem_wait(sp->slots);
-  sem_wait(sp->mutex);
-  sp->buf[sp->tail] = connfd;
-  sp->tail = (sp->tail + 1) % sp->capacity;
-  // print_sbuf("insert", sp);
-  sem_post(sp->items);
-  sem_post(sp->mutex);
+  sbuf_insert_batch(sp, &connfd, 1);
+}
+
+// Insert connfd unless the ring is full, never sleeps. Returns 1 if inserted.
+int sbuf_try_insert(sbuf_t *sp, int connfd) {
+  if (try_insert(sp, &connfd, 1) == 0) return 0;
+  signal_side(&sp->items, &sp->consumers_waiting, 1);
+  return 1;
+}
+
+// Items waiting right now, approximate while others insert or delete
+int sbuf_depth(sbuf_t *sp) {
+  size_t tail = __atomic_load_n(&sp->tail, __ATOMIC_RELAXED), head = __atomic_load_n(&sp->head, __ATOMIC_RELAXED);
+  return (long)(tail - head) > 0 ? (int)(tail - head) : 0;
 }
 
 int sbuf_delete(sbuf_t *sp) {
   int connfd;
-  sem_wait(sp->items);
-  sem_wait(sp->mutex);
-  connfd = sp->buf[sp->head];
-  sp->head = (sp->head + 1) % sp->capacity;
-  // print_sbuf("delete", sp);
-  sem_post(sp->slots);
-  sem_post(sp->mutex);
+  delete_batch(sp, &connfd, NULL, 1);
+  return connfd;
+}
+
+// sbuf_delete, also telling when the fd was inserted
+int sbuf_delete_stamped(sbuf_t *sp, uint64_t *stamp) {
+  int connfd;
+  delete_batch(sp, &connfd, stamp, 1);
   return connfd;
 }
 
@@ -40,7 +190,7 @@ void print_sbuf(char *action, sbuf_t *sp) {
   int i;
   printf("%s sbuf[", action);
   for(i = 0; i < sp->capacity; i++) {
-    printf(" %d ", sp->buf[i]);
+    printf(" %d ", sp->buf[i].fd);
   }
-  printf("], head = %d, tail = %d\n", sp->head, sp->tail);
-}
\ No newline at end of file
+  printf("], head = %zu, tail = %zu\n", sp->head, sp->tail);
+}
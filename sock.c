@@ -1,6 +1,6 @@
 #include "./inc/sock.h"
 
-int open_listenfd(int port) {
+static int bind_listenfd(int port, int reuseport, int cpu) {
   int listenfd, optval = 1;
   struct sockaddr_in server;
   if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) fatal_exit(1, "Failed create socket");
@@ -10,7 +10,27 @@ int open_listenfd(int port) {
   server.sin_addr.s_addr = htonl(INADDR_ANY);
   if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int)) < 0)
     fatal_exit(1, "Failed setsockopt");
+  if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval, sizeof(int)) < 0)
+    fatal_exit(1, "Failed setsockopt SO_REUSEPORT");
+  // kernel prefers the group member whose cpu handled the packet, best effort
+  if (cpu >= 0) setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, (const void *)&cpu, sizeof(int));
   if (bind(listenfd, (SA *)&server, sizeof(server)) < 0) fatal_exit(2, "Failed bind socket");
   if (listen(listenfd, LISTENQ) < 0) fatal_exit(3, "Failed listen");
   return listenfd;
-}
\ No newline at end of file
+}
+
+int open_listenfd(int port) {
+  return bind_listenfd(port, 0, -1);
+}
+
+// One member of a SO_REUSEPORT group, the kernel balances connections
+// across members. cpu >= 0 also steers connections arriving on that cpu.
+int open_reuseport_listenfd(int port, int cpu) {
+  return bind_listenfd(port, 1, cpu);
+}
+
+int set_nonblocking(int fd) {
+  int flags;
+  if ((flags = fcntl(fd, F_GETFL, 0)) < 0) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
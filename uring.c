@@ -0,0 +1,507 @@
+#include "./inc/uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+// Register a provided buffer ring of n entries as group URING_BGID
+static struct io_uring_buf_ring *bufring_create(int fd, unsigned n) {
+    struct io_uring_buf_reg reg;
+    void *ring = mmap(NULL, n * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) return NULL;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring;
+    reg.ring_entries = n;
+    reg.bgid = URING_BGID;
+    if (sys_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, n * sizeof(struct io_uring_buf));
+        return NULL;
+    }
+    return (struct io_uring_buf_ring *)ring;
+}
+
+// Whether this kernel runs the engine: the opcodes, waiting with a timeout
+// and provided buffer rings, which came along with multishot accept (5.19)
+int uring_probe(void) {
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_SPLICE };
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    struct io_uring_buf_ring *br = NULL;
+    size_t size = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    int fd, ret = FAILED;
+    size_t i;
+    memset(&p, 0, sizeof(p));
+    if ((fd = sys_setup(8, &p)) < 0) return FAILED;
+    if ((probe = (struct io_uring_probe *)calloc(1, size)) != NULL &&
+        sys_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 && (p.features & IORING_FEAT_EXT_ARG)) {
+        ret = OK;
+        for(i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) ret = FAILED;
+        }
+        if (ret == OK && (br = bufring_create(fd, 1)) == NULL) ret = FAILED;
+    }
+    free(probe);
+    // closing the ring unregisters the buffer ring, then it can go
+    close(fd);
+    if (br) munmap(br, sizeof(struct io_uring_buf));
+    return ret;
+}
+
+void uring_init(uring_t *lp, int id, int listenfd, server_t *app) {
+    lp->id = id;
+    lp->fd = -1;
+    lp->listenfd = listenfd;
+    lp->app = app;
+    lp->starved = NULL;
+}
+
+// hand a receive buffer back to the kernel
+static void buf_recycle(uring_t *lp, int bid) {
+    struct io_uring_buf *buf = &lp->br->bufs[lp->br_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t)(lp->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    lp->br_tail++;
+    __atomic_store_n(&lp->br->tail, lp->br_tail, __ATOMIC_RELEASE);
+}
+
+// Map the rings, provide the receive buffers and register the listen socket.
+// Runs on the loop's own thread, the only one ever to submit.
+static void ring_setup(uring_t *lp) {
+    struct io_uring_params p;
+    size_t sqsize, cqsize;
+    char *sq, *cq;
+    int i;
+    memset(&p, 0, sizeof(p));
+    // task work only runs when this thread waits, no interrupts in between
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((lp->fd = sys_setup(URING_ENTRIES, &p)) < 0) {
+        memset(&p, 0, sizeof(p));
+        if ((lp->fd = sys_setup(URING_ENTRIES, &p)) < 0) fatal_exit(1, "Failed setup io_uring");
+    }
+    sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) sqsize = cqsize = sqsize > cqsize ? sqsize : cqsize;
+    sq = (char *)mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, lp->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) fatal_exit(1, "Failed map io_uring");
+    cq = p.features & IORING_FEAT_SINGLE_MMAP ? sq :
+         (char *)mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, lp->fd, IORING_OFF_CQ_RING);
+    lp->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, lp->fd, IORING_OFF_SQES);
+    if (cq == MAP_FAILED || lp->sqes == MAP_FAILED) fatal_exit(1, "Failed map io_uring");
+    lp->sq_head = (unsigned *)(sq + p.sq_off.head);
+    lp->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    lp->sq_array = (unsigned *)(sq + p.sq_off.array);
+    lp->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    lp->sq_entries = p.sq_entries;
+    lp->sq_local = *lp->sq_tail;
+    lp->cq_head = (unsigned *)(cq + p.cq_off.head);
+    lp->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    lp->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    lp->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if ((lp->br = bufring_create(lp->fd, URING_BUFS)) == NULL) fatal_exit(1, "Failed register io_uring buffers");
+    if ((lp->bufs = (char *)malloc((size_t)URING_BUFS * URING_BUF_SIZE)) == NULL) fatal_exit(1, "Failed allocate io_uring buffers");
+    lp->br_tail = 0;
+    for(i = 0; i < URING_BUFS; i++) buf_recycle(lp, i);
+    // the listen socket is fixed file 0, accepts skip the fd table lookup
+    if (sys_register(lp->fd, IORING_REGISTER_FILES, &lp->listenfd, 1) < 0) fatal_exit(1, "Failed register listen socket");
+    lp->now = wheel_ticks();
+    wheel_init(&lp->wheel, lp->now);
+}
+
+// Publish queued entries and optionally wait for a completion, at most ticks if not 0
+static int ring_enter(uring_t *lp, int wait, unsigned long ticks) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit;
+    __atomic_store_n(lp->sq_tail, lp->sq_local, __ATOMIC_RELEASE);
+    submit = lp->sq_local - __atomic_load_n(lp->sq_head, __ATOMIC_ACQUIRE);
+    memset(&arg, 0, sizeof(arg));
+    if (wait && ticks) {
+        ts.tv_sec = ticks * WHEEL_TICK_MS / 1000;
+        ts.tv_nsec = ticks * WHEEL_TICK_MS % 1000 * 1000000;
+        arg.ts = (uintptr_t)&ts;
+    }
+    return sys_enter(lp->fd, submit, wait ? 1 : 0, (wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG,
+                     &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe *sqe_get(uring_t *lp) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+    // full: hand what is queued to the kernel first
+    while(lp->sq_local - __atomic_load_n(lp->sq_head, __ATOMIC_ACQUIRE) >= lp->sq_entries) ring_enter(lp, 0, 0);
+    idx = lp->sq_local & lp->sq_mask;
+    sqe = &lp->sqes[idx];
+    lp->sq_array[idx] = idx;
+    lp->sq_local++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static uint64_t user_data(uconn_t *u, int op) {
+    return (uint64_t)(uintptr_t)u | op;
+}
+
+static void arm_accept(uring_t *lp) {
+    struct io_uring_sqe *sqe = sqe_get(lp);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD_ACCEPT;
+}
+
+static void arm_recv(uring_t *lp, uconn_t *u) {
+    struct io_uring_sqe *sqe = sqe_get(lp);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = u->conn.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->len = URING_BUF_SIZE;
+    sqe->user_data = user_data(u, UD_RECV);
+    u->ops++;
+    u->recving = 1;
+}
+
+static void submit_send(uring_t *lp, uconn_t *u, char *buf, size_t n, int more) {
+    struct io_uring_sqe *sqe = sqe_get(lp);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = u->conn.fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = n;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    sqe->user_data = user_data(u, UD_SEND);
+    u->ops++;
+    u->writing++;
+}
+
+// the queued segments, corked when a body follows
+static void submit_sendmsg(uring_t *lp, uconn_t *u) {
+    conn_t *conn = &u->conn;
+    struct io_uring_sqe *sqe = sqe_get(lp);
+    memset(&u->msg, 0, sizeof(u->msg));
+    u->msg.msg_iov = conn->iov + conn->iovsent;
+    u->msg.msg_iovlen = conn->niov - conn->iovsent;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)&u->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (conn->pending ? MSG_MORE : 0);
+    sqe->user_data = user_data(u, UD_SEND);
+    u->ops++;
+    u->writing++;
+}
+
+static void splice_sqe(struct io_uring_sqe *sqe, int in, uint64_t offin, int out, size_t n) {
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = in;
+    sqe->splice_off_in = offin;
+    sqe->fd = out;
+    sqe->off = (uint64_t)-1;
+    sqe->len = n;
+}
+
+// what the pipe holds, out to the socket
+static void submit_splice_out(uring_t *lp, uconn_t *u) {
+    struct io_uring_sqe *sqe = sqe_get(lp);
+    splice_sqe(sqe, u->pipe[0], (uint64_t)-1, u->conn.fd, u->inpipe);
+    sqe->user_data = user_data(u, UD_SPLICE_OUT);
+    u->ops++;
+    u->writing++;
+}
+
+// A chunk of file body: into the pipe, and linked to it, out to the socket.
+// The pipe is empty and the chunk fits, so the first half never blocks; if
+// it comes up short the link breaks and the rest is sent on its own.
+static int submit_splice(uring_t *lp, uconn_t *u, off_t offset, size_t n) {
+    struct io_uring_sqe *sqe;
+    int size;
+    if (u->pipe[0] < 0) {
+        if (pipe2(u->pipe, O_CLOEXEC) < 0) return FAILED;
+        fcntl(u->pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+        u->pipesz = (size = fcntl(u->pipe[1], F_GETPIPE_SZ)) > 0 ? (size_t)size : 4096;
+    }
+    if (n > u->pipesz) n = u->pipesz;
+    sqe = sqe_get(lp);
+    splice_sqe(sqe, u->conn.res.fd, offset, u->pipe[1], n);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = user_data(u, UD_SPLICE_IN);
+    sqe = sqe_get(lp);
+    splice_sqe(sqe, u->pipe[0], (uint64_t)-1, u->conn.fd, n);
+    sqe->user_data = user_data(u, UD_SPLICE_OUT);
+    u->ops += 2;
+    u->writing += 2;
+    return OK;
+}
+
+// Next piece of the pending body, the same walk conn_flush does with
+// sendfile. Returns 1 once submitted, 0 when the body is out, FAILED.
+static int submit_body(uring_t *lp, uconn_t *u) {
+    conn_t *conn = &u->conn;
+    res_t *res = &conn->res;
+    range_t *part;
+    size_t done;
+    if (u->inpipe) {
+        submit_splice_out(lp, u);
+        return 1;
+    }
+    if (!res->nranges) {
+        if (conn->bodysent >= res->length) return 0;
+        return submit_splice(lp, u, res->offset + conn->bodysent, res->length - conn->bodysent) == OK ? 1 : FAILED;
+    }
+    while(conn->part <= res->nranges) {
+        part = &res->ranges[conn->part];
+        if (conn->bodysent < part->headlen) {
+            submit_send(lp, u, part->head + conn->bodysent, part->headlen - conn->bodysent, conn->part < res->nranges);
+            return 1;
+        }
+        if ((done = conn->bodysent - part->headlen) < part->len) {
+            if (res->fd >= 0) return submit_splice(lp, u, part->start + done, part->len - done) == OK ? 1 : FAILED;
+            submit_send(lp, u, res->body + part->start + done, part->len - done, 1);
+            return 1;
+        }
+        conn->part++;
+        conn->bodysent = 0;
+    }
+    return 0;
+}
+
+// Shut the connection down. Whatever is in flight completes with an error
+// or end of file, the memory goes once the last completion is in.
+static void uconn_close(uring_t *lp, uconn_t *u) {
+    if (u->closing) return;
+    u->closing = 1;
+    wheel_cancel(&lp->wheel, &u->conn.timer);
+    shutdown(u->conn.fd, SHUT_RDWR);
+    if (u->spilllen) {
+        buf_recycle(lp, u->spillbid);
+        u->spilllen = 0;
+    }
+}
+
+static void uconn_release(uconn_t *u) {
+    if (!u->closing || u->ops) return;
+    conn_close(&u->conn);
+    if (u->pipe[0] >= 0) {
+        close(u->pipe[0]);
+        close(u->pipe[1]);
+    }
+    free(u);
+}
+
+// move as much spilled input into rio as fits, compacting it first like rio_fill
+static void take_spill(uring_t *lp, uconn_t *u) {
+    rio_t *rp = &u->conn.rio;
+    size_t n;
+    if (!u->spilllen) return;
+    if (rp->cursor != rp->buf) {
+        if (rp->unread > 0) memmove(rp->buf, rp->cursor, rp->unread);
+        rp->cursor = rp->buf;
+    }
+    n = sizeof(rp->buf) - rp->unread;
+    if (n > u->spilllen) n = u->spilllen;
+    memcpy(rp->buf + rp->unread, u->spill, n);
+    rp->unread += n;
+    u->spill += n;
+    if ((u->spilllen -= n) == 0) buf_recycle(lp, u->spillbid);
+}
+
+// Drive the connection as far as it goes without waiting: answer what is
+// buffered, submit the next write or arm a receive. Like conn_drive, with
+// completions in place of readiness.
+static void uconn_pump(uring_t *lp, uconn_t *u) {
+    conn_t *conn = &u->conn;
+    int ret;
+    if (u->closing || u->writing) return;
+    while(1) {
+        if (conn->state == CONN_WRITE) {
+            if (conn->iovsent < conn->niov) {
+                submit_sendmsg(lp, u);
+                return;
+            }
+            if (conn->pending && (ret = submit_body(lp, u)) != 0) {
+                if (ret == 1) return;
+                conn->state = CONN_CLOSE;
+                continue;
+            }
+            conn_sent(conn);
+            continue;
+        }
+        if (conn->state != CONN_READ) {
+            uconn_close(lp, u);
+            return;
+        }
+        take_spill(lp, u);
+        if (conn_process(lp->app, conn)) continue;
+        if (conn->rio.unread >= (int)sizeof(conn->rio.buf)) {
+            conn_overflow(conn);
+            continue;
+        }
+        if (!u->recving) arm_recv(lp, u);
+        return;
+    }
+}
+
+static void uring_expired(wtimer_t *timer, void *arg) {
+    conn_t *conn = (conn_t *)((char *)timer - offsetof(conn_t, timer));
+    conn_timed_out(conn);
+    uconn_close((uring_t *)arg, (uconn_t *)conn);
+}
+
+static void uring_accepted(uring_t *lp, struct io_uring_cqe *cqe) {
+    struct sockaddr_in peer;
+    socklen_t peerlen = sizeof(peer);
+    uconn_t *u;
+    int connfd = cqe->res;
+    // the multishot accept stopped, on an error or a full completion queue
+    if (!(cqe->flags & IORING_CQE_F_MORE)) arm_accept(lp);
+    if (connfd < 0) {
+        if (connfd != -EINTR && connfd != -ECONNABORTED) {
+            errno = -connfd;
+            perror("accept");
+        }
+        return;
+    }
+    PROBE1(accept, connfd);
+    if (conn_admit(lp->app) != OK) {
+        conn_shed(connfd);
+        return;
+    }
+    if ((u = (uconn_t *)malloc(sizeof(uconn_t))) == NULL) {
+        close(connfd);
+        return;
+    }
+    conn_init(&u->conn, connfd);
+    if (accesslog_enabled() && getpeername(connfd, (SA *)&peer, &peerlen) == 0) u->conn.peer = peer.sin_addr;
+    u->ops = u->recving = u->writing = u->closing = 0;
+    u->spill = NULL;
+    u->spilllen = 0;
+    u->pipe[0] = u->pipe[1] = -1;
+    u->pipesz = u->inpipe = 0;
+    u->starved = NULL;
+    arm_recv(lp, u);
+    conn_deadline(lp->app, &lp->wheel, &u->conn, lp->now);
+}
+
+static void uring_received(uring_t *lp, uconn_t *u, struct io_uring_cqe *cqe) {
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    u->recving = 0;
+    if (u->closing) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) buf_recycle(lp, bid);
+        return;
+    }
+    if (cqe->res == -ENOBUFS) {
+        // every buffer is taken, retried after this batch; counts as in flight meanwhile
+        u->ops++;
+        u->starved = lp->starved;
+        lp->starved = u;
+        return;
+    }
+    if (cqe->res <= 0) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) buf_recycle(lp, bid);
+        if (cqe->res < 0) METRIC_ADD(errors, 1);
+        uconn_close(lp, u);
+        return;
+    }
+    u->spill = lp->bufs + (size_t)bid * URING_BUF_SIZE;
+    u->spilllen = cqe->res;
+    u->spillbid = bid;
+}
+
+static void uring_written(uring_t *lp, uconn_t *u, struct io_uring_cqe *cqe, int op) {
+    conn_t *conn = &u->conn;
+    int n = cqe->res;
+    u->writing--;
+    if (u->closing) return;
+    // a short splice into the pipe broke the link, what did get in is sent next
+    if (op == UD_SPLICE_OUT && n == -ECANCELED) return;
+    if (n <= 0) {
+        // n == 0 reading the file: it shrank, Content-Length can't be honored anymore
+        if (n < 0) METRIC_ADD(errors, 1);
+        uconn_close(lp, u);
+        return;
+    }
+    if (op == UD_SPLICE_IN) {
+        u->inpipe += n;
+        return;
+    }
+    conn_wrote(conn, n);
+    if (op == UD_SPLICE_OUT) {
+        u->inpipe -= n;
+        conn->bodysent += n;
+    } else if (conn->iovsent < conn->niov) {
+        conn_advance(conn, n);
+    } else {
+        conn->bodysent += n;
+    }
+}
+
+static void uring_complete(uring_t *lp, struct io_uring_cqe *cqe) {
+    uconn_t *u = (uconn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)UD_MASK);
+    int op = cqe->user_data & UD_MASK;
+    if (!u) {
+        uring_accepted(lp, cqe);
+        return;
+    }
+    u->ops--;
+    if (op == UD_RECV) uring_received(lp, u, cqe);
+    else uring_written(lp, u, cqe, op);
+    if (u->closing) {
+        uconn_release(u);
+        return;
+    }
+    uconn_pump(lp, u);
+    if (!u->closing) conn_deadline(lp->app, &lp->wheel, &u->conn, lp->now);
+    else uconn_release(u);
+}
+
+// receives that found no buffer get another try
+static void retry_starved(uring_t *lp) {
+    uconn_t *u, *next;
+    for(u = lp->starved, lp->starved = NULL; u; u = next) {
+        next = u->starved;
+        u->starved = NULL;
+        u->ops--;
+        if (u->closing) uconn_release(u);
+        else arm_recv(lp, u);
+    }
+}
+
+void *uring_run(void *arg) {
+    uring_t *lp = (uring_t *)arg;
+    struct io_uring_cqe cqe;
+    unsigned head;
+    if (lp->app->pin) pin_cpu(lp->id);
+    ring_setup(lp);
+    arm_accept(lp);
+    while(1) {
+        // with deadlines armed or receives to retry, wake up every tick
+        if (ring_enter(lp, 1, lp->wheel.count || lp->starved ? 1 : 0) < 0 &&
+            errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+            fatal_exit(3, "Failed enter io_uring");
+        }
+        lp->now = wheel_ticks();
+        head = *lp->cq_head;
+        while(head != __atomic_load_n(lp->cq_tail, __ATOMIC_ACQUIRE)) {
+            // copied out and released first, handling it may submit
+            cqe = lp->cqes[head & lp->cq_mask];
+            __atomic_store_n(lp->cq_head, ++head, __ATOMIC_RELEASE);
+            uring_complete(lp, &cqe);
+        }
+        wheel_advance(&lp->wheel, lp->now, uring_expired, lp);
+        retry_starved(lp);
+    }
+    return NULL;
+}
@@ -3,4 +3,32 @@
 void fatal_exit(int code, char *msg) {
   fprintf(stderr, "[fatal] %s\n", msg);
   exit(code);
-}
\ No newline at end of file
+}
+
+// "64M" style sizes, K/M/G suffixes are powers of 1024
+size_t parse_size(const char *s) {
+  char *end;
+  size_t n = strtoull(s, &end, 10);
+  switch(*end) {
+    case 'g': case 'G': n <<= 10; // fall through
+    case 'm': case 'M': n <<= 10; // fall through
+    case 'k': case 'K': n <<= 10;
+  }
+  return n;
+}
+
+// pin calling thread to cpu, wrapping around the online cpus
+int pin_cpu(int cpu) {
+  cpu_set_t set;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  CPU_ZERO(&set);
+  CPU_SET(cpu % (ncpu > 0 ? ncpu : 1), &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// monotonic nanoseconds, a vDSO call with no syscall
+uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,85 @@
+#include "./inc/wheel.h"
+
+// monotonic clock in ticks, immune to wall clock jumps
+unsigned long wheel_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / WHEEL_TICK_MS;
+}
+
+void wheel_init(wheel_t *wp, unsigned long now) {
+    int level, i;
+    wp->now = now;
+    wp->count = 0;
+    for(level = 0; level < WHEEL_LEVELS; level++) {
+        for(i = 0; i < WHEEL_SIZE; i++) {
+            wp->slots[level][i].prev = wp->slots[level][i].next = &wp->slots[level][i];
+        }
+    }
+}
+
+// put t in the slot for its expiry, relative to wp->now
+static void wheel_insert(wheel_t *wp, wtimer_t *t) {
+    unsigned long delta = t->expires > wp->now ? t->expires - wp->now : 1;
+    int level = 0;
+    wtimer_t *head;
+    while(level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))) level++;
+    // too far out, parked at the farthest slot and re-cascaded from there
+    if (delta >= (1UL << (WHEEL_BITS * WHEEL_LEVELS))) t->expires = wp->now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (t->expires <= wp->now) t->expires = wp->now + 1;
+    head = &wp->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+// (Re)arm t to fire at tick expires
+void wheel_arm(wheel_t *wp, wtimer_t *t, unsigned long expires) {
+    wheel_cancel(wp, t);
+    t->expires = expires;
+    wheel_insert(wp, t);
+    wp->count++;
+}
+
+// Disarm t, harmless if it isn't armed
+void wheel_cancel(wheel_t *wp, wtimer_t *t) {
+    if (!t->next) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    wp->count--;
+}
+
+// move every timer of a higher level slot down to where it belongs now
+static void cascade(wheel_t *wp, int level) {
+    wtimer_t *head = &wp->slots[level][(wp->now >> (WHEEL_BITS * level)) & WHEEL_MASK], *t;
+    while((t = head->next) != head) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        wheel_insert(wp, t);
+    }
+}
+
+// Run time forward to tick now, calling fn on every timer that expires.
+// fn gets a disarmed timer and may arm or cancel any timer.
+void wheel_advance(wheel_t *wp, unsigned long now, expire_fn fn, void *arg) {
+    wtimer_t *head, *t;
+    int level;
+    while(wp->now < now) {
+        wp->now++;
+        // at each wrap of a level, the next level's current slot comes due
+        for(level = 1; level < WHEEL_LEVELS && !(wp->now & ((1UL << (WHEEL_BITS * level)) - 1)); level++) {
+            cascade(wp, level);
+        }
+        head = &wp->slots[0][wp->now & WHEEL_MASK];
+        while((t = head->next) != head) {
+            wheel_cancel(wp, t);
+            fn(t, arg);
+        }
+        if (!wp->count) {
+            // nothing to walk through, jump
+            wp->now = now;
+        }
+    }
+}